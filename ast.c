@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "malloc_safe.h"
+#include "values.h"
 
 static NilLiteral preallocated_nil_literal;
 static BooleanLiteral preallocated_true_literal;
@@ -21,9 +22,9 @@ void initialize_preallocated_literals() {
   preallocated_true_literal.value = 1;
   preallocated_false_literal.base.stmt.kind = BooleanLiteralAst;
   preallocated_false_literal.value = 0;
-  for (short int i = -1; i < 255; i++) {
+  for (short int i = 0; i < 256; i++) {
     preallocated_numeric_literals[i].base.stmt.kind = NumericLiteralAst;
-    preallocated_numeric_literals[i].value = (1 + i) * 1.0;
+    preallocated_numeric_literals[i].value = i * 1.0;
   }
   numeric_literals_initialized = 1;
 }
@@ -44,6 +45,7 @@ VarDeclaration *create_var_expr(const char *varname, Expr *value) {
   var_expr->base.stmt.kind = VarDeclarationAst;
   var_expr->varname = strdup(varname);
   var_expr->value = value;
+  var_expr->slot = -1;
   return var_expr;
 }
 
@@ -53,6 +55,8 @@ AssignVar *assign_var_expr(const char *varname, Expr *value) {
   var_expr->base.stmt.kind = AssignVarAst;
   var_expr->varname = strdup(varname);
   var_expr->value = value;
+  var_expr->depth = -1;
+  var_expr->slot = -1;
   return var_expr;
 }
 
@@ -63,6 +67,8 @@ AssignListVar *assign_list_expr(const char *varname, Expr *index, Expr *value) {
   var_expr->varname = strdup(varname);
   var_expr->index = index;
   var_expr->value = value;
+  var_expr->depth = -1;
+  var_expr->slot = -1;
   return var_expr;
 }
 
@@ -73,6 +79,8 @@ AssignDictVar *assign_dict_expr(const char *varname, Expr *key, Expr *value) {
   var_expr->varname = strdup(varname);
   var_expr->key = key;
   var_expr->value = value;
+  var_expr->depth = -1;
+  var_expr->slot = -1;
   return var_expr;
 }
 
@@ -82,30 +90,83 @@ UnaryExpr *create_unary_expr(const char *operator, Expr * expr) {
   unary_expr->base.stmt.kind = UnaryExprAst;
   unary_expr->operator= strdup(operator);
   unary_expr->expr = expr;
+  unary_expr->number_operand = 0;
   return unary_expr;
 }
 
-BinaryExpr *create_binary_expr(Expr *left, Expr *right, const char *operator) {
+static const char *binary_operator_symbols[] = {
+#define BINARY_OPERATOR_SYMBOL(name, symbol) symbol,
+    BINARY_OPERATOR_LIST(BINARY_OPERATOR_SYMBOL)
+#undef BINARY_OPERATOR_SYMBOL
+};
+
+// Returns BINARY_OPERATOR_COUNT when the symbol is not a binary operator.
+BinaryOperator binary_operator_from_string(const char *symbol) {
+  for (int i = 0; i < BINARY_OPERATOR_COUNT; i++) {
+    if (strcmp(binary_operator_symbols[i], symbol) == 0) {
+      return (BinaryOperator)i;
+    }
+  }
+  return BINARY_OPERATOR_COUNT;
+}
+
+const char *binary_operator_to_string(BinaryOperator operator) {
+  return binary_operator_symbols[operator];
+}
+
+BinaryExpr *create_binary_expr(Expr *left, Expr *right,
+                               BinaryOperator operator) {
   BinaryExpr *binary_expr =
       (BinaryExpr *)malloc_safe(sizeof(BinaryExpr), "BinaryExpr");
   binary_expr->base.stmt.kind = BinaryExprAst;
   binary_expr->left = left;
   binary_expr->right = right;
   binary_expr->operator= operator;
+  binary_expr->specialization = SPECIALIZE_PENDING;
+  binary_expr->invariant = 0;
+  binary_expr->invariant_epoch = 0;
   return binary_expr;
 }
 
+LogicalExpr *create_logical_expr(Expr *left, Expr *right,
+                                 BinaryOperator operator) {
+  LogicalExpr *logical_expr =
+      (LogicalExpr *)malloc_safe(sizeof(LogicalExpr), "LogicalExpr");
+  logical_expr->base.stmt.kind = LogicalExprAst;
+  logical_expr->left = left;
+  logical_expr->right = right;
+  logical_expr->operator= operator;
+  return logical_expr;
+}
+
+JumpExpr *create_jump_expr(NodeType kind) {
+  JumpExpr *jump_expr = (JumpExpr *)malloc_safe(sizeof(JumpExpr), "JumpExpr");
+  jump_expr->base.stmt.kind = kind;
+  return jump_expr;
+}
+
+ReturnExpr *create_return_expr(Expr *value) {
+  ReturnExpr *return_expr =
+      (ReturnExpr *)malloc_safe(sizeof(ReturnExpr), "ReturnExpr");
+  return_expr->base.stmt.kind = ReturnAst;
+  return_expr->value = value;
+  return return_expr;
+}
+
 Identifier *create_identifier(const char *symbol) {
   Identifier *identifier =
       (Identifier *)malloc_safe(sizeof(Identifier), "Identifier");
   identifier->base.stmt.kind = IdentifierAst;
   identifier->symbol = strdup(symbol);
+  identifier->depth = -1;
+  identifier->slot = -1;
+  identifier->name_id = -1;
   return identifier;
 }
 
 NumericLiteral *create_numeric_literal(double value) {
   if (value == floor(value) && value >= 0 && value <= 255) {
-    return &preallocated_numeric_literals[(int)value - 1];
+    return &preallocated_numeric_literals[(int)value];
   }
   NumericLiteral *numeric_literal =
       (NumericLiteral *)malloc_safe(sizeof(NumericLiteral), "NumericLiteral");
@@ -119,6 +180,7 @@ StringLiteral *create_string_literal(const char *value) {
       (StringLiteral *)malloc_safe(sizeof(StringLiteral), "StringLiteral");
   str_literal->base.stmt.kind = StringLiteralAst;
   str_literal->value = strdup(value);
+  str_literal->constant = NULL;
   return str_literal;
 }
 
@@ -139,6 +201,9 @@ WhileExpr *create_while(Expr *condition, Stmt **body, size_t body_count) {
   while_expr->condition = condition;
   while_expr->body = body;
   while_expr->body_count = body_count;
+  while_expr->has_scope = 1;
+  while_expr->slot_count = 0;
+  while_expr->boolean_condition = 0;
   return while_expr;
 }
 
@@ -152,6 +217,11 @@ IfExpr *create_if(Expr *condition, Stmt **body, size_t body_count,
   if_expr->else_if = (struct IfExpr *)else_if;
   if_expr->else_body = else_body;
   if_expr->else_body_count = else_body_count;
+  if_expr->has_scope = 1;
+  if_expr->else_has_scope = 1;
+  if_expr->slot_count = 0;
+  if_expr->else_slot_count = 0;
+  if_expr->boolean_condition = 0;
   return if_expr;
 }
 
@@ -164,6 +234,14 @@ ForExpr *create_for_expr(Expr *initialization, Expr *condition, Expr *increment,
   for_expr->increment = increment;
   for_expr->body = body;
   for_expr->body_count = body_count;
+  for_expr->has_scope = 1;
+  for_expr->body_has_scope = 1;
+  for_expr->slot_count = 0;
+  for_expr->body_slot_count = 0;
+  for_expr->counted = 0;
+  for_expr->step = 0;
+  for_expr->bound_invariant = 0;
+  for_expr->boolean_condition = 0;
   return for_expr;
 }
 
@@ -176,6 +254,13 @@ FuncDef *create_func_def(char *name, char **params, size_t param_count,
   func_def->param_count = param_count;
   func_def->body = body;
   func_def->body_count = body_count;
+  func_def->slot = -1;
+  func_def->slot_count = param_count;
+  func_def->flat = 0;
+  func_def->scope_depth = 0;
+  func_def->captures = NULL;
+  func_def->capture_count = 0;
+  func_def->region = 0;
   return func_def;
 }
 
@@ -185,6 +270,11 @@ CallExpr *create_call_expr(Expr *callee, Expr **arguments, size_t arg_count) {
   call_expr->callee = callee;
   call_expr->arguments = arguments;
   call_expr->arg_count = arg_count;
+  call_expr->callee_cache = (VarCache){0};
+  call_expr->checked_callee = NULL;
+  call_expr->callee_version = 0;
+  call_expr->intrinsic = 0;
+  call_expr->is_tail = 0;
   return call_expr;
 }
 
@@ -214,6 +304,7 @@ ListIndex *create_list_index(Expr *list, Expr *start, Expr *end,
   list_index->start = start;
   list_index->end = end;
   list_index->is_slice = is_slice;
+  list_index->specialization = SPECIALIZE_PENDING;
   return list_index;
 }
 
@@ -237,6 +328,121 @@ TableLiteral *create_table_literal(char **columns, size_t column_count) {
   return table;
 }
 
+void visit_block(Stmt **body, size_t body_count, NodeVisitor visit,
+                 void *context) {
+  for (size_t i = 0; i < body_count; i++) {
+    visit(body[i], context);
+  }
+}
+
+void visit_children(Stmt *node, NodeVisitor visit, void *context) {
+  switch (node->kind) {
+  case UnaryExprAst:
+    visit(&(((UnaryExpr *)node)->expr->stmt), context);
+    break;
+  case BinaryExprAst:
+    visit(&(((BinaryExpr *)node)->left->stmt), context);
+    visit(&(((BinaryExpr *)node)->right->stmt), context);
+    break;
+  case LogicalExprAst:
+    visit(&(((LogicalExpr *)node)->left->stmt), context);
+    visit(&(((LogicalExpr *)node)->right->stmt), context);
+    break;
+  case VarDeclarationAst:
+    visit(&(((VarDeclaration *)node)->value->stmt), context);
+    break;
+  case AssignVarAst:
+    visit(&(((AssignVar *)node)->value->stmt), context);
+    break;
+  case AssignListVarAst:
+    visit(&(((AssignListVar *)node)->value->stmt), context);
+    visit(&(((AssignListVar *)node)->index->stmt), context);
+    break;
+  case AssignDictVarAst:
+    visit(&(((AssignDictVar *)node)->value->stmt), context);
+    visit(&(((AssignDictVar *)node)->key->stmt), context);
+    break;
+  case IfAst: {
+    IfExpr *if_expr = (IfExpr *)node;
+    visit(&(if_expr->condition->stmt), context);
+    visit_block(if_expr->body, if_expr->body_count, visit, context);
+    if (if_expr->else_if != NULL) {
+      visit((Stmt *)if_expr->else_if, context);
+    }
+    visit_block(if_expr->else_body, if_expr->else_body_count, visit, context);
+    break;
+  }
+  case WhileAst: {
+    WhileExpr *while_expr = (WhileExpr *)node;
+    visit(&(while_expr->condition->stmt), context);
+    visit_block(while_expr->body, while_expr->body_count, visit, context);
+    break;
+  }
+  case ForAst: {
+    ForExpr *for_expr = (ForExpr *)node;
+    visit(&(for_expr->initialization->stmt), context);
+    visit(&(for_expr->condition->stmt), context);
+    visit(&(for_expr->increment->stmt), context);
+    visit_block(for_expr->body, for_expr->body_count, visit, context);
+    break;
+  }
+  case FuncDefAst:
+    visit_block(((FuncDef *)node)->body, ((FuncDef *)node)->body_count, visit,
+                context);
+    break;
+  case CallExprAst: {
+    CallExpr *call_expr = (CallExpr *)node;
+    visit(&(call_expr->callee->stmt), context);
+    for (size_t i = 0; i < call_expr->arg_count; i++) {
+      visit(&(call_expr->arguments[i]->stmt), context);
+    }
+    break;
+  }
+  case ListLiteralAst: {
+    ListLiteral *list_lit = (ListLiteral *)node;
+    for (size_t i = 0; i < list_lit->element_count; i++) {
+      visit(&(list_lit->elements[i]->stmt), context);
+    }
+    break;
+  }
+  case DictLiteralAst: {
+    DictLiteral *dict_lit = (DictLiteral *)node;
+    for (size_t i = 0; i < dict_lit->element_count; i++) {
+      visit(&(dict_lit->keys[i]->stmt), context);
+      visit(&(dict_lit->values[i]->stmt), context);
+    }
+    break;
+  }
+  case ListIndexAst: {
+    ListIndex *list_index = (ListIndex *)node;
+    visit(&(list_index->list->stmt), context);
+    visit(&(list_index->start->stmt), context);
+    if (list_index->is_slice && list_index->end != NULL) {
+      visit(&(list_index->end->stmt), context);
+    }
+    break;
+  }
+  case DictKeyAst:
+    visit(&(((DictKey *)node)->dict->stmt), context);
+    visit(&(((DictKey *)node)->key->stmt), context);
+    break;
+  case ReturnAst:
+    visit(&(((ReturnExpr *)node)->value->stmt), context);
+    break;
+  default:
+    break;
+  }
+}
+
+// The shared constant may outlive the node (a REPL variable can hold it), so
+// it is only handed back to the collector.
+static void release_string_literal(StringLiteral *str_literal) {
+  if (str_literal->constant != NULL) {
+    str_literal->constant->pinned = 0;
+  }
+  free_safe(str_literal->value);
+}
+
 void free_expr(Expr *expr) {
   if (!expr)
     return;
@@ -244,7 +450,7 @@ void free_expr(Expr *expr) {
   switch (expr->stmt.kind) {
   case StringLiteralAst: {
     StringLiteral *str_literal = (StringLiteral *)expr;
-    free_safe(str_literal->value);
+    release_string_literal(str_literal);
     free_safe(str_literal);
     break;
   }
@@ -276,6 +482,24 @@ void free_expr(Expr *expr) {
     free_safe(binary_expr);
     break;
   }
+  case LogicalExprAst: {
+    LogicalExpr *logical_expr = (LogicalExpr *)expr;
+    free_expr(logical_expr->left);
+    free_expr(logical_expr->right);
+    free_safe(logical_expr);
+    break;
+  }
+  case BreakAst:
+  case ContinueAst: {
+    free_safe(expr);
+    break;
+  }
+  case ReturnAst: {
+    ReturnExpr *return_expr = (ReturnExpr *)expr;
+    free_expr(return_expr->value);
+    free_safe(return_expr);
+    break;
+  }
   case ListLiteralAst: {
     ListLiteral *list_literal = (ListLiteral *)expr;
     for (size_t i = 0; i < list_literal->element_count; i++) {
@@ -312,8 +536,16 @@ void free_expr(Expr *expr) {
   }
 }
 
+static short int is_preallocated_literal(Stmt *stmt) {
+  return stmt == (Stmt *)&preallocated_nil_literal ||
+         stmt == (Stmt *)&preallocated_true_literal ||
+         stmt == (Stmt *)&preallocated_false_literal ||
+         (stmt >= (Stmt *)&preallocated_numeric_literals[0] &&
+          stmt <= (Stmt *)&preallocated_numeric_literals[255]);
+}
+
 void free_stmt(Stmt *stmt) {
-  if (!stmt)
+  if (!stmt || is_preallocated_literal(stmt))
     return;
 
   switch (stmt->kind) {
@@ -344,6 +576,16 @@ void free_stmt(Stmt *stmt) {
     free_expr(binary_expr->right);
     break;
   }
+  case LogicalExprAst: {
+    LogicalExpr *logical_expr = (LogicalExpr *)stmt;
+    free_expr(logical_expr->left);
+    free_expr(logical_expr->right);
+    break;
+  }
+  case ReturnAst: {
+    free_expr(((ReturnExpr *)stmt)->value);
+    break;
+  }
   case ListLiteralAst: {
     ListLiteral *list_literal = (ListLiteral *)stmt;
     for (size_t i = 0; i < list_literal->element_count; i++) {
@@ -364,6 +606,16 @@ void free_stmt(Stmt *stmt) {
   }
   case NilAst:
     break;
+  case StringLiteralAst: {
+    release_string_literal((StringLiteral *)stmt);
+    break;
+  }
+  case UnaryExprAst: {
+    UnaryExpr *unary_expr = (UnaryExpr *)stmt;
+    free_safe((char *)unary_expr->operator);
+    free_expr(unary_expr->expr);
+    break;
+  }
   case CallExprAst: {
     CallExpr *call_expr = (CallExpr *)stmt;
     free_expr(call_expr->callee);
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 
 #ifndef AST_H
 #define AST_H
@@ -7,6 +8,8 @@ struct Expr;
 struct Stmt;
 struct Program;
 struct IfExpr;
+struct Environment;
+struct RuntimeVal;
 
 typedef enum {
   ProgramAst,         // 0
@@ -31,13 +34,71 @@ typedef enum {
   AssignListVarAst,   // 19
   AssignDictVarAst,   // 20
   TableLiteralAst,    // 21
-  ImportAst           // 22
+  ImportAst,          // 22
+  LogicalExprAst,     // 23
+  BreakAst,           // 24
+  ContinueAst,        // 25
+  ReturnAst           // 26
 } NodeType;
 
+// Binary operators are resolved once by the parser; the evaluator and the VM
+// only ever see the enum.
+#define BINARY_OPERATOR_LIST(X) \
+  X(BIN_ADD, "+")               \
+  X(BIN_SUB, "-")               \
+  X(BIN_MUL, "*")               \
+  X(BIN_DIV, "/")               \
+  X(BIN_MOD, "%")               \
+  X(BIN_POW, "**")              \
+  X(BIN_GT, ">")                \
+  X(BIN_GE, ">=")               \
+  X(BIN_LT, "<")                \
+  X(BIN_LE, "<=")               \
+  X(BIN_EQ, "==")               \
+  X(BIN_NE, "!=")               \
+  X(BIN_AND, "&&")              \
+  X(BIN_OR, "||")               \
+  X(BIN_BIT_AND, "&")           \
+  X(BIN_BIT_OR, "|")            \
+  X(BIN_BIT_XOR, "^")           \
+  X(BIN_SHL, "<<")              \
+  X(BIN_SHR, ">>")              \
+  X(BIN_EACH_ADD, "&+")         \
+  X(BIN_EACH_SUB, "&-")         \
+  X(BIN_EACH_MUL, "&*")         \
+  X(BIN_EACH_DIV, "&/")         \
+  X(BIN_EACH_MOD, "&%")         \
+  X(BIN_EACH_POW, "&**")        \
+  X(BIN_EACH_SHL, "&<<")        \
+  X(BIN_EACH_SHR, "&>>")        \
+  X(BIN_EACH_AND, "&e")         \
+  X(BIN_EACH_OR, "&|")
+
+typedef enum {
+#define BINARY_OPERATOR_ENUM(name, symbol) name,
+  BINARY_OPERATOR_LIST(BINARY_OPERATOR_ENUM)
+#undef BINARY_OPERATOR_ENUM
+  BINARY_OPERATOR_COUNT
+} BinaryOperator;
+
 typedef struct Stmt {
   NodeType kind;
 } Stmt;
 
+// The tree walker (eval.c) specializes a node on its first evaluation when
+// the operands have the types of a fast path, and keeps its guard checking
+// them afterwards. Once the guard fails the node stays generic. The PROVEN_
+// kinds are set by type inference (infer.c) when the operands can have no
+// other type, and check no guard.
+typedef enum {
+  SPECIALIZE_PENDING,
+  SPECIALIZED_NUMBERS,     // BinaryExpr on two numbers
+  SPECIALIZED_LIST_INDEX,  // ListIndex of a list by a number
+  SPECIALIZE_GENERIC,
+  PROVEN_NUMBERS,
+  PROVEN_LIST_INDEX
+} Specialization;
+
 typedef struct {
   Stmt base;
   Stmt **body;
@@ -48,22 +109,58 @@ typedef struct {
   Stmt stmt;
 } Expr;
 
+// number_operand is set by type inference (infer.c) when the operand is
+// always a number.
 typedef struct {
   Expr base;
   const char *operator;
   Expr *expr;
+  int number_operand;
 } UnaryExpr;
 
 typedef struct {
   Expr base;
   Expr *left;
   Expr *right;
-  const char *operator;
+  BinaryOperator operator;
+  Specialization specialization;
+  // Set by the resolver inside '@' bodies that cannot change the operands;
+  // the tree walker then computes the value once per loop run.
+  int invariant;
+  uint64_t invariant_value;
+  unsigned long invariant_epoch;
 } BinaryExpr;
 
+// `&&` and `||` (operator BIN_AND or BIN_OR): the right operand is only
+// evaluated when the left one does not decide the result.
+typedef struct {
+  Expr base;
+  Expr *left;
+  Expr *right;
+  BinaryOperator operator;
+} LogicalExpr;
+
+// `break` (BreakAst) or `continue` (ContinueAst) of the innermost loop.
+typedef struct {
+  Expr base;
+} JumpExpr;
+
+// `return`, with a nil value when none is given.
+typedef struct {
+  Expr base;
+  Expr *value;
+} ReturnExpr;
+
+// depth/slot are filled in by the resolver (resolver.c): the variable lives in
+// slot `slot` of the environment `depth` levels up. A slot of -1 means the
+// name is looked up dynamically (globals, module scope, the REPL); its
+// interned id (intern_name) is then kept in name_id.
 typedef struct {
   Expr base;
   char *symbol;
+  int depth;
+  int slot;
+  int name_id;
 } Identifier;
 
 typedef struct {
@@ -71,9 +168,12 @@ typedef struct {
   double value;
 } NumericLiteral;
 
+// constant is the string every evaluation returns, once the optimizer has
+// made one (optimizer.c).
 typedef struct {
   Expr base;
   char *value;
+  struct RuntimeVal *constant;
 } StringLiteral;
 
 typedef struct {
@@ -89,12 +189,15 @@ typedef struct {
   Expr base;
   Expr *value;
   char *varname;
+  int slot;
 } VarDeclaration;
 
 typedef struct {
   Expr base;
   Expr *value;
   char *varname;
+  int depth;
+  int slot;
 } AssignVar;
 
 typedef struct {
@@ -102,6 +205,8 @@ typedef struct {
   Expr *value;
   Expr *index;
   char *varname;
+  int depth;
+  int slot;
 } AssignListVar;
 
 typedef struct {
@@ -109,8 +214,14 @@ typedef struct {
   Expr *value;
   Expr *key;
   char *varname;
+  int depth;
+  int slot;
 } AssignDictVar;
 
+// The resolver clears has_scope for blocks that declare nothing; such a
+// block runs directly in the enclosing environment. boolean_condition, here
+// and in the loops, is set by type inference (infer.c) when the condition
+// always yields a boolean.
 typedef struct {
   Expr base;
   Expr *condition;
@@ -119,6 +230,11 @@ typedef struct {
   Stmt **else_body;
   size_t else_body_count;
   struct IfExpr *else_if;
+  int has_scope;
+  int else_has_scope;
+  size_t slot_count;
+  size_t else_slot_count;
+  int boolean_condition;
 } IfExpr;
 
 typedef struct {
@@ -126,6 +242,9 @@ typedef struct {
   Expr *condition;
   Stmt **body;
   size_t body_count;
+  int has_scope;
+  size_t slot_count;
+  int boolean_condition;
 } WhileExpr;
 
 typedef struct {
@@ -135,8 +254,31 @@ typedef struct {
   Expr *increment;
   Stmt **body;
   size_t body_count;
+  int has_scope;
+  int body_has_scope;
+  size_t slot_count;
+  size_t body_slot_count;
+  // `@(let i = a; i < b; i = i + step)` whose body never assigns i, as
+  // recognized by the resolver; bound_invariant means b cannot change.
+  int counted;
+  double step;
+  int bound_invariant;
+  int boolean_condition;
 } ForExpr;
 
+// A variable a flat closure copies, as seen from where it is defined.
+typedef struct {
+  int depth;
+  int slot;
+} Capture;
+
+// Parameters take the first param_count slots of the function environment.
+// A flat function (see capture_scope in resolver.c) does not keep the
+// environment it is defined in: it gets one holding just `captures`, whose
+// parent is the top-level environment scope_depth levels up. region is set
+// by escape analysis (infer.c) when nothing the body allocates can outlive
+// a call except through its result; the tree walker then frees all of it
+// when the call returns.
 typedef struct {
   Expr base;
   char *name;
@@ -144,13 +286,40 @@ typedef struct {
   size_t param_count;
   Stmt **body;
   size_t body_count;
+  int slot;
+  size_t slot_count;
+  int flat;
+  int scope_depth;
+  Capture *captures;
+  size_t capture_count;
+  int region;
 } FuncDef;
 
+// Where a name that is looked up by name was last found; see
+// lookup_var_cached (env.c). `binding` points at the Value cell.
+typedef struct {
+  unsigned long version;
+  struct Environment *scope;
+  uint64_t *binding;
+} VarCache;
+
+// When the callee is such a name, the call site also keeps the function it
+// resolved to once its type and arity have been checked; callee_version is
+// the version of the global slot it came from, or 0 if it came from a scope
+// walk checked through callee_cache. intrinsic (an Intrinsic, builtins.h)
+// names the core builtin the callee refers to unless it is rebound or
+// shadowed. is_tail is set by the resolver for calls whose value is the
+// result of the enclosing function.
 typedef struct {
   Expr base;
   Expr *callee;
   Expr **arguments;
   size_t arg_count;
+  VarCache callee_cache;
+  struct RuntimeVal *checked_callee;
+  unsigned long callee_version;
+  int intrinsic;
+  int is_tail;
 } CallExpr;
 
 typedef struct {
@@ -197,10 +366,18 @@ typedef struct {
   Expr *start;
   Expr *end;
   int is_slice;
+  Specialization specialization;
 } ListIndex;
 
 Program *create_program(Stmt **body, size_t body_count);
-BinaryExpr *create_binary_expr(Expr *left, Expr *right, const char *operator);
+BinaryExpr *create_binary_expr(Expr *left, Expr *right,
+                               BinaryOperator operator);
+LogicalExpr *create_logical_expr(Expr *left, Expr *right,
+                                 BinaryOperator operator);
+JumpExpr *create_jump_expr(NodeType kind);
+ReturnExpr *create_return_expr(Expr *value);
+BinaryOperator binary_operator_from_string(const char *symbol);
+const char *binary_operator_to_string(BinaryOperator operator);
 UnaryExpr *create_unary_expr(const char *operator, Expr *expr);
 Identifier *create_identifier(const char *symbol);
 NumericLiteral *create_numeric_literal(double value);
@@ -227,6 +404,14 @@ DictLiteral *create_dict_literal(Expr **keys, Expr **values,
 DictKey *create_dict_key(Expr *dict, Expr *key);
 TableLiteral *create_table_literal(char **columns, size_t column_count);
 
+// Calls `visit` on every direct child of a node, the statements of nested
+// blocks and function bodies included.
+typedef void (*NodeVisitor)(Stmt *node, void *context);
+
+void visit_block(Stmt **body, size_t body_count, NodeVisitor visit,
+                 void *context);
+void visit_children(Stmt *node, NodeVisitor visit, void *context);
+
 void free_expr(Expr *expr);
 void free_stmt(Stmt *stmt);
 void free_program(Program *program);
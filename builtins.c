@@ -13,87 +13,87 @@
 #include "malloc_safe.h"
 #include "values.h"
 
-RuntimeVal *builtin_sum(Environment *env, RuntimeVal **args, size_t arg_count) {
-  if (arg_count != 1 || args[0]->type != LIST_T) {
-    error("The 'sum' function expects exactly one list argument.");
-  }
-
-  ListVal *list = (ListVal *)args[0];
+static Value sum_list(ListVal *list) {
   double total = 0.0;
 
   for (size_t i = 0; i < list->size; i++) {
-    RuntimeVal *item = list->items[i];
-    if (item->type != NUMBER_T) {
+    Value item = list->items[i];
+    if (!IS_NUMBER(item)) {
       error("All elements of the list must be numbers.");
     }
-    total += ((NumberVal *)item)->value;
+    total += AS_NUMBER(item);
   }
 
-  return (RuntimeVal *)MK_NUMBER(total);
+  return NUMBER_VAL(total);
 }
 
-RuntimeVal *builtin_find(Environment *env, RuntimeVal **args,
-                         size_t arg_count) {
+Value builtin_sum(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 1 || value_type(args[0]) != LIST_T) {
+    error("The 'sum' function expects exactly one list argument.");
+  }
+  return sum_list(AS_LIST(args[0]));
+}
+
+Value builtin_find(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 2) {
     error("Function 'find' expects exactly two arguments.");
   }
-  if (args[0]->type != STRING_T && args[0]->type != LIST_T && args[0]->type != DICT_T) {
+  if (value_type(args[0]) != STRING_T && value_type(args[0]) != LIST_T &&
+      value_type(args[0]) != DICT_T) {
     error("The first argument for 'find' must be a string, list or dictionary.");
   }
-  if (args[1]->type != STRING_T && args[1]->type != NUMBER_T &&
-      args[1]->type != BOOLEAN_T) {
+  if (value_type(args[1]) != STRING_T && value_type(args[1]) != NUMBER_T &&
+      value_type(args[1]) != BOOLEAN_T) {
     error(
         "The second argument for 'find' must be a string, number or boolean.");
   }
-  if (args[0]->type == STRING_T) {
-    StringVal *str = (StringVal *)args[0];
-    StringVal *value = (StringVal *)args[1];
+  if (value_type(args[0]) == STRING_T) {
+    StringVal *str = AS_STRING(args[0]);
+    StringVal *value = AS_STRING(args[1]);
     char *str_value = str->value;
     char *value_value = value->value;
     char *pos = strstr(str_value, value_value);
     if (pos != NULL) {
-      return (RuntimeVal *)MK_NUMBER((double)(pos - str_value));
+      return NUMBER_VAL((double)(pos - str_value));
     }
   }
-  if (args[0]->type == LIST_T || args[0]->type == DICT_T) {
+  if (value_type(args[0]) == LIST_T || value_type(args[0]) == DICT_T) {
     ListVal *obj;
-    if (args[0]->type == LIST_T) {
-      obj = (ListVal *)args[0];
+    if (value_type(args[0]) == LIST_T) {
+      obj = AS_LIST(args[0]);
     } else {
-      obj = (ListVal *)dict_to_keys((DictVal *)args[0]);
+      obj = dict_to_keys(AS_DICT(args[0]));
     }
-    RuntimeVal *value = args[1];
+    Value value = args[1];
     for (size_t i = 0; i < obj->size; i++) {
       if (compare_runtimeval(obj->items[i], value)) {
-        return (RuntimeVal *)MK_NUMBER((double)i);
+        return NUMBER_VAL((double)i);
       }
     }
   }
-  return (RuntimeVal *)MK_NUMBER((double)-1);
+  return NUMBER_VAL((double)-1);
 }
 
-RuntimeVal *builtin_keys(Environment *env, RuntimeVal **args,
-                         size_t arg_count) {
+Value builtin_keys(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 1) {
     error("Function 'keys' expects exactly one argument.");
   }
-  if (args[0]->type != DICT_T) {
+  if (value_type(args[0]) != DICT_T) {
     error("Argument to 'keys' must be a dictionary.");
   }
-  ListVal *keys_list = dict_to_keys((DictVal *)args[0]);
-  return (RuntimeVal *)keys_list;
+  ListVal *keys_list = dict_to_keys(AS_DICT(args[0]));
+  return OBJ_VAL(keys_list);
 }
 
-RuntimeVal *builtin_values(Environment *env, RuntimeVal **args,
-                           size_t arg_count) {
+Value builtin_values(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 1) {
     error("The 'values' function expects exactly one argument.");
   }
-  if (args[0]->type != DICT_T) {
+  if (value_type(args[0]) != DICT_T) {
     error("The argument for 'values' must be a dictionary.");
   }
 
-  DictVal *dict = (DictVal *)args[0];
+  DictVal *dict = AS_DICT(args[0]);
   ListVal *values_list = MK_LIST(dict->size);
 
   for (size_t i = 0; i < dict->capacity; i++) {
@@ -104,53 +104,102 @@ RuntimeVal *builtin_values(Environment *env, RuntimeVal **args,
     }
   }
 
-  return (RuntimeVal *)values_list;
+  return OBJ_VAL(values_list);
 }
 
-RuntimeVal *builtin_len(Environment *env, RuntimeVal **args, size_t arg_count) {
+Value builtin_len(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 1) {
     error("Function 'len' expects exactly one argument.");
   }
-  if (args[0]->type == LIST_T) {
-    ListVal *list = (ListVal *)args[0];
-    return (RuntimeVal *)MK_NUMBER((double)list->size);
-  } else if (args[0]->type == STRING_T) {
-    StringVal *str = (StringVal *)args[0];
-    return (RuntimeVal *)MK_NUMBER((double)strlen(str->value));
-  } else if (args[0]->type == DICT_T) {
-    DictVal *dict = (DictVal *)args[0];
-    return (RuntimeVal *)MK_NUMBER((double)dict->size);
-  } else if (args[0]->type == TABLE_T) {
-    TableVal *table = (TableVal *)args[0];
-    return (RuntimeVal *)MK_NUMBER((double)table->row_count);
+  if (value_type(args[0]) == LIST_T) {
+    ListVal *list = AS_LIST(args[0]);
+    return NUMBER_VAL((double)list->size);
+  } else if (value_type(args[0]) == STRING_T) {
+    StringVal *str = AS_STRING(args[0]);
+    return NUMBER_VAL((double)strlen(str->value));
+  } else if (value_type(args[0]) == DICT_T) {
+    DictVal *dict = AS_DICT(args[0]);
+    return NUMBER_VAL((double)dict->size);
+  } else if (value_type(args[0]) == TABLE_T) {
+    TableVal *table = AS_TABLE(args[0]);
+    return NUMBER_VAL((double)table->row_count);
   } else {
     error("Argument to 'len' must be a table, list, string or dictionary.");
   }
 }
 
-void _builtin_print_value(Environment *env, RuntimeVal **args, size_t arg_count,
+NativeFn intrinsic_builtins[] = {NULL, builtin_len, builtin_sum, builtin_keys,
+                                 builtin_values, builtin_find};
+
+static const char *intrinsic_names[] = {NULL, "len", "sum", "keys", "values",
+                                        "find"};
+
+Intrinsic intrinsic_for(const char *name, size_t arg_count) {
+  for (int i = LEN_INTRINSIC; i <= FIND_INTRINSIC; i++) {
+    if (strcmp(name, intrinsic_names[i]) == 0) {
+      size_t arity = i == FIND_INTRINSIC ? 2 : 1;
+      return arg_count == arity ? (Intrinsic)i : NO_INTRINSIC;
+    }
+  }
+  return NO_INTRINSIC;
+}
+
+// The arity is known to match; lists get their answer right here, anything
+// else goes to the builtin, which also reports wrong argument types.
+Value run_intrinsic(Intrinsic intrinsic, Environment *env, Value *args) {
+  switch (intrinsic) {
+  case LEN_INTRINSIC:
+    if (value_type(args[0]) == LIST_T) {
+      return NUMBER_VAL((double)AS_LIST(args[0])->size);
+    }
+    return builtin_len(env, args, 1);
+  case SUM_INTRINSIC:
+    if (value_type(args[0]) == LIST_T) {
+      return sum_list(AS_LIST(args[0]));
+    }
+    return builtin_sum(env, args, 1);
+  case KEYS_INTRINSIC:
+    return builtin_keys(env, args, 1);
+  case VALUES_INTRINSIC:
+    return builtin_values(env, args, 1);
+  case FIND_INTRINSIC:
+    if (value_type(args[0]) == LIST_T && IS_NUMBER(args[1])) {
+      ListVal *list = AS_LIST(args[0]);
+      for (size_t i = 0; i < list->size; i++) {
+        if (IS_NUMBER(list->items[i]) &&
+            AS_NUMBER(list->items[i]) == AS_NUMBER(args[1])) {
+          return NUMBER_VAL((double)i);
+        }
+      }
+      return NUMBER_VAL(-1);
+    }
+    return builtin_find(env, args, 2);
+  default:
+    return NIL_VAL;
+  }
+}
+
+void _builtin_print_value(Environment *env, Value *args, size_t arg_count,
                           bool as_string) {
   if (arg_count != 1) {
     error("Function 'print' expects exactly one argument.");
   }
-  RuntimeVal *val = args[0];
+  Value val = args[0];
 
-  switch (val->type) {
+  switch (value_type(val)) {
   case NIL_T:
     printf("nil");
     break;
   case BOOLEAN_T: {
-    BooleanVal *bool_val = (BooleanVal *)val;
-    printf("%s", bool_val->value ? "true" : "false");
+    printf("%s", AS_BOOL(val) ? "true" : "false");
     break;
   }
   case NUMBER_T: {
-    NumberVal *num_val = (NumberVal *)val;
-    printf("%f", num_val->value);
+    printf("%f", AS_NUMBER(val));
     break;
   }
   case STRING_T: {
-    StringVal *str_val = (StringVal *)val;
+    StringVal *str_val = AS_STRING(val);
     if (as_string) {
       printf("\"%s\"", str_val->value);
     } else {
@@ -159,21 +208,20 @@ void _builtin_print_value(Environment *env, RuntimeVal **args, size_t arg_count,
     break;
   }
   case LIST_T: {
-    ListVal *list_val = (ListVal *)val;
+    ListVal *list_val = AS_LIST(val);
     printf("{");
     for (size_t i = 0; i < list_val->size; i++) {
       if (i > 0) {
         printf(", ");
       }
-      RuntimeVal *item = list_val->items[i];
-      RuntimeVal *item_args[] = {item};
+      Value item_args[] = {list_val->items[i]};
       _builtin_print_value(env, item_args, 1, 1);
     }
     printf("}");
     break;
   }
   case TABLE_T: {
-    TableVal *table_val = (TableVal *)val;
+    TableVal *table_val = AS_TABLE(val);
     printf("|>");
     for (size_t i = 0; i < table_val->column_count; i++) {
       if (i > 0) {
@@ -186,7 +234,7 @@ void _builtin_print_value(Environment *env, RuntimeVal **args, size_t arg_count,
     break;
   }
   case DICT_T: {
-    DictVal *dict_val = (DictVal *)val;
+    DictVal *dict_val = AS_DICT(val);
     printf("[");
     short int first = 1;
     for (size_t i = 0; i < dict_val->capacity; i++) {
@@ -196,7 +244,7 @@ void _builtin_print_value(Environment *env, RuntimeVal **args, size_t arg_count,
           printf("; ");
         }
         printf("\"%s\" -> ", entry->key);
-        RuntimeVal *entry_args[] = {entry->value};
+        Value entry_args[] = {entry->value};
         _builtin_print_value(env, entry_args, 1, 1);
         entry = entry->next;
         first = 0;
@@ -206,7 +254,6 @@ void _builtin_print_value(Environment *env, RuntimeVal **args, size_t arg_count,
     break;
   }
   case FUNCTION_T: {
-    FunctionVal *func_val = (FunctionVal *)val;
     printf("<function>");
     break;
   }
@@ -215,48 +262,45 @@ void _builtin_print_value(Environment *env, RuntimeVal **args, size_t arg_count,
   }
 }
 
-RuntimeVal *builtin_println_value(Environment *env, RuntimeVal **args,
-                                  size_t arg_count) {
+Value builtin_println_value(Environment *env, Value *args, size_t arg_count) {
   _builtin_print_value(env, args, 1, 0);
   printf("\n");
-  return (RuntimeVal *)MK_NIL();
+  return NIL_VAL;
 }
 
-RuntimeVal *builtin_random(Environment *env, RuntimeVal **args,
-                           size_t arg_count) {
+Value builtin_random(Environment *env, Value *args, size_t arg_count) {
   static int initialized = 0;
   if (!initialized) {
     srand(time(NULL));
     initialized = 1;
   }
   double random_value = (double)rand() / RAND_MAX;
-  return (RuntimeVal *)MK_NUMBER(random_value);
+  return NUMBER_VAL(random_value);
 }
 
-RuntimeVal *builtin_random_int(Environment *env, RuntimeVal **args,
-                               size_t arg_count) {
+Value builtin_random_int(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 2) {
     fprintf(stderr, "Error: random_int expects 2 arguments, but received %zu\n",
             arg_count);
-    return (RuntimeVal *)MK_NIL();
+    return NIL_VAL;
   }
 
-  RuntimeVal *min_val = args[0];
-  RuntimeVal *max_val = args[1];
+  Value min_val = args[0];
+  Value max_val = args[1];
 
-  if (min_val->type != NUMBER_T || max_val->type != NUMBER_T) {
+  if (!IS_NUMBER(min_val) || !IS_NUMBER(max_val)) {
     fprintf(stderr, "Error: random_int expects two numbers as arguments\n");
-    return (RuntimeVal *)MK_NIL();
+    return NIL_VAL;
   }
 
-  int min = (int)((NumberVal *)min_val)->value;
-  int max = (int)((NumberVal *)max_val)->value;
+  int min = (int)AS_NUMBER(min_val);
+  int max = (int)AS_NUMBER(max_val);
 
   if (min > max) {
     fprintf(
         stderr,
         "Error: the first argument must be less than or equal to the second\n");
-    return (RuntimeVal *)MK_NIL();
+    return NIL_VAL;
   }
 
   static int initialized = 0;
@@ -266,13 +310,12 @@ RuntimeVal *builtin_random_int(Environment *env, RuntimeVal **args,
   }
 
   int random_int = min + rand() % (max - min + 1);
-  return (RuntimeVal *)MK_NUMBER((double)random_int);
+  return NUMBER_VAL((double)random_int);
 }
 
-RuntimeVal *builtin_print_value(Environment *env, RuntimeVal **args,
-                                size_t arg_count) {
+Value builtin_print_value(Environment *env, Value *args, size_t arg_count) {
   _builtin_print_value(env, args, 1, 0);
-  return (RuntimeVal *)MK_NIL();
+  return NIL_VAL;
 }
 
 void register_builtins(Environment *env) {
@@ -282,31 +325,31 @@ void register_builtins(Environment *env) {
 
   declare_var(
       env, "keys",
-      (RuntimeVal *)MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_keys));
+      OBJ_VAL(MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_keys)));
   declare_var(
       env, "len",
-      (RuntimeVal *)MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_len));
+      OBJ_VAL(MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_len)));
   declare_var(env, "print",
-              (RuntimeVal *)MK_FUNCTION(single_param, 1, NULL, 0, env,
-                                        builtin_print_value));
+              OBJ_VAL(MK_FUNCTION(single_param, 1, NULL, 0, env,
+                                  builtin_print_value)));
   declare_var(env, "println",
-              (RuntimeVal *)MK_FUNCTION(single_param, 1, NULL, 0, env,
-                                        builtin_println_value));
+              OBJ_VAL(MK_FUNCTION(single_param, 1, NULL, 0, env,
+                                  builtin_println_value)));
   declare_var(
       env, "values",
-      (RuntimeVal *)MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_values));
+      OBJ_VAL(MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_values)));
   declare_var(
       env, "sum",
-      (RuntimeVal *)MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_sum));
+      OBJ_VAL(MK_FUNCTION(single_param, 1, NULL, 0, env, builtin_sum)));
 
   declare_var(env, "random_int",
-              (RuntimeVal *)MK_FUNCTION(double_param, 2, NULL, 0, env,
-                                        builtin_random_int));
+              OBJ_VAL(MK_FUNCTION(double_param, 2, NULL, 0, env,
+                                  builtin_random_int)));
   declare_var(
       env, "find",
-      (RuntimeVal *)MK_FUNCTION(double_param, 2, NULL, 0, env, builtin_find));
+      OBJ_VAL(MK_FUNCTION(double_param, 2, NULL, 0, env, builtin_find)));
 
   declare_var(
       env, "random",
-      (RuntimeVal *)MK_FUNCTION(no_params, 0, NULL, 0, env, builtin_random));
+      OBJ_VAL(MK_FUNCTION(no_params, 0, NULL, 0, env, builtin_random)));
 }
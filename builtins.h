@@ -9,14 +9,36 @@
 
 void register_builtins(Environment *env);
 
-RuntimeVal *builtin_keys(Environment *env, RuntimeVal **args, size_t arg_count);
-RuntimeVal *builtin_len(Environment *env, RuntimeVal **args, size_t arg_count);
-RuntimeVal *builtin_println_value(Environment *env, RuntimeVal **args,
-                                  size_t arg_count);
-RuntimeVal *builtin_values(Environment *env, RuntimeVal **args,
-                           size_t arg_count);
-RuntimeVal *builtin_print_value(Environment *env, RuntimeVal **args,
-                                size_t arg_count);
-RuntimeVal *builtin_sum(Environment *env, RuntimeVal **args, size_t arg_count);
+Value builtin_keys(Environment *env, Value *args, size_t arg_count);
+Value builtin_len(Environment *env, Value *args, size_t arg_count);
+Value builtin_println_value(Environment *env, Value *args, size_t arg_count);
+Value builtin_values(Environment *env, Value *args, size_t arg_count);
+Value builtin_print_value(Environment *env, Value *args, size_t arg_count);
+Value builtin_sum(Environment *env, Value *args, size_t arg_count);
+Value builtin_find(Environment *env, Value *args, size_t arg_count);
+
+// Core builtins the resolver marks at call sites (CallExpr.intrinsic) whose
+// callee is looked up by name. As long as the name still refers to the
+// builtin, the engines run it through run_intrinsic instead of a call; a
+// user binding of the same name is a different function and is called as
+// usual.
+typedef enum {
+  NO_INTRINSIC,
+  LEN_INTRINSIC,
+  SUM_INTRINSIC,
+  KEYS_INTRINSIC,
+  VALUES_INTRINSIC,
+  FIND_INTRINSIC
+} Intrinsic;
+
+extern NativeFn intrinsic_builtins[];
+
+Intrinsic intrinsic_for(const char *name, size_t arg_count);
+Value run_intrinsic(Intrinsic intrinsic, Environment *env, Value *args);
+
+static inline int is_intrinsic_callee(Value callee, Intrinsic intrinsic) {
+  return value_type(callee) == FUNCTION_T &&
+         AS_FUNCTION(callee)->builtin_func == intrinsic_builtins[intrinsic];
+}
 
 #endif // BUILTINS_H
\ No newline at end of file
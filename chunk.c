@@ -0,0 +1,231 @@
+#include "chunk.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "global.h"
+#include "jit.h"
+#include "malloc_safe.h"
+
+static const char *opcode_names[] = {
+#define OPCODE_NAME(name) #name,
+    OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+char *scope_names[] = {"if_env", "else_env", "while_env", "for_env",
+                       "for_env_loop"};
+
+Chunk *create_chunk() {
+  Chunk *chunk = (Chunk *)malloc_safe(sizeof(Chunk), "Chunk");
+  chunk->code = NULL;
+  chunk->count = 0;
+  chunk->capacity = 0;
+  chunk->constants = NULL;
+  chunk->constant_count = 0;
+  chunk->names = NULL;
+  chunk->name_caches = NULL;
+  chunk->name_ids = NULL;
+  chunk->name_count = 0;
+  chunk->protos = NULL;
+  chunk->proto_count = 0;
+  chunk->nodes = NULL;
+  chunk->node_count = 0;
+  chunk->max_registers = 1;
+  chunk->hotness = 0;
+  chunk->jit = NULL;
+  return chunk;
+}
+
+size_t chunk_emit(Chunk *chunk, Instruction instruction) {
+  if (chunk->count >= chunk->capacity) {
+    chunk->capacity = chunk->capacity == 0 ? 32 : chunk->capacity * 2;
+    chunk->code = realloc_safe(chunk->code,
+                               sizeof(Instruction) * chunk->capacity,
+                               "chunk_emit code");
+  }
+  chunk->code[chunk->count] = instruction;
+  return chunk->count++;
+}
+
+size_t chunk_add_constant(Chunk *chunk, Value value) {
+  for (size_t i = 0; i < chunk->constant_count; i++) {
+    Value k = chunk->constants[i];
+    if (value_type(k) != value_type(value)) {
+      continue;
+    }
+    if (IS_NUMBER(k) && AS_NUMBER(k) == AS_NUMBER(value)) {
+      return i;
+    }
+    if (value_type(k) == STRING_T &&
+        strcmp(AS_STRING(k)->value, AS_STRING(value)->value) == 0) {
+      return i;
+    }
+  }
+  if (chunk->constant_count > 0xffff) {
+    error("Too many constants in one function.\n");
+  }
+  chunk->constants = realloc_safe(
+      chunk->constants, sizeof(Value) * (chunk->constant_count + 1),
+      "chunk_add_constant");
+  chunk->constants[chunk->constant_count] = value;
+  return chunk->constant_count++;
+}
+
+size_t chunk_add_name(Chunk *chunk, const char *name) {
+  for (size_t i = 0; i < chunk->name_count; i++) {
+    if (strcmp(chunk->names[i], name) == 0) {
+      return i;
+    }
+  }
+  if (chunk->name_count > 0xffff) {
+    error("Too many names in one function.\n");
+  }
+  chunk->names = realloc_safe(chunk->names,
+                              sizeof(char *) * (chunk->name_count + 1),
+                              "chunk_add_name");
+  chunk->name_caches = realloc_safe(chunk->name_caches,
+                                    sizeof(VarCache) * (chunk->name_count + 1),
+                                    "chunk_add_name caches");
+  chunk->name_ids = realloc_safe(chunk->name_ids,
+                                 sizeof(int) * (chunk->name_count + 1),
+                                 "chunk_add_name ids");
+  chunk->names[chunk->name_count] = strdup(name);
+  chunk->name_caches[chunk->name_count] = (VarCache){0};
+  chunk->name_ids[chunk->name_count] = intern_name(name);
+  return chunk->name_count++;
+}
+
+size_t chunk_add_proto(Chunk *chunk, FunctionProto *proto) {
+  chunk->protos = realloc_safe(chunk->protos,
+                               sizeof(FunctionProto *) *
+                                   (chunk->proto_count + 1),
+                               "chunk_add_proto");
+  chunk->protos[chunk->proto_count] = proto;
+  return chunk->proto_count++;
+}
+
+size_t chunk_add_node(Chunk *chunk, Stmt *node) {
+  chunk->nodes = realloc_safe(chunk->nodes,
+                              sizeof(Stmt *) * (chunk->node_count + 1),
+                              "chunk_add_node");
+  chunk->nodes[chunk->node_count] = node;
+  return chunk->node_count++;
+}
+
+// Only the top-level program chunk is ever freed; the chunks of nested
+// functions live as long as the FunctionVal values that point at them.
+void free_chunk(Chunk *chunk) {
+  for (size_t i = 0; i < chunk->name_count; i++) {
+    free_safe(chunk->names[i]);
+  }
+  free_safe(chunk->names);
+  free_safe(chunk->name_caches);
+  free_safe(chunk->name_ids);
+  free_safe(chunk->code);
+  free_safe(chunk->constants);
+  for (size_t i = 0; i < chunk->proto_count; i++) {
+    free_safe(chunk->protos[i]);
+  }
+  free_safe(chunk->protos);
+  free_safe(chunk->nodes);
+  jit_free(chunk->jit);
+  free_safe(chunk);
+}
+
+static void print_rk(Chunk *chunk, int operand) {
+  if (operand & RK_CONSTANT) {
+    Value k = chunk->constants[operand & ~RK_CONSTANT];
+    if (IS_NUMBER(k)) {
+      printf(" K(%g)", AS_NUMBER(k));
+    } else if (value_type(k) == STRING_T) {
+      printf(" K(\"%s\")", AS_STRING(k)->value);
+    } else {
+      printf(" K%d", operand & ~RK_CONSTANT);
+    }
+  } else {
+    printf(" R%d", operand);
+  }
+}
+
+void disassemble_chunk(Chunk *chunk, const char *title) {
+  printf("== %s (%d registers) ==\n", title, chunk->max_registers);
+  for (size_t offset = 0; offset < chunk->count; offset++) {
+    Instruction i = chunk->code[offset];
+    OpCode op = GET_OP(i);
+    printf("%04zu %-15s", offset, opcode_names[op]);
+    switch (op) {
+    case OP_LOADK:
+      printf(" R%d", GET_A(i));
+      print_rk(chunk, RK_CONSTANT | GET_BX(i));
+      break;
+    case OP_GETVAR:
+    case OP_SETVAR:
+    case OP_DEFVAR:
+      printf(" R%d '%s'", GET_A(i), chunk->names[GET_BX(i)]);
+      break;
+    case OP_GETLOCAL:
+    case OP_SETLOCAL:
+      printf(" R%d ^%d [%d]", GET_A(i), GET_B(i), GET_C(i));
+      break;
+    case OP_DEFLOCAL:
+      printf(" R%d [%d]", GET_A(i), GET_BX(i));
+      break;
+    case OP_PUSHENV:
+      printf(" '%s' %d", scope_names[GET_A(i)], GET_BX(i));
+      break;
+    case OP_JMP:
+    case OP_LOOP:
+      printf(" -> %04zu", offset + 1 + GET_SBX(i));
+      break;
+    case OP_JMPFALSE_IF:
+    case OP_JMPFALSE_WHILE:
+    case OP_JMPFALSE_FOR:
+    case OP_JMPAND:
+    case OP_JMPOR:
+      printf(" R%d -> %04zu", GET_A(i), offset + 1 + GET_SBX(i));
+      break;
+    case OP_CLOSURE:
+      printf(" R%d '%s'", GET_A(i), chunk->protos[GET_BX(i)]->name);
+      break;
+    case OP_NEWLIST:
+    case OP_NEWDICT:
+    case OP_NEWTABLE:
+    case OP_EVALAST:
+      printf(" R%d %d", GET_A(i), GET_BX(i));
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE:
+      printf(" R%d", GET_A(i));
+      print_rk(chunk, GET_B(i));
+      print_rk(chunk, GET_C(i));
+      break;
+    case OP_BINARY:
+      printf(" R%d R%d R%d '%s'", GET_A(i), GET_B(i), GET_C(i),
+             binary_operator_to_string(chunk->code[offset + 1]));
+      offset++;
+      break;
+    default:
+      printf(" %d %d %d", GET_A(i), GET_B(i), GET_C(i));
+      break;
+    }
+    printf("\n");
+  }
+  for (size_t p = 0; p < chunk->proto_count; p++) {
+    FunctionProto *proto = chunk->protos[p];
+    if (proto->chunk != NULL) {
+      disassemble_chunk(proto->chunk, proto->name);
+    }
+  }
+}
@@ -0,0 +1,151 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ast.h"
+#include "values.h"
+
+// Every instruction is a 32-bit word laid out as
+//   | op:8 | A:8 | B:8 | C:8 |   or   | op:8 | A:8 | Bx:16 |
+// Jumps store a signed offset in Bx biased by JUMP_BIAS.
+typedef uint32_t Instruction;
+
+#define MAX_REGISTERS 128
+#define RK_CONSTANT 0x80
+#define MAX_RK_CONSTANTS 128
+#define JUMP_BIAS 32767
+
+// A B C fields of the arithmetic/comparison opcodes are "RK" operands: values
+// below RK_CONSTANT name a register, values with RK_CONSTANT set name a
+// constant.
+#define OPCODE_LIST(X)                                                         \
+  X(MOVE)           /* A B     R[A] = R[B]                               */    \
+  X(LOADK)          /* A Bx    R[A] = K[Bx]                              */    \
+  X(LOADNIL)        /* A       R[A] = nil                                */    \
+  X(LOADBOOL)       /* A B     R[A] = (B != 0)                           */    \
+  X(GETVAR)         /* A Bx    R[A] = lookup(N[Bx])                      */    \
+  X(SETVAR)         /* A Bx    assign(N[Bx], R[A])                       */    \
+  X(DEFVAR)         /* A Bx    declare(N[Bx], R[A])                      */    \
+  X(GETLOCAL)       /* A B C   R[A] = slot C of the env B levels up      */    \
+  X(SETLOCAL)       /* A B C   slot C of the env B levels up = R[A]      */    \
+  X(DEFLOCAL)       /* A Bx    slot Bx of env = R[A]                     */    \
+  X(ADD)            /* A B C   R[A] = RK[B] + RK[C]                      */    \
+  X(SUB)            /* A B C   R[A] = RK[B] - RK[C]                      */    \
+  X(MUL)            /* A B C   R[A] = RK[B] * RK[C]                      */    \
+  X(DIV)            /* A B C   R[A] = RK[B] / RK[C]                      */    \
+  X(LT)             /* A B C   R[A] = RK[B] < RK[C]                      */    \
+  X(LE)             /* A B C   R[A] = RK[B] <= RK[C]                     */    \
+  X(GT)             /* A B C   R[A] = RK[B] > RK[C]                      */    \
+  X(GE)             /* A B C   R[A] = RK[B] >= RK[C]                     */    \
+  X(EQ)             /* A B C   R[A] = RK[B] == RK[C]                     */    \
+  X(NE)             /* A B C   R[A] = RK[B] != RK[C]                     */    \
+  X(BINARY)         /* A B C   R[A] = R[B] <op in next word> R[C]        */    \
+  X(UNM)            /* A B     R[A] = -R[B]                              */    \
+  X(UPLUS)          /* A B     R[A] = +R[B]                              */    \
+  X(JMP)            /* sBx     ip += sBx                                 */    \
+  X(LOOP)           /* sBx     ip += sBx (back-edge, GC safe point)      */    \
+  X(JMPFALSE_IF)    /* A sBx   if !R[A] then ip += sBx ('?' condition)   */    \
+  X(JMPFALSE_WHILE) /* A sBx   if !R[A] then ip += sBx ('#' condition)   */    \
+  X(JMPFALSE_FOR)   /* A sBx   if !R[A] then ip += sBx ('@' condition)   */    \
+  X(JMPAND)         /* A sBx   R[A] false or 0: R[A] = false, jump       */    \
+  X(JMPOR)          /* A sBx   R[A] true or not 0: R[A] = true, jump     */    \
+  X(PUSHENV)        /* A Bx    env = new Environment(env, scope A, Bx)   */    \
+  X(POPENV)         /*         env = env->parent                         */    \
+  X(CLOSURE)        /* A Bx    R[A] = declare(function P[Bx])            */    \
+  X(CALL)           /* A B     R[A] = R[A](R[A+1] .. R[A+B])             */    \
+  X(TAILCALL)       /* A B     CALL reusing the current frame            */    \
+  X(RETURN)         /* A       return R[A]                               */    \
+  X(INTRINSIC)      /* A B     if R[A] is builtin B: R[A] = B(R[A+1] ..) */    \
+                    /*         and skip the call that follows            */    \
+  X(NEWLIST)        /* A Bx    R[A] = list with room for Bx items        */    \
+  X(LISTAPPEND)     /* A B C   append R[B] .. R[B+C-1] to R[A]           */    \
+  X(NEWDICT)        /* A Bx    R[A] = dict for Bx entries                */    \
+  X(DICTPUT)        /* A B C   R[A]{R[B+2i]} = R[B+2i+1], i < C          */    \
+  X(NEWTABLE)       /* A Bx    R[A] = table from node X[Bx]              */    \
+  X(INDEX)          /* A B C   R[A] = R[B][R[C]]                         */    \
+  X(SLICE)          /* A B C   R[A] = R[B][R[C]:R[C+1]]                  */    \
+  X(SLICEOPEN)      /* A B C   R[A] = R[B][R[C]:]                        */    \
+  X(GETKEY)         /* A B C   R[A] = R[B]{R[C]}                         */    \
+  X(SETINDEX)       /* A B C   R[A][R[B]] = R[C]                         */    \
+  X(SETKEY)         /* A B C   R[A]{R[B]} = R[C]                         */    \
+  X(EVALAST)        /* A Bx    R[A] = evaluate(X[Bx]) (tree walker)      */
+
+typedef enum {
+#define OPCODE_ENUM(name) OP_##name,
+  OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
+      OPCODE_COUNT
+} OpCode;
+
+#define GET_OP(i) ((OpCode)((i) & 0xff))
+#define GET_A(i) (((i) >> 8) & 0xff)
+#define GET_B(i) (((i) >> 16) & 0xff)
+#define GET_C(i) (((i) >> 24) & 0xff)
+#define GET_BX(i) (((i) >> 16) & 0xffff)
+#define GET_SBX(i) ((int)GET_BX(i) - JUMP_BIAS)
+
+#define MAKE_ABC(op, a, b, c)                                                  \
+  ((Instruction)(op) | ((Instruction)(a) << 8) | ((Instruction)(b) << 16) |    \
+   ((Instruction)(c) << 24))
+#define MAKE_ABX(op, a, bx)                                                    \
+  ((Instruction)(op) | ((Instruction)(a) << 8) | ((Instruction)(bx) << 16))
+
+typedef enum {
+  IF_SCOPE,
+  ELSE_SCOPE,
+  WHILE_SCOPE,
+  FOR_SCOPE,
+  FOR_LOOP_SCOPE
+} ScopeKind;
+
+extern char *scope_names[];
+
+typedef struct Chunk Chunk;
+typedef struct JitCode JitCode;
+
+typedef struct {
+  char *name;
+  char **params;
+  size_t param_count;
+  Stmt **body;
+  size_t body_count;
+  int slot;
+  size_t slot_count;
+  int flat;
+  int scope_depth;
+  Capture *captures;
+  size_t capture_count;
+  Chunk *chunk;
+} FunctionProto;
+
+struct Chunk {
+  Instruction *code;
+  size_t count;
+  size_t capacity;
+  Value *constants;
+  size_t constant_count;
+  char **names;
+  VarCache *name_caches;  // one per name, for GETVAR
+  int *name_ids;          // interned, see intern_name
+  size_t name_count;
+  FunctionProto **protos;
+  size_t proto_count;
+  Stmt **nodes;
+  size_t node_count;
+  int max_registers;
+  unsigned long hotness;  // calls and back-edges, for jit_tick
+  JitCode *jit;
+};
+
+Chunk *create_chunk();
+size_t chunk_emit(Chunk *chunk, Instruction instruction);
+size_t chunk_add_constant(Chunk *chunk, Value value);
+size_t chunk_add_name(Chunk *chunk, const char *name);
+size_t chunk_add_proto(Chunk *chunk, FunctionProto *proto);
+size_t chunk_add_node(Chunk *chunk, Stmt *node);
+void free_chunk(Chunk *chunk);
+void disassemble_chunk(Chunk *chunk, const char *title);
+
+#endif  // CHUNK_H
@@ -0,0 +1,597 @@
+#include "compiler.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "chunk.h"
+#include "global.h"
+#include "malloc_safe.h"
+#include "values.h"
+
+#define LIST_BATCH 32
+#define DICT_BATCH 16
+
+// The innermost loop being compiled. break and continue pop the
+// environments entered since env_depth and jump; the jumps that go forward
+// are patched once their target is known. A '#' loop continues by jumping
+// back to continue_target, a '@' loop forward to its increment.
+typedef struct Loop {
+  struct Loop *enclosing;
+  int env_depth;
+  long continue_target;
+  size_t *breaks;
+  size_t break_count;
+  size_t *continues;
+  size_t continue_count;
+} Loop;
+
+typedef struct {
+  Chunk *chunk;
+  int free_reg;
+  int env_depth;  // environments pushed by this chunk so far
+  Loop *loop;
+} Compiler;
+
+// Operators with a dedicated opcode; OP_MOVE marks the ones that go through
+// OP_BINARY.
+static const OpCode fast_opcodes[BINARY_OPERATOR_COUNT] = {
+    [BIN_ADD] = OP_ADD, [BIN_SUB] = OP_SUB, [BIN_MUL] = OP_MUL,
+    [BIN_DIV] = OP_DIV, [BIN_LT] = OP_LT,   [BIN_LE] = OP_LE,
+    [BIN_GT] = OP_GT,   [BIN_GE] = OP_GE,   [BIN_EQ] = OP_EQ,
+    [BIN_NE] = OP_NE};
+
+static void compile_expr(Compiler *c, Stmt *node, int dst);
+
+static int alloc_regs(Compiler *c, int count) {
+  int reg = c->free_reg;
+  c->free_reg += count;
+  if (c->free_reg > MAX_REGISTERS) {
+    error("Expression too complex: out of VM registers.\n");
+  }
+  if (c->free_reg > c->chunk->max_registers) {
+    c->chunk->max_registers = c->free_reg;
+  }
+  return reg;
+}
+
+static void emit(Compiler *c, Instruction instruction) {
+  chunk_emit(c->chunk, instruction);
+}
+
+static size_t emit_jump(Compiler *c, OpCode op, int a) {
+  return chunk_emit(c->chunk, MAKE_ABX(op, a, 0));
+}
+
+static Instruction with_offset(Instruction i, long offset) {
+  if (offset < -JUMP_BIAS || offset > 0xffff - JUMP_BIAS) {
+    error("Block too large: jump offset out of range.\n");
+  }
+  return MAKE_ABX(GET_OP(i), GET_A(i), offset + JUMP_BIAS);
+}
+
+static void patch_jump(Compiler *c, size_t at) {
+  long offset = (long)c->chunk->count - (long)at - 1;
+  c->chunk->code[at] = with_offset(c->chunk->code[at], offset);
+}
+
+static void emit_loop(Compiler *c, size_t target) {
+  long offset = (long)target - (long)c->chunk->count - 1;
+  emit(c, with_offset(MAKE_ABX(OP_LOOP, 0, 0), offset));
+}
+
+static size_t name_index(Compiler *c, const char *name) {
+  return chunk_add_name(c->chunk, name);
+}
+
+// Blocks the resolver found to declare nothing get no environment at all.
+static void emit_push_env(Compiler *c, ScopeKind kind, int has_scope,
+                          size_t slot_count) {
+  if (!has_scope) {
+    return;
+  }
+  if (slot_count > 0xffff) {
+    error("Too many local variables in one scope.\n");
+  }
+  emit(c, MAKE_ABX(OP_PUSHENV, kind, slot_count));
+  c->env_depth++;
+}
+
+static void emit_pop_env(Compiler *c, int has_scope) {
+  if (has_scope) {
+    emit(c, MAKE_ABC(OP_POPENV, 0, 0, 0));
+    c->env_depth--;
+  }
+}
+
+static void begin_loop(Compiler *c, Loop *loop, long continue_target) {
+  loop->enclosing = c->loop;
+  loop->env_depth = c->env_depth;
+  loop->continue_target = continue_target;
+  loop->breaks = NULL;
+  loop->break_count = 0;
+  loop->continues = NULL;
+  loop->continue_count = 0;
+  c->loop = loop;
+}
+
+static void patch_jumps(Compiler *c, size_t *jumps, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    patch_jump(c, jumps[i]);
+  }
+}
+
+// Breaks land on the next instruction.
+static void end_loop(Compiler *c, Loop *loop) {
+  patch_jumps(c, loop->breaks, loop->break_count);
+  free_safe(loop->breaks);
+  free_safe(loop->continues);
+  c->loop = loop->enclosing;
+}
+
+static void add_jump(size_t **jumps, size_t *count, size_t at) {
+  *jumps = realloc_safe(*jumps, sizeof(size_t) * (*count + 1), "add_jump");
+  (*jumps)[(*count)++] = at;
+}
+
+// Like the tree walker, a loop left or restarted this way has nil as its
+// last value.
+static void compile_jump(Compiler *c, NodeType kind, int dst) {
+  Loop *loop = c->loop;
+  emit(c, MAKE_ABC(OP_LOADNIL, dst, 0, 0));
+  for (int depth = c->env_depth; depth > loop->env_depth; depth--) {
+    emit(c, MAKE_ABC(OP_POPENV, 0, 0, 0));
+  }
+  if (kind == ContinueAst && loop->continue_target >= 0) {
+    emit_loop(c, (size_t)loop->continue_target);
+  } else if (kind == ContinueAst) {
+    add_jump(&loop->continues, &loop->continue_count,
+             emit_jump(c, OP_JMP, 0));
+  } else {
+    add_jump(&loop->breaks, &loop->break_count, emit_jump(c, OP_JMP, 0));
+  }
+}
+
+// Variables the resolver gave a slot are addressed directly; everything else
+// goes through the name table.
+static void emit_get(Compiler *c, int dst, const char *name, int depth,
+                     int slot) {
+  if (slot < 0) {
+    emit(c, MAKE_ABX(OP_GETVAR, dst, name_index(c, name)));
+    return;
+  }
+  if (depth > 0xff || slot > 0xff) {
+    error("Too many nested scopes or local variables.\n");
+  }
+  emit(c, MAKE_ABC(OP_GETLOCAL, dst, depth, slot));
+}
+
+static void emit_set(Compiler *c, int src, const char *name, int depth,
+                     int slot) {
+  if (slot < 0) {
+    emit(c, MAKE_ABX(OP_SETVAR, src, name_index(c, name)));
+    return;
+  }
+  if (depth > 0xff || slot > 0xff) {
+    error("Too many nested scopes or local variables.\n");
+  }
+  emit(c, MAKE_ABC(OP_SETLOCAL, src, depth, slot));
+}
+
+static void emit_define(Compiler *c, int src, const char *name, int slot) {
+  if (slot < 0) {
+    emit(c, MAKE_ABX(OP_DEFVAR, src, name_index(c, name)));
+  } else {
+    emit(c, MAKE_ABX(OP_DEFLOCAL, src, slot));
+  }
+}
+
+static size_t constant_index(Compiler *c, Stmt *node) {
+  if (node->kind == NumericLiteralAst) {
+    return chunk_add_constant(c->chunk,
+                              NUMBER_VAL(((NumericLiteral *)node)->value));
+  }
+  StringLiteral *str_literal = (StringLiteral *)node;
+  if (str_literal->constant != NULL) {
+    return chunk_add_constant(c->chunk, OBJ_VAL(str_literal->constant));
+  }
+  return chunk_add_constant(c->chunk,
+                            OBJ_VAL(MK_TENURED_STRING(str_literal->value)));
+}
+
+// Returns an RK operand for literal nodes whose constant slot is small enough
+// to be encoded inline, or -1 when the node has to be computed into a
+// register.
+static int constant_operand(Compiler *c, Stmt *node) {
+  if (node->kind != NumericLiteralAst && node->kind != StringLiteralAst) {
+    return -1;
+  }
+  size_t index = constant_index(c, node);
+  if (index >= MAX_RK_CONSTANTS) {
+    return -1;
+  }
+  return RK_CONSTANT | (int)index;
+}
+
+static void compile_block(Compiler *c, Stmt **body, size_t body_count,
+                          int dst) {
+  if (body_count == 0) {
+    emit(c, MAKE_ABC(OP_LOADNIL, dst, 0, 0));
+    return;
+  }
+  for (size_t i = 0; i < body_count; i++) {
+    compile_expr(c, body[i], dst);
+  }
+}
+
+static void compile_binary(Compiler *c, BinaryExpr *binop, int dst) {
+  int saved = c->free_reg;
+  OpCode fast = fast_opcodes[binop->operator];
+  if (fast != OP_MOVE) {
+    int b = constant_operand(c, &(binop->left->stmt));
+    if (b < 0) {
+      compile_expr(c, &(binop->left->stmt), dst);
+      b = dst;
+    }
+    int rk = constant_operand(c, &(binop->right->stmt));
+    if (rk < 0) {
+      rk = alloc_regs(c, 1);
+      compile_expr(c, &(binop->right->stmt), rk);
+    }
+    emit(c, MAKE_ABC(fast, dst, b, rk));
+    c->free_reg = saved;
+    return;
+  }
+  compile_expr(c, &(binop->left->stmt), dst);
+  int rhs = alloc_regs(c, 1);
+  compile_expr(c, &(binop->right->stmt), rhs);
+  emit(c, MAKE_ABC(OP_BINARY, dst, dst, rhs));
+  emit(c, (Instruction)binop->operator);
+  c->free_reg = saved;
+}
+
+// JMPAND/JMPOR skip the right operand when the left one decides the result;
+// otherwise BINARY combines the two like any other operator.
+static void compile_logical(Compiler *c, LogicalExpr *logical, int dst) {
+  int saved = c->free_reg;
+  compile_expr(c, &(logical->left->stmt), dst);
+  OpCode op = logical->operator == BIN_OR ? OP_JMPOR : OP_JMPAND;
+  size_t to_end = emit_jump(c, op, dst);
+  int rhs = alloc_regs(c, 1);
+  compile_expr(c, &(logical->right->stmt), rhs);
+  emit(c, MAKE_ABC(OP_BINARY, dst, dst, rhs));
+  emit(c, (Instruction)logical->operator);
+  patch_jump(c, to_end);
+  c->free_reg = saved;
+}
+
+static void compile_if(Compiler *c, IfExpr *if_expr, int dst) {
+  // A literal `true` condition is what the optimizer leaves of a '?' whose
+  // branch is known; nothing else can run.
+  if (if_expr->condition->stmt.kind == BooleanLiteralAst &&
+      ((BooleanLiteral *)if_expr->condition)->value) {
+    emit_push_env(c, IF_SCOPE, if_expr->has_scope, if_expr->slot_count);
+    compile_block(c, if_expr->body, if_expr->body_count, dst);
+    emit_pop_env(c, if_expr->has_scope);
+    return;
+  }
+  emit_push_env(c, IF_SCOPE, if_expr->has_scope, if_expr->slot_count);
+  compile_expr(c, &(if_expr->condition->stmt), dst);
+  size_t to_else = emit_jump(c, OP_JMPFALSE_IF, dst);
+  compile_block(c, if_expr->body, if_expr->body_count, dst);
+  emit_pop_env(c, if_expr->has_scope);
+  size_t to_end = emit_jump(c, OP_JMP, 0);
+  patch_jump(c, to_else);
+  // The false path still has the '?' environment to leave.
+  c->env_depth += if_expr->has_scope;
+  emit_pop_env(c, if_expr->has_scope);
+  if (if_expr->else_if != NULL) {
+    compile_if(c, (IfExpr *)if_expr->else_if, dst);
+  } else if (if_expr->else_body != NULL) {
+    emit_push_env(c, ELSE_SCOPE, if_expr->else_has_scope,
+                  if_expr->else_slot_count);
+    compile_block(c, if_expr->else_body, if_expr->else_body_count, dst);
+    emit_pop_env(c, if_expr->else_has_scope);
+  } else {
+    emit(c, MAKE_ABC(OP_LOADNIL, dst, 0, 0));
+  }
+  patch_jump(c, to_end);
+}
+
+static void compile_while(Compiler *c, WhileExpr *while_expr, int dst) {
+  int saved = c->free_reg;
+  int cond = alloc_regs(c, 1);
+  emit_push_env(c, WHILE_SCOPE, while_expr->has_scope, while_expr->slot_count);
+  emit(c, MAKE_ABC(OP_LOADNIL, dst, 0, 0));
+  size_t loop_start = c->chunk->count;
+  compile_expr(c, &(while_expr->condition->stmt), cond);
+  size_t to_exit = emit_jump(c, OP_JMPFALSE_WHILE, cond);
+  Loop loop;
+  begin_loop(c, &loop, (long)loop_start);
+  for (size_t i = 0; i < while_expr->body_count; i++) {
+    compile_expr(c, while_expr->body[i], dst);
+  }
+  emit_loop(c, loop_start);
+  patch_jump(c, to_exit);
+  end_loop(c, &loop);
+  emit_pop_env(c, while_expr->has_scope);
+  c->free_reg = saved;
+}
+
+static void compile_for(Compiler *c, ForExpr *for_expr, int dst) {
+  int saved = c->free_reg;
+  int tmp = alloc_regs(c, 1);
+  emit_push_env(c, FOR_SCOPE, for_expr->has_scope, for_expr->slot_count);
+  emit(c, MAKE_ABC(OP_LOADNIL, dst, 0, 0));
+  compile_expr(c, &(for_expr->initialization->stmt), tmp);
+  size_t loop_start = c->chunk->count;
+  compile_expr(c, &(for_expr->condition->stmt), tmp);
+  size_t to_exit = emit_jump(c, OP_JMPFALSE_FOR, tmp);
+  Loop loop;
+  begin_loop(c, &loop, -1);
+  emit_push_env(c, FOR_LOOP_SCOPE, for_expr->body_has_scope,
+                for_expr->body_slot_count);
+  for (size_t i = 0; i < for_expr->body_count; i++) {
+    compile_expr(c, for_expr->body[i], dst);
+  }
+  emit_pop_env(c, for_expr->body_has_scope);
+  patch_jumps(c, loop.continues, loop.continue_count);
+  compile_expr(c, &(for_expr->increment->stmt), tmp);
+  emit_loop(c, loop_start);
+  patch_jump(c, to_exit);
+  end_loop(c, &loop);
+  emit_pop_env(c, for_expr->has_scope);
+  c->free_reg = saved;
+}
+
+static void compile_func_def(Compiler *c, FuncDef *func_def, int dst) {
+  FunctionProto *proto =
+      (FunctionProto *)malloc_safe(sizeof(FunctionProto), "FunctionProto");
+  proto->name = func_def->name;
+  proto->params = func_def->params;
+  proto->param_count = func_def->param_count;
+  proto->body = func_def->body;
+  proto->body_count = func_def->body_count;
+  proto->slot = func_def->slot;
+  proto->slot_count = func_def->slot_count;
+  proto->flat = func_def->flat;
+  proto->scope_depth = func_def->scope_depth;
+  proto->captures = func_def->captures;
+  proto->capture_count = func_def->capture_count;
+  proto->chunk = compile_function(func_def->body, func_def->body_count);
+  emit(c, MAKE_ABX(OP_CLOSURE, dst, chunk_add_proto(c->chunk, proto)));
+}
+
+static void compile_call(Compiler *c, CallExpr *call_expr, int dst) {
+  int saved = c->free_reg;
+  if (call_expr->arg_count >= MAX_REGISTERS) {
+    error("Too many arguments in function call.\n");
+  }
+  int base = alloc_regs(c, (int)call_expr->arg_count + 1);
+  compile_expr(c, &(call_expr->callee->stmt), base);
+  for (size_t i = 0; i < call_expr->arg_count; i++) {
+    compile_expr(c, &(call_expr->arguments[i]->stmt), base + 1 + (int)i);
+  }
+  if (call_expr->intrinsic != NO_INTRINSIC) {
+    emit(c, MAKE_ABC(OP_INTRINSIC, base, call_expr->intrinsic, 0));
+  }
+  emit(c, MAKE_ABC(call_expr->is_tail ? OP_TAILCALL : OP_CALL, base,
+                   call_expr->arg_count, 0));
+  if (dst != base) {
+    emit(c, MAKE_ABC(OP_MOVE, dst, base, 0));
+  }
+  c->free_reg = saved;
+}
+
+static void compile_list_literal(Compiler *c, ListLiteral *list_lit, int dst) {
+  size_t capacity = list_lit->element_count * 2;
+  emit(c, MAKE_ABX(OP_NEWLIST, dst, capacity > 0xffff ? 0xffff : capacity));
+  for (size_t i = 0; i < list_lit->element_count; i += LIST_BATCH) {
+    int saved = c->free_reg;
+    size_t batch = list_lit->element_count - i;
+    if (batch > LIST_BATCH) {
+      batch = LIST_BATCH;
+    }
+    int base = alloc_regs(c, (int)batch);
+    for (size_t j = 0; j < batch; j++) {
+      compile_expr(c, &(list_lit->elements[i + j]->stmt), base + (int)j);
+    }
+    emit(c, MAKE_ABC(OP_LISTAPPEND, dst, base, batch));
+    c->free_reg = saved;
+  }
+}
+
+static void compile_dict_literal(Compiler *c, DictLiteral *dict_lit, int dst) {
+  size_t count = dict_lit->element_count;
+  emit(c, MAKE_ABX(OP_NEWDICT, dst, count > 0x7fff ? 0x7fff : count));
+  for (size_t i = 0; i < count; i += DICT_BATCH) {
+    int saved = c->free_reg;
+    size_t batch = count - i;
+    if (batch > DICT_BATCH) {
+      batch = DICT_BATCH;
+    }
+    int base = alloc_regs(c, (int)batch * 2);
+    for (size_t j = 0; j < batch; j++) {
+      compile_expr(c, &(dict_lit->keys[i + j]->stmt), base + 2 * (int)j);
+      compile_expr(c, &(dict_lit->values[i + j]->stmt), base + 2 * (int)j + 1);
+    }
+    emit(c, MAKE_ABC(OP_DICTPUT, dst, base, batch));
+    c->free_reg = saved;
+  }
+}
+
+static void compile_list_index(Compiler *c, ListIndex *list_index, int dst) {
+  int saved = c->free_reg;
+  compile_expr(c, &(list_index->list->stmt), dst);
+  int start = alloc_regs(c, 1);
+  compile_expr(c, &(list_index->start->stmt), start);
+  if (!list_index->is_slice) {
+    emit(c, MAKE_ABC(OP_INDEX, dst, dst, start));
+  } else if (list_index->end != NULL) {
+    int end = alloc_regs(c, 1);
+    compile_expr(c, &(list_index->end->stmt), end);
+    emit(c, MAKE_ABC(OP_SLICE, dst, dst, start));
+  } else {
+    emit(c, MAKE_ABC(OP_SLICEOPEN, dst, dst, start));
+  }
+  c->free_reg = saved;
+}
+
+static void compile_expr(Compiler *c, Stmt *node, int dst) {
+  switch (node->kind) {
+  case NumericLiteralAst:
+  case StringLiteralAst: {
+    emit(c, MAKE_ABX(OP_LOADK, dst, constant_index(c, node)));
+    break;
+  }
+  case BooleanLiteralAst: {
+    emit(c, MAKE_ABC(OP_LOADBOOL, dst, ((BooleanLiteral *)node)->value, 0));
+    break;
+  }
+  case NilAst: {
+    emit(c, MAKE_ABC(OP_LOADNIL, dst, 0, 0));
+    break;
+  }
+  case IdentifierAst: {
+    Identifier *ident = (Identifier *)node;
+    emit_get(c, dst, ident->symbol, ident->depth, ident->slot);
+    break;
+  }
+  case UnaryExprAst: {
+    UnaryExpr *unary = (UnaryExpr *)node;
+    compile_expr(c, &(unary->expr->stmt), dst);
+    OpCode op = strcmp(unary->operator, "-") == 0 ? OP_UNM : OP_UPLUS;
+    emit(c, MAKE_ABC(op, dst, dst, 0));
+    break;
+  }
+  case BinaryExprAst: {
+    compile_binary(c, (BinaryExpr *)node, dst);
+    break;
+  }
+  case LogicalExprAst: {
+    compile_logical(c, (LogicalExpr *)node, dst);
+    break;
+  }
+  case VarDeclarationAst: {
+    VarDeclaration *var = (VarDeclaration *)node;
+    compile_expr(c, &(var->value->stmt), dst);
+    emit_define(c, dst, var->varname, var->slot);
+    break;
+  }
+  case AssignVarAst: {
+    AssignVar *var = (AssignVar *)node;
+    compile_expr(c, &(var->value->stmt), dst);
+    emit_set(c, dst, var->varname, var->depth, var->slot);
+    break;
+  }
+  case AssignListVarAst: {
+    AssignListVar *var = (AssignListVar *)node;
+    int saved = c->free_reg;
+    compile_expr(c, &(var->value->stmt), dst);
+    int index = alloc_regs(c, 1);
+    compile_expr(c, &(var->index->stmt), index);
+    int list = alloc_regs(c, 1);
+    emit_get(c, list, var->varname, var->depth, var->slot);
+    emit(c, MAKE_ABC(OP_SETINDEX, list, index, dst));
+    c->free_reg = saved;
+    break;
+  }
+  case AssignDictVarAst: {
+    AssignDictVar *var = (AssignDictVar *)node;
+    int saved = c->free_reg;
+    compile_expr(c, &(var->value->stmt), dst);
+    int key = alloc_regs(c, 1);
+    compile_expr(c, &(var->key->stmt), key);
+    int dict = alloc_regs(c, 1);
+    emit_get(c, dict, var->varname, var->depth, var->slot);
+    emit(c, MAKE_ABC(OP_SETKEY, dict, key, dst));
+    c->free_reg = saved;
+    break;
+  }
+  case IfAst: {
+    compile_if(c, (IfExpr *)node, dst);
+    break;
+  }
+  case WhileAst: {
+    compile_while(c, (WhileExpr *)node, dst);
+    break;
+  }
+  case ForAst: {
+    compile_for(c, (ForExpr *)node, dst);
+    break;
+  }
+  case FuncDefAst: {
+    compile_func_def(c, (FuncDef *)node, dst);
+    break;
+  }
+  case CallExprAst: {
+    compile_call(c, (CallExpr *)node, dst);
+    break;
+  }
+  case ListLiteralAst: {
+    compile_list_literal(c, (ListLiteral *)node, dst);
+    break;
+  }
+  case DictLiteralAst: {
+    compile_dict_literal(c, (DictLiteral *)node, dst);
+    break;
+  }
+  case TableLiteralAst: {
+    emit(c, MAKE_ABX(OP_NEWTABLE, dst, chunk_add_node(c->chunk, node)));
+    break;
+  }
+  case ListIndexAst: {
+    compile_list_index(c, (ListIndex *)node, dst);
+    break;
+  }
+  case DictKeyAst: {
+    DictKey *dict_key = (DictKey *)node;
+    int saved = c->free_reg;
+    compile_expr(c, &(dict_key->dict->stmt), dst);
+    int key = alloc_regs(c, 1);
+    compile_expr(c, &(dict_key->key->stmt), key);
+    emit(c, MAKE_ABC(OP_GETKEY, dst, dst, key));
+    c->free_reg = saved;
+    break;
+  }
+  case ImportAst: {
+    emit(c, MAKE_ABX(OP_EVALAST, dst, chunk_add_node(c->chunk, node)));
+    break;
+  }
+  case BreakAst:
+  case ContinueAst: {
+    compile_jump(c, node->kind, dst);
+    break;
+  }
+  case ReturnAst: {
+    compile_expr(c, &(((ReturnExpr *)node)->value->stmt), dst);
+    emit(c, MAKE_ABC(OP_RETURN, dst, 0, 0));
+    break;
+  }
+  default: {
+    error("This AST Node has not yet been setup for compilation.\n");
+  }
+  }
+}
+
+static Chunk *compile_body(Stmt **body, size_t body_count) {
+  Compiler compiler;
+  compiler.chunk = create_chunk();
+  compiler.free_reg = 0;
+  compiler.env_depth = 0;
+  compiler.loop = NULL;
+  int result = alloc_regs(&compiler, 1);
+  compile_block(&compiler, body, body_count, result);
+  emit(&compiler, MAKE_ABC(OP_RETURN, result, 0, 0));
+  return compiler.chunk;
+}
+
+Chunk *compile_program(Program *program) {
+  return compile_body(program->body, program->body_count);
+}
+
+Chunk *compile_function(Stmt **body, size_t body_count) {
+  return compile_body(body, body_count);
+}
@@ -0,0 +1,10 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "ast.h"
+#include "chunk.h"
+
+Chunk *compile_program(Program *program);
+Chunk *compile_function(Stmt **body, size_t body_count);
+
+#endif  // COMPILER_H
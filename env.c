@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "gc.h"
 #include "global.h"
 #include "hash.h"
 #include "malloc_safe.h"
@@ -12,20 +13,264 @@
 #define INITIAL_CAPACITY 16
 #define LOAD_FACTOR_THRESHOLD 0.75
 
-Environment *create_environment(Environment *parent, char *scope_name) {
-  Environment *env = (Environment *)malloc_safe(
-      sizeof(Environment), "Failed to allocate memory for Environment");
+unsigned long binding_version = 1;
+
+GlobalSlot *global_slots = NULL;
+static size_t global_count = 0;
+static size_t global_capacity = 0;
+static Environment *global_env = NULL;
+
+// Open addressing from name to index in global_slots; -1 marks a free entry.
+static int *intern_table = NULL;
+static size_t intern_capacity = 0;
+
+// An environment of class c has room for 1 << c slots and a table of class
+// c holds INITIAL_CAPACITY << c entries. Larger ones bypass the pool, and
+// each free list keeps at most POOL_MAX_FREE blocks.
+#define ENV_POOL_CLASSES 8
+#define TABLE_POOL_CLASSES 4
+#define POOL_MAX_FREE 4096
+
+typedef struct PoolBlock {
+  struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct {
+  PoolBlock *head;
+  size_t count;
+} FreeList;
+
+static FreeList env_pool[ENV_POOL_CLASSES];
+static FreeList table_pool[TABLE_POOL_CLASSES];
+EnvPoolStats env_pool_stats;
+
+static void *pool_take(FreeList *list) {
+  PoolBlock *block = list->head;
+  if (block != NULL) {
+    list->head = block->next;
+    list->count--;
+  }
+  return block;
+}
+
+static int pool_give(FreeList *list, void *memory) {
+  if (list->count == POOL_MAX_FREE) {
+    return 0;
+  }
+  PoolBlock *block = (PoolBlock *)memory;
+  block->next = list->head;
+  list->head = block;
+  list->count++;
+  return 1;
+}
+
+static void pool_drain(FreeList *list) {
+  void *memory;
+  while ((memory = pool_take(list)) != NULL) {
+    free(memory);
+  }
+}
+
+static int env_class(size_t slot_count) {
+  int size_class = 0;
+  while (((size_t)1 << size_class) < slot_count) {
+    size_class++;
+  }
+  return size_class;
+}
+
+static int table_class(size_t capacity) {
+  int size_class = 0;
+  while (((size_t)INITIAL_CAPACITY << size_class) < capacity) {
+    size_class++;
+  }
+  return size_class;
+}
+
+// Called by gc_allocate_env, which fills in the header.
+Environment *env_pool_alloc(size_t slot_count) {
+  int size_class = env_class(slot_count);
+  if (size_class < ENV_POOL_CLASSES) {
+    Environment *env = pool_take(&env_pool[size_class]);
+    if (env != NULL) {
+      env_pool_stats.env_hits++;
+      return env;
+    }
+    slot_count = (size_t)1 << size_class;
+  }
+  env_pool_stats.env_misses++;
+  return malloc_safe(sizeof(Environment) + sizeof(Value) * slot_count,
+                     "env_pool_alloc");
+}
+
+static void env_pool_release(Environment *env) {
+  int size_class = env_class(env->slot_count);
+  if (size_class >= ENV_POOL_CLASSES ||
+      !pool_give(&env_pool[size_class], env)) {
+    free(env);
+  }
+}
+
+static HashEntry *allocate_table(size_t capacity) {
+  int size_class = table_class(capacity);
+  if (size_class < TABLE_POOL_CLASSES) {
+    HashEntry *entries = pool_take(&table_pool[size_class]);
+    if (entries != NULL) {
+      env_pool_stats.table_hits++;
+      memset(entries, 0, sizeof(HashEntry) * capacity);
+      return entries;
+    }
+  }
+  env_pool_stats.table_misses++;
+  return (HashEntry *)calloc(capacity, sizeof(HashEntry));
+}
+
+static void release_table(HashEntry *entries, size_t capacity) {
+  int size_class = table_class(capacity);
+  if (size_class >= TABLE_POOL_CLASSES ||
+      !pool_give(&table_pool[size_class], entries)) {
+    free(entries);
+  }
+}
+
+void env_pool_free_all() {
+  for (int i = 0; i < ENV_POOL_CLASSES; i++) {
+    pool_drain(&env_pool[i]);
+  }
+  for (int i = 0; i < TABLE_POOL_CLASSES; i++) {
+    pool_drain(&table_pool[i]);
+  }
+}
+
+Environment *create_local_environment(Environment *parent, char *scope_name,
+                                      size_t slot_count) {
+  Environment *env = gc_allocate_env(slot_count);
   env->parent = parent;
-  env->capacity = INITIAL_CAPACITY;
+  env->slot_count = slot_count;
+  env->slots = (Value *)(env + 1);
+  for (size_t i = 0; i < slot_count; i++) {
+    env->slots[i] = EMPTY_VAL;
+  }
+  env->capacity = 0;
   env->size = 0;
-  env->entries = (HashEntry *)calloc(env->capacity, sizeof(HashEntry));
+  env->entries = NULL;
   env->scope_name = scope_name;
   return env;
 }
 
+// The values a flat closure captures, copied out of the environment it is
+// defined in, under the top-level environment. A closure that captures
+// nothing uses the top-level environment itself.
+Environment *create_closure_env(Environment *env, int scope_depth,
+                                Capture *captures, size_t capture_count) {
+  Environment *top = env_ancestor(env, scope_depth);
+  if (capture_count == 0) {
+    return top;
+  }
+  Environment *closure_env =
+      create_local_environment(top, "closure_env", capture_count);
+  for (size_t i = 0; i < capture_count; i++) {
+    closure_env->slots[i] =
+        lookup_slot(env, captures[i].depth, captures[i].slot);
+  }
+  return closure_env;
+}
+
+static int find_name(const char *name) {
+  if (intern_capacity == 0) {
+    return -1;
+  }
+  size_t index = hash(name, intern_capacity);
+  while (intern_table[index] >= 0) {
+    if (strcmp(global_slots[intern_table[index]].name, name) == 0) {
+      return intern_table[index];
+    }
+    index = (index + 1) % intern_capacity;
+  }
+  return -1;
+}
+
+static void insert_name(int name_id) {
+  size_t index = hash(global_slots[name_id].name, intern_capacity);
+  while (intern_table[index] >= 0) {
+    index = (index + 1) % intern_capacity;
+  }
+  intern_table[index] = name_id;
+}
+
+static void grow_intern_table() {
+  free_safe(intern_table);
+  intern_capacity = intern_capacity == 0 ? 64 : intern_capacity * 2;
+  intern_table = malloc_safe(sizeof(int) * intern_capacity, "intern_table");
+  memset(intern_table, -1, sizeof(int) * intern_capacity);
+  for (size_t i = 0; i < global_count; i++) {
+    insert_name((int)i);
+  }
+}
+
+// Gives every distinct name a small integer, which is also its slot in the
+// global table.
+int intern_name(const char *name) {
+  int name_id = find_name(name);
+  if (name_id >= 0) {
+    return name_id;
+  }
+  if (global_count == global_capacity) {
+    global_capacity = global_capacity == 0 ? 64 : global_capacity * 2;
+    global_slots = realloc_safe(global_slots,
+                                sizeof(GlobalSlot) * global_capacity,
+                                "intern_name");
+    binding_version++;
+  }
+  if ((global_count + 1) * 2 > intern_capacity) {
+    grow_intern_table();
+  }
+  name_id = (int)global_count++;
+  global_slots[name_id] = (GlobalSlot){strdup(name), EMPTY_VAL, 1, 0};
+  insert_name(name_id);
+  return name_id;
+}
+
+Environment *create_global_environment() {
+  global_env = create_local_environment(NULL, "global", 0);
+  return global_env;
+}
+
+void env_mark_globals() {
+  for (size_t i = 0; i < global_count; i++) {
+    gc_mark_value(global_slots[i].value);
+  }
+}
+
+void env_promote_globals() {
+  for (size_t i = 0; i < global_count; i++) {
+    gc_promote_slot(&global_slots[i].value);
+  }
+}
+
+void env_free_globals() {
+  for (size_t i = 0; i < global_count; i++) {
+    free(global_slots[i].name);
+  }
+  free_safe(global_slots);
+  free_safe(intern_table);
+  global_slots = NULL;
+  intern_table = NULL;
+  global_count = global_capacity = intern_capacity = 0;
+  global_env = NULL;
+}
+
+Environment *create_environment(Environment *parent, char *scope_name) {
+  Environment *env = create_local_environment(parent, scope_name, 0);
+  env->capacity = INITIAL_CAPACITY;
+  env->entries = allocate_table(env->capacity);
+  gc_track_bytes(sizeof(HashEntry) * env->capacity);
+  return env;
+}
+
 static void resize_hash_table(Environment *env) {
   size_t new_capacity = env->capacity * 2;
-  HashEntry *new_entries = (HashEntry *)calloc(new_capacity, sizeof(HashEntry));
+  HashEntry *new_entries = allocate_table(new_capacity);
 
   for (size_t i = 0; i < env->capacity; i++) {
     if (env->entries[i].key != NULL) {
@@ -37,12 +282,34 @@ static void resize_hash_table(Environment *env) {
     }
   }
 
-  free_safe(env->entries);
+  release_table(env->entries, env->capacity);
   env->entries = new_entries;
   env->capacity = new_capacity;
 }
 
-void declare_var(Environment *env, const char *varname, RuntimeVal *value) {
+static void redeclaration_error(const char *varname) {
+  char error_message[100];
+  snprintf(error_message, sizeof(error_message),
+           "Cannot declare variable %s. It is already defined.\n", varname);
+  error(error_message);
+}
+
+void declare_var(Environment *env, const char *varname, Value value) {
+  if (env == global_env) {
+    int name_id = intern_name(varname);
+    GlobalSlot *global = &global_slots[name_id];
+    if (global->value != EMPTY_VAL) {
+      redeclaration_error(varname);
+    }
+    global->value = value;
+    global->version++;
+    return;
+  }
+  if (env->entries == NULL) {
+    env->capacity = INITIAL_CAPACITY;
+    env->entries = allocate_table(env->capacity);
+    gc_track_bytes(sizeof(HashEntry) * env->capacity);
+  }
   if ((float)env->size / env->capacity >= LOAD_FACTOR_THRESHOLD) {
     resize_hash_table(env);
   }
@@ -50,75 +317,117 @@ void declare_var(Environment *env, const char *varname, RuntimeVal *value) {
   size_t index = hash(varname, env->capacity);
   while (env->entries[index].key != NULL) {
     if (strcmp(env->entries[index].key, varname) == 0) {
-      char error_message[100];
-      snprintf(error_message, sizeof(error_message),
-               "Cannot declare variable %s. It is already defined.\n", varname);
-      error(error_message);
+      redeclaration_error(varname);
     }
     index = (index + 1) % env->capacity;
   }
   env->entries[index].key = strdup(varname);
   env->entries[index].value = value;
   env->size++;
+  int name_id = intern_name(varname);
+  global_slots[name_id].shadows++;
+  binding_version++;
+  gc_write_barrier(&env->base, value);
 }
 
-void assign_var(Environment *env, const char *varname, RuntimeVal *value) {
-  Environment *resolved_env = resolve(env, varname);
-  size_t index = hash(varname, resolved_env->capacity);
-
-  while (resolved_env->entries[index].key != NULL) {
-    if (strcmp(resolved_env->entries[index].key, varname) == 0) {
-      resolved_env->entries[index].value = value;
-      return;
+static HashEntry *find_entry(Environment *env, const char *varname) {
+  if (env->entries == NULL) {
+    return NULL;
+  }
+  size_t index = hash(varname, env->capacity);
+  while (env->entries[index].key != NULL) {
+    if (strcmp(env->entries[index].key, varname) == 0) {
+      return &env->entries[index];
     }
-    index = (index + 1) % resolved_env->capacity;
+    index = (index + 1) % env->capacity;
   }
+  return NULL;
 }
 
-RuntimeVal *lookup_var(Environment *env, const char *varname) {
-  Environment *resolved_env = resolve(env, varname);
-  size_t index = hash(varname, resolved_env->capacity);
+static Value *find_binding(Environment *env, const char *varname) {
+  if (env == global_env) {
+    int name_id = find_name(varname);
+    if (name_id < 0 || global_slots[name_id].value == EMPTY_VAL) {
+      return NULL;
+    }
+    return &global_slots[name_id].value;
+  }
+  HashEntry *entry = find_entry(env, varname);
+  return entry != NULL ? &entry->value : NULL;
+}
 
-  while (resolved_env->entries[index].key != NULL) {
-    if (strcmp(resolved_env->entries[index].key, varname) == 0) {
-      RuntimeVal *value = resolved_env->entries[index].value;
-      return value;
+static Value *resolve_binding(Environment *env, const char *varname,
+                              Environment **owner) {
+  for (Environment *current = env; current != NULL;
+       current = current->parent) {
+    Value *binding = find_binding(current, varname);
+    if (binding != NULL) {
+      *owner = current;
+      return binding;
     }
-    index = (index + 1) % resolved_env->capacity;
   }
   char error_message[100];
   snprintf(error_message, sizeof(error_message),
-           "Value not found for variable %s\n", varname);
+           "Cannot resolve variable '%s' as it does not exist.", varname);
   error(error_message);
+  return NULL;
 }
 
-Environment *resolve(Environment *env, const char *varname) {
-  Environment *current = env;
-
-  while (current != NULL) {
-    size_t index = hash(varname, current->capacity);
+void assign_var(Environment *env, const char *varname, Value value) {
+  Environment *owner;
+  Value *binding = resolve_binding(env, varname, &owner);
+  if (value_type(*binding) == FUNCTION_T) {
+    binding_version++;
+  }
+  *binding = value;
+  if (owner == global_env) {
+    global_slots[find_name(varname)].version++;
+  } else {
+    gc_write_barrier(&owner->base, value);
+  }
+}
 
-    while (current->entries[index].key != NULL) {
-      if (strcmp(current->entries[index].key, varname) == 0) {
-        return current;
-      }
-      index = (index + 1) % current->capacity;
-    }
+Value lookup_var(Environment *env, const char *varname) {
+  Environment *owner;
+  return *resolve_binding(env, varname, &owner);
+}
 
-    current = current->parent;
+Value *lookup_var_cached(Environment *env, const char *varname,
+                         VarCache *cache) {
+  if (var_cache_hit(env, cache)) {
+    return cache->binding;
   }
-  char error_message[100];
-  snprintf(error_message, sizeof(error_message),
-           "Cannot resolve variable '%s' as it does not exist.", varname);
-  error(error_message);
+  Environment *owner;
+  Value *binding = resolve_binding(env, varname, &owner);
+  Environment *scope = env;
+  while (scope != NULL && scope->entries == NULL) {
+    scope = scope->parent;
+  }
+  cache->version = binding_version;
+  cache->scope = scope;
+  cache->binding = binding;
+  return binding;
 }
 
+// A slot is read before its declaration ran, e.g. a nested function calling
+// a sibling that is declared further down.
+void undeclared_slot_error() {
+  error("Variable used before its declaration.\n");
+}
+
+// Called by the collector once nothing references the environment.
 void free_environment(Environment *env) {
+  if (env->entries != NULL) {
+    binding_version++;
+  }
   for (size_t i = 0; i < env->capacity; i++) {
     if (env->entries[i].key != NULL) {
+      global_slots[find_name(env->entries[i].key)].shadows--;
       free(env->entries[i].key);
     }
   }
-  free(env->entries);
-  free(env);
+  if (env->entries != NULL) {
+    release_table(env->entries, env->capacity);
+  }
+  env_pool_release(env);
 }
@@ -8,11 +8,19 @@
 
 typedef struct {
   char *key;
-  RuntimeVal *value;
+  Value value;
 } HashEntry;
 
+// Variables the resolver could place live in `slots` and are reached by
+// (depth, slot). Names that are only known at run time (globals, module
+// scope, REPL lines, imports) go to the hash table, which block and function
+// environments only allocate on first use. Environments are collected like
+// any other heap object, since closures keep theirs alive.
 struct Environment {
+  RuntimeVal base;
   Environment *parent;
+  Value *slots;
+  size_t slot_count;
   HashEntry *entries;
   size_t capacity;
   size_t size;
@@ -21,10 +29,119 @@ struct Environment {
 
 Environment *create_env();
 Environment *create_environment(Environment *parent, char *scope_name);
-void declare_var(Environment *env, const char *varname, RuntimeVal *value);
-void assign_var(Environment *env, const char *varname, RuntimeVal *value);
-RuntimeVal *lookup_var(Environment *env, const char *varname);
-Environment *resolve(Environment *env, const char *varname);
+Environment *create_local_environment(Environment *parent, char *scope_name,
+                                      size_t slot_count);
+Environment *create_closure_env(Environment *env, int scope_depth,
+                                Capture *captures, size_t capture_count);
+void declare_var(Environment *env, const char *varname, Value value);
+void assign_var(Environment *env, const char *varname, Value value);
+Value lookup_var(Environment *env, const char *varname);
+Value *lookup_var_cached(Environment *env, const char *varname,
+                         VarCache *cache);
+void undeclared_slot_error();
 void free_environment(Environment *env);
 
+// Environments and hash tables are recycled through per-size-class free
+// lists (env.c); the counts tell how often a request was served from them.
+typedef struct {
+  unsigned long env_hits;
+  unsigned long env_misses;
+  unsigned long table_hits;
+  unsigned long table_misses;
+} EnvPoolStats;
+
+extern EnvPoolStats env_pool_stats;
+
+Environment *env_pool_alloc(size_t slot_count);
+void env_pool_free_all();
+
+// Bumped whenever a named binding is added, a function bound to a name is
+// replaced, an environment with named bindings is freed or the global slot
+// table moves.
+extern unsigned long binding_version;
+
+// The global environment keeps its bindings in a table indexed by interned
+// name (intern_name) rather than in a hash table. `shadows` counts the other
+// hashed environments (modules, imports inside functions) binding the same
+// name; while it is 0 the global slot is the only binding a lookup by name
+// can find, so code goes straight to it without walking any scope.
+// `version` changes with every write to the global binding, so a call site
+// that checked the function found there only has to compare it.
+typedef struct {
+  char *name;
+  Value value;  // EMPTY_VAL while the global environment does not bind it
+  unsigned long version;
+  size_t shadows;
+} GlobalSlot;
+
+extern GlobalSlot *global_slots;
+
+Environment *create_global_environment();
+int intern_name(const char *name);
+void env_mark_globals();
+void env_promote_globals();
+void env_free_globals();
+
+static inline GlobalSlot *unshadowed_global(int name_id) {
+  GlobalSlot *global = &global_slots[name_id];
+  if (global->shadows != 0 || global->value == EMPTY_VAL) {
+    return NULL;
+  }
+  return global;
+}
+
+// Hash tables only ever gain names through declare_var, and the chain above
+// an environment never changes, so a cached lookup stays valid as long as no
+// binding changed and the search still starts from the same first
+// environment with named bindings.
+static inline int var_cache_hit(Environment *env, VarCache *cache) {
+  if (cache->version != binding_version) {
+    return 0;
+  }
+  while (env != NULL && env->entries == NULL) {
+    env = env->parent;
+  }
+  return env == cache->scope;
+}
+
+// A name looked up by name, `name_id` being its interned id.
+static inline Value lookup_name(Environment *env, const char *name,
+                                int name_id, VarCache *cache) {
+  GlobalSlot *global = unshadowed_global(name_id);
+  if (global != NULL) {
+    return global->value;
+  }
+  return *lookup_var_cached(env, name, cache);
+}
+
+static inline Environment *env_ancestor(Environment *env, int depth) {
+  while (depth-- > 0) {
+    env = env->parent;
+  }
+  return env;
+}
+
+static inline Value lookup_slot(Environment *env, int depth, int slot) {
+  Value value = env_ancestor(env, depth)->slots[slot];
+  if (value == EMPTY_VAL) {
+    undeclared_slot_error();
+  }
+  return value;
+}
+
+static inline void assign_slot(Environment *env, int depth, int slot,
+                               Value value) {
+  Environment *target = env_ancestor(env, depth);
+  if (target->slots[slot] == EMPTY_VAL) {
+    undeclared_slot_error();
+  }
+  target->slots[slot] = value;
+  gc_write_barrier(&target->base, value);
+}
+
+static inline void define_slot(Environment *env, int slot, Value value) {
+  env->slots[slot] = value;
+  gc_write_barrier(&env->base, value);
+}
+
 #endif  // ENVIRONMENT_H
@@ -1,20 +1,28 @@
 #include "eval.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
+#include "builtins.h"
 #include "env.h"
+#include "gc.h"
 #include "global.h"
 #include "hash.h"
 #include "malloc_safe.h"
 #include "native_modules.h"
 #include "parser.h"
 #include "values.h"
+#include "vm.h"
 
 #ifdef _WIN32
 #define PATH_SEPARATOR "\\"
@@ -22,13 +30,29 @@
 #define PATH_SEPARATOR "/"
 #endif
 
-RuntimeVal *eval_binary_expr_evaluated(RuntimeVal *lhs, RuntimeVal *rhs,
-                                       const char *operator);
-char *runtime_value_to_string(RuntimeVal *val);
-Expr *runtime_value_to_expr(RuntimeVal *val);
-
-RuntimeVal *eval_program(Program *program, Environment *env) {
-  RuntimeVal *lastEvaluated = (RuntimeVal *)MK_NIL();
+Expr *runtime_value_to_expr(Value val);
+
+// break, continue and return do not unwind the C stack: they record a status.
+// Every expression returns as soon as one of its operands sets it (jumped)
+// and every sequence of statements (eval_block) stops before its next
+// statement. Loops consume break and continue; eval_call_expr takes the value
+// of a return.
+typedef enum {
+  CONTROL_NONE,
+  CONTROL_BREAK,
+  CONTROL_CONTINUE,
+  CONTROL_RETURN
+} ControlStatus;
+
+static struct {
+  ControlStatus status;
+  Value value;
+} control;
+
+static int jumped() { return control.status != CONTROL_NONE; }
+
+Value eval_program(Program *program, Environment *env) {
+  Value lastEvaluated = NIL_VAL;
   if (program->body_count == 0) {
     return lastEvaluated;
   }
@@ -38,533 +62,875 @@ RuntimeVal *eval_program(Program *program, Environment *env) {
   return lastEvaluated;
 }
 
-NumberVal *eval_numeric_binary_expr(NumberVal *lhs, NumberVal *rhs,
-                                    const char *operator) {
-  double result;
-  int isComparison = 0;
-
-  if (!strcmp(operator, "+")) {
-    result = lhs->value + rhs->value;
-  } else if (!strcmp(operator, "-")) {
-    result = lhs->value - rhs->value;
-  } else if (!strcmp(operator, "*")) {
-    result = lhs->value * rhs->value;
-  } else if (!strcmp(operator, "/")) {
-    if (rhs->value == 0) {
-      error("Error: Division by zero\n");
-    }
-    result = lhs->value / rhs->value;
-  } else if (!strcmp(operator, "%")) {
-    result = (int)lhs->value % (int)rhs->value;
-  } else if (!strcmp(operator, "**")) {
-    result = pow(lhs->value, rhs->value);
-  } else if (!strcmp(operator, ">")) {
-    result = (int)(lhs->value > rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, ">=")) {
-    result = (int)(lhs->value >= rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "<")) {
-    result = (int)(lhs->value < rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "<=")) {
-    result = (int)(lhs->value <= rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "==")) {
-    result = (int)(lhs->value == rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "!=")) {
-    result = (int)(lhs->value != rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "&&")) {
-    result = (int)(lhs->value && rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "||")) {
-    result = (int)(lhs->value || rhs->value);
-    isComparison = 1;
-  } else if (!strcmp(operator, "&")) {
-    result = (int)lhs->value & (int)rhs->value;
-  } else if (!strcmp(operator, "|")) {
-    result = (int)lhs->value | (int)rhs->value;
-  } else if (!strcmp(operator, "^")) {
-    result = (int)lhs->value ^ (int)rhs->value;
-  } else if (!strcmp(operator, "<<")) {
-    result = (int)lhs->value << (int)rhs->value;
-  } else if (!strcmp(operator, ">>")) {
-    result = (int)lhs->value >> (int)rhs->value;
+// Names the resolver left without a slot are looked up by name.
+static Value lookup_resolved(Environment *env, const char *name, int depth,
+                             int slot) {
+  if (slot < 0) {
+    return lookup_var(env, name);
+  }
+  return lookup_slot(env, depth, slot);
+}
+
+// Only the global environment binds the name: read its slot directly.
+static GlobalSlot *ident_global(Identifier *ident) {
+  if (ident->name_id < 0) {
+    return NULL;
+  }
+  return unshadowed_global(ident->name_id);
+}
+
+Value eval_var_expr(VarDeclaration *var, Environment *env) {
+  Value value = evaluate(&(var->value->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  if (var->slot < 0) {
+    declare_var(env, var->varname, value);
   } else {
-    char error_message[100];
-    snprintf(error_message, sizeof(error_message),
-             "Error: Unknown operator '%s'\n", operator);
-    error(error_message);
+    define_slot(env, var->slot, value);
+  }
+  return value;
+}
+
+Value eval_string_literal(StringLiteral *str_literal) {
+  if (str_literal->constant != NULL) {
+    return OBJ_VAL(str_literal->constant);
   }
+  return OBJ_VAL(MK_STRING(str_literal->value));
+}
 
-  if (isComparison) {
-    return (NumberVal *)MK_BOOL(result);
+Value eval_assign_var_expr(AssignVar *var, Environment *env) {
+  Value value = evaluate(&(var->value->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  if (var->slot < 0) {
+    assign_var(env, var->varname, value);
   } else {
-    return MK_NUMBER(result);
-  }
-}
-
-ListVal *eval_list_binary_expr(ListVal *lhs, ListVal *rhs,
-                               const char *operator) {
-  ListVal *new_list = NULL;
-  if (!strcmp(operator, "*")) {
-    size_t result_size = lhs->size * rhs->size;
-    new_list = MK_LIST(result_size);
-    size_t index = 0;
-    for (size_t i = 0; i < lhs->size; i++) {
-      for (size_t j = 0; j < rhs->size; j++) {
-        ListVal *pair = MK_LIST(2);
-        pair->items[0] = lhs->items[i];
-        pair->items[1] = rhs->items[j];
-        pair->size = 2;
-        new_list->items[index] = (RuntimeVal *)pair;
-        index++;
-      }
-    }
-    new_list->size = result_size;
-  } else if (!strcmp(operator, "+")) {
-    new_list = MK_LIST(lhs->capacity + rhs->capacity);
-    new_list->size = lhs->size + rhs->size;
-    for (size_t i = 0; i < lhs->size; i++) {
-      new_list->items[i] = lhs->items[i];
-    }
-    for (size_t i = 0; i < rhs->size; i++) {
-      new_list->items[lhs->size + i] = rhs->items[i];
-    }
-  } else if (!strcmp(operator, "-")) {
-    new_list = MK_LIST(fmax(lhs->capacity, rhs->capacity));
-    new_list->size = 0;
-    for (size_t i = 0; i < lhs->size; i++) {
-      if (!contains((RuntimeVal *)rhs, lhs->items[i])) {
-        new_list->items[new_list->size++] = lhs->items[i];
-      }
-    }
-    for (size_t i = 0; i < rhs->size; i++) {
-      if (!contains((RuntimeVal *)lhs, rhs->items[i])) {
-        new_list->items[new_list->size++] = rhs->items[i];
-      }
-    }
-  } else if (!strcmp(operator, "^")) {
-    new_list = MK_LIST(lhs->capacity + rhs->capacity);
-    new_list->size = 0;
-    for (size_t i = 0; i < lhs->size; i++) {
-      if (!contains((RuntimeVal *)rhs, lhs->items[i])) {
-        new_list->items[new_list->size++] = lhs->items[i];
-      }
-    }
-    for (size_t i = 0; i < rhs->size; i++) {
-      if (!contains((RuntimeVal *)lhs, rhs->items[i])) {
-        new_list->items[new_list->size++] = rhs->items[i];
-      }
-    }
-  } else if (!strcmp(operator, "|")) {
-    new_list = MK_LIST(lhs->capacity + rhs->capacity);
-    new_list->size = 0;
-    for (size_t i = 0; i < lhs->size; i++) {
-      new_list->items[new_list->size++] = lhs->items[i];
-    }
-    for (size_t i = 0; i < rhs->size; i++) {
-      if (!contains((RuntimeVal *)new_list, rhs->items[i])) {
-        new_list->items[new_list->size++] = rhs->items[i];
-      }
-    }
-  } else if (!strcmp(operator, "&")) {
-    new_list = MK_LIST(lhs->capacity + rhs->capacity);
-    new_list->size = 0;
-    for (size_t i = 0; i < lhs->size; i++) {
-      if (contains((RuntimeVal *)rhs, lhs->items[i])) {
-        new_list->items[new_list->size++] = lhs->items[i];
-      }
-    }
-    for (size_t i = 0; i < rhs->size; i++) {
-      if (!contains((RuntimeVal *)new_list, rhs->items[i])) {
-        if (contains((RuntimeVal *)lhs, rhs->items[i])) {
-          new_list->items[new_list->size++] = rhs->items[i];
-        }
-      }
+    assign_slot(env, var->depth, var->slot, value);
+  }
+  return value;
+}
+
+Value eval_assign_list_var_expr(AssignListVar *var, Environment *env) {
+  Value value = evaluate(&(var->value->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  gc_push_root(&value);
+  Value index = evaluate(&(var->index->stmt), env);
+  gc_pop_roots(1);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  ListVal *list =
+      AS_LIST(lookup_resolved(env, var->varname, var->depth, var->slot));
+  list->items[AS_INTEGER(index)] = value;
+  gc_write_barrier(&list->base, value);
+  return value;
+}
+
+Value eval_assign_dict_var_expr(AssignDictVar *var, Environment *env) {
+  Value value = evaluate(&(var->value->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  gc_push_root(&value);
+  Value key_val = evaluate(&(var->key->stmt), env);
+  gc_pop_roots(1);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  StringVal *key = AS_STRING(key_val);
+  DictVal *dict =
+      AS_DICT(lookup_resolved(env, var->varname, var->depth, var->slot));
+  dict_set_val(dict, key->value, value);
+  return value;
+}
+
+Expr *runtime_value_to_expr(Value val) {
+  if (value_type(val) == NUMBER_T) {
+    return (Expr *)create_numeric_literal(AS_NUMBER(val));
+  } else if (value_type(val) == BOOLEAN_T) {
+    return (Expr *)create_boolean_literal(AS_BOOL(val));
+  } else if (value_type(val) == STRING_T) {
+    return (Expr *)create_string_literal(AS_STRING(val)->value);
+  } else if (value_type(val) == NIL_T) {
+    return (Expr *)create_nil_literal();
+  }
+  return NULL;
+}
+
+typedef Value (*BinaryHandler)(Value lhs, Value rhs, BinaryOperator operator);
+
+// Indexed by (lhs type, rhs type, operator). Empty slots fall back to the
+// generic rule at the end of eval_binary_expr_evaluated.
+static BinaryHandler binary_handlers[VALUE_TYPE_COUNT][VALUE_TYPE_COUNT]
+                                    [BINARY_OPERATOR_COUNT];
+
+#define NUMERIC_HANDLER(name, result)                                          \
+  static Value name(Value lhs, Value rhs, BinaryOperator operator) {           \
+    double a = AS_NUMBER(lhs);                                                 \
+    double b = AS_NUMBER(rhs);                                                 \
+    return NUMBER_VAL(result);                                                 \
+  }
+
+#define COMPARISON_HANDLER(name, result)                                       \
+  static Value name(Value lhs, Value rhs, BinaryOperator operator) {           \
+    double a = AS_NUMBER(lhs);                                                 \
+    double b = AS_NUMBER(rhs);                                                 \
+    return BOOL_VAL(result);                                                   \
+  }
+
+NUMERIC_HANDLER(number_add, a + b)
+NUMERIC_HANDLER(number_sub, a - b)
+NUMERIC_HANDLER(number_mul, a * b)
+NUMERIC_HANDLER(number_pow, pow(a, b))
+
+// The result goes back to a double, which rounds it past 2^53.
+#define INTEGER_HANDLER(name, result)                                          \
+  static Value name(Value lhs, Value rhs, BinaryOperator operator) {           \
+    int64_t a = AS_INTEGER(lhs);                                               \
+    int64_t b = AS_INTEGER(rhs);                                               \
+    return NUMBER_VAL((double)(result));                                       \
+  }
+
+INTEGER_HANDLER(number_bit_and, a & b)
+INTEGER_HANDLER(number_bit_or, a | b)
+INTEGER_HANDLER(number_bit_xor, a ^ b)
+// Shifting by 64 or more, or by a negative count, shifts every bit out.
+INTEGER_HANDLER(number_shl, b < 0 || b > 63 ? 0 : (int64_t)((uint64_t)a << b))
+INTEGER_HANDLER(number_shr, b < 0 || b > 63 ? (a < 0 ? -1 : 0) : a >> b)
+INTEGER_HANDLER(number_mod_nonzero, b == -1 ? 0 : a % b)
+
+static Value number_mod(Value lhs, Value rhs, BinaryOperator operator) {
+  if (AS_INTEGER(rhs) == 0) {
+    error("Error: Modulo by zero\n");
+  }
+  return number_mod_nonzero(lhs, rhs, operator);
+}
+COMPARISON_HANDLER(number_gt, a > b)
+COMPARISON_HANDLER(number_ge, a >= b)
+COMPARISON_HANDLER(number_lt, a < b)
+COMPARISON_HANDLER(number_le, a <= b)
+COMPARISON_HANDLER(number_eq, a == b)
+COMPARISON_HANDLER(number_ne, a != b)
+COMPARISON_HANDLER(number_and, a && b)
+COMPARISON_HANDLER(number_or, a || b)
+
+static Value number_div(Value lhs, Value rhs, BinaryOperator operator) {
+  if (AS_NUMBER(rhs) == 0) {
+    error("Error: Division by zero\n");
+  }
+  return NUMBER_VAL(AS_NUMBER(lhs) / AS_NUMBER(rhs));
+}
+
+// Booleans mixed with numbers behave as 1 and 0.
+static Value number_with_boolean(Value lhs, Value rhs,
+                                 BinaryOperator operator) {
+  Value lhs_num = IS_NUMBER(lhs) ? lhs : NUMBER_VAL(AS_BOOL(lhs) ? 1 : 0);
+  Value rhs_num = IS_NUMBER(rhs) ? rhs : NUMBER_VAL(AS_BOOL(rhs) ? 1 : 0);
+  return binary_handlers[NUMBER_T][NUMBER_T][operator](lhs_num, rhs_num,
+                                                       operator);
+}
+
+static Value list_product(Value lhs_val, Value rhs_val,
+                          BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  ListVal *rhs = AS_LIST(rhs_val);
+  size_t result_size = lhs->size * rhs->size;
+  ListVal *new_list = MK_LIST(result_size);
+  size_t index = 0;
+  for (size_t i = 0; i < lhs->size; i++) {
+    for (size_t j = 0; j < rhs->size; j++) {
+      ListVal *pair = MK_LIST(2);
+      pair->items[0] = lhs->items[i];
+      pair->items[1] = rhs->items[j];
+      pair->size = 2;
+      new_list->items[index] = OBJ_VAL(pair);
+      index++;
     }
   }
-  return new_list;
+  new_list->size = result_size;
+  return OBJ_VAL(new_list);
 }
 
-static const char *remove_prefix(const char *operator) {
-  return (operator[0] == '&') ? operator+ 1 : operator;
+static Value list_concat(Value lhs_val, Value rhs_val,
+                         BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  ListVal *rhs = AS_LIST(rhs_val);
+  ListVal *new_list = MK_LIST(lhs->capacity + rhs->capacity);
+  new_list->size = lhs->size + rhs->size;
+  for (size_t i = 0; i < lhs->size; i++) {
+    new_list->items[i] = lhs->items[i];
+  }
+  for (size_t i = 0; i < rhs->size; i++) {
+    new_list->items[lhs->size + i] = rhs->items[i];
+  }
+  return OBJ_VAL(new_list);
 }
 
-RuntimeVal *eval_list_any_binary_expr(const char *operator, ListVal * lhs,
-                                      RuntimeVal *rhs) {
-  if (!strcmp(operator, "<<")) {
-    if (lhs->size >= lhs->capacity) {
-      lhs->capacity = lhs->capacity * 2 + 1;
-      lhs->items =
-          realloc_safe(lhs->items, sizeof(RuntimeVal *) * lhs->capacity,
-                       "eval_list_any_binary_expr realloc");
+// Both '-' and '^' keep the elements that appear in only one of the lists.
+static Value list_difference(Value lhs_val, Value rhs_val,
+                             BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  ListVal *rhs = AS_LIST(rhs_val);
+  ListVal *new_list = MK_LIST(lhs->capacity + rhs->capacity);
+  new_list->size = 0;
+  for (size_t i = 0; i < lhs->size; i++) {
+    if (!contains(OBJ_VAL(rhs), lhs->items[i])) {
+      new_list->items[new_list->size++] = lhs->items[i];
     }
-    lhs->items[lhs->size] = rhs;
-    lhs->size++;
-    return (RuntimeVal *)lhs;
-  } else if (!strcmp(operator, "*") && rhs->type == NUMBER_T) {
-    ListVal *new_list = MK_LIST(lhs->capacity * ((NumberVal *)rhs)->value);
-    for (size_t i = 0; i < lhs->size * ((NumberVal *)rhs)->value; i++) {
-      new_list->items[i] = lhs->items[i % lhs->size];
+  }
+  for (size_t i = 0; i < rhs->size; i++) {
+    if (!contains(OBJ_VAL(lhs), rhs->items[i])) {
+      new_list->items[new_list->size++] = rhs->items[i];
     }
-    new_list->size = lhs->size * ((NumberVal *)rhs)->value;
-    return (RuntimeVal *)new_list;
-  } else if (operator[0] ==
-             '&' &&(operator[1] == '+' || operator[1] == '*' || operator[1] ==
-                    '/' ||
-                    operator[1] == '-' ||
-                    operator[1] == '%')) {
-    const char *operator_suffix = remove_prefix(operator);
-    ListVal *new_list = MK_LIST(lhs->capacity);
-    for (size_t i = 0; i < lhs->size; i++) {
-      RuntimeVal *result =
-          eval_binary_expr_evaluated(lhs->items[i], rhs, operator_suffix);
-      new_list->items[new_list->size++] = result;
+  }
+  return OBJ_VAL(new_list);
+}
+
+static Value list_union(Value lhs_val, Value rhs_val, BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  ListVal *rhs = AS_LIST(rhs_val);
+  ListVal *new_list = MK_LIST(lhs->capacity + rhs->capacity);
+  new_list->size = 0;
+  for (size_t i = 0; i < lhs->size; i++) {
+    new_list->items[new_list->size++] = lhs->items[i];
+  }
+  for (size_t i = 0; i < rhs->size; i++) {
+    if (!contains(OBJ_VAL(new_list), rhs->items[i])) {
+      new_list->items[new_list->size++] = rhs->items[i];
     }
-    return (RuntimeVal *)new_list;
   }
-  return NULL;
+  return OBJ_VAL(new_list);
 }
 
-DictVal *eval_dict_binary_expr(DictVal *lhs, DictVal *rhs,
-                               const char *operator) {
-  DictVal *new_dict = NULL;
-  if (!strcmp(operator, "+")) {
-    new_dict = MK_DICT(lhs->capacity + rhs->capacity);
-    new_dict->size = lhs->size + rhs->size;
-    for (size_t i = 0; i < lhs->capacity; i++) {
-      Entry *entry = lhs->entries[i];
-      if (entry != NULL) {
-        dict_set_val(new_dict, entry->key, entry->value);
-      }
+static Value list_intersection(Value lhs_val, Value rhs_val,
+                               BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  ListVal *rhs = AS_LIST(rhs_val);
+  ListVal *new_list = MK_LIST(lhs->capacity + rhs->capacity);
+  new_list->size = 0;
+  for (size_t i = 0; i < lhs->size; i++) {
+    if (contains(OBJ_VAL(rhs), lhs->items[i])) {
+      new_list->items[new_list->size++] = lhs->items[i];
     }
-    for (size_t i = 0; i < rhs->capacity; i++) {
-      Entry *entry = rhs->entries[i];
-      if (entry != NULL) {
-        dict_set_val(new_dict, entry->key, entry->value);
+  }
+  for (size_t i = 0; i < rhs->size; i++) {
+    if (!contains(OBJ_VAL(new_list), rhs->items[i])) {
+      if (contains(OBJ_VAL(lhs), rhs->items[i])) {
+        new_list->items[new_list->size++] = rhs->items[i];
       }
     }
   }
-  return new_dict;
+  return OBJ_VAL(new_list);
 }
 
-RuntimeVal *eval_var_expr(VarDeclaration *var, Environment *env) {
-  RuntimeVal *value = evaluate(&(var->value->stmt), env);
-  declare_var(env, var->varname, value);
-  return value;
+static Value list_append(Value lhs_val, Value rhs, BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  if (lhs->size >= lhs->capacity) {
+    list_reserve(lhs, lhs->capacity * 2 + 1);
+  }
+  lhs->items[lhs->size] = rhs;
+  lhs->size++;
+  gc_write_barrier(&lhs->base, rhs);
+  return OBJ_VAL(lhs);
 }
 
-RuntimeVal *eval_string_literal(StringLiteral *str_literal) {
-  return (RuntimeVal *)MK_STRING(str_literal->value);
+static Value list_repeat(Value lhs_val, Value rhs, BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  ListVal *new_list = MK_LIST(lhs->capacity * AS_NUMBER(rhs));
+  for (size_t i = 0; i < lhs->size * AS_NUMBER(rhs); i++) {
+    new_list->items[i] = lhs->items[i % lhs->size];
+  }
+  new_list->size = lhs->size * AS_NUMBER(rhs);
+  return OBJ_VAL(new_list);
 }
 
-RuntimeVal *eval_assign_var_expr(AssignVar *var, Environment *env) {
-  RuntimeVal *value = evaluate(&(var->value->stmt), env);
-  lookup_var(env, var->varname);
-  assign_var(env, var->varname, value);
-  return value;
+static BinaryOperator element_wise_operator(BinaryOperator operator) {
+  switch (operator) {
+  case BIN_EACH_ADD:
+    return BIN_ADD;
+  case BIN_EACH_SUB:
+    return BIN_SUB;
+  case BIN_EACH_MUL:
+    return BIN_MUL;
+  case BIN_EACH_DIV:
+    return BIN_DIV;
+  case BIN_EACH_MOD:
+    return BIN_MOD;
+  case BIN_EACH_POW:
+    return BIN_POW;
+  case BIN_EACH_SHL:
+    return BIN_SHL;
+  case BIN_EACH_SHR:
+    return BIN_SHR;
+  case BIN_EACH_AND:
+    return BIN_BIT_AND;
+  default:
+    return BIN_BIT_OR;
+  }
 }
 
-RuntimeVal *eval_assign_list_var_expr(AssignListVar *var, Environment *env) {
-  RuntimeVal *value = evaluate(&(var->value->stmt), env);
-  NumberVal *index = (NumberVal *)evaluate(&(var->index->stmt), env);
-  ListVal *list = (ListVal *)lookup_var(env, var->varname);
-  list->items[(int)index->value] = value;
-  return value;
+static Value list_element_wise(Value lhs_val, Value rhs,
+                               BinaryOperator operator) {
+  ListVal *lhs = AS_LIST(lhs_val);
+  BinaryOperator item_operator = element_wise_operator(operator);
+  ListVal *new_list = MK_LIST(lhs->capacity);
+  for (size_t i = 0; i < lhs->size; i++) {
+    Value result =
+        eval_binary_expr_evaluated(lhs->items[i], rhs, item_operator);
+    new_list->items[new_list->size++] = result;
+  }
+  return OBJ_VAL(new_list);
 }
 
-RuntimeVal *eval_assign_dict_var_expr(AssignDictVar *var, Environment *env) {
-  RuntimeVal *value = evaluate(&(var->value->stmt), env);
-  StringVal *key = (StringVal *)evaluate(&(var->key->stmt), env);
-  DictVal *dict = (DictVal *)lookup_var(env, var->varname);
-  dict_set_val(dict, key->value, value);
-  return value;
+static Value dict_merge(Value lhs_val, Value rhs_val, BinaryOperator operator) {
+  DictVal *lhs = AS_DICT(lhs_val);
+  DictVal *rhs = AS_DICT(rhs_val);
+  DictVal *new_dict = MK_DICT(lhs->capacity + rhs->capacity);
+  new_dict->size = lhs->size + rhs->size;
+  for (size_t i = 0; i < lhs->capacity; i++) {
+    Entry *entry = lhs->entries[i];
+    if (entry != NULL) {
+      dict_set_val(new_dict, entry->key, entry->value);
+    }
+  }
+  for (size_t i = 0; i < rhs->capacity; i++) {
+    Entry *entry = rhs->entries[i];
+    if (entry != NULL) {
+      dict_set_val(new_dict, entry->key, entry->value);
+    }
+  }
+  return OBJ_VAL(new_dict);
 }
 
-static RuntimeVal *eval_string_binary_expr(StringVal *lhs, StringVal *rhs,
-                                           const char *operator) {
-  if (!strcmp(operator, "+")) {
-    size_t new_size = strlen(lhs->value) + strlen(rhs->value);
-    char *new_value =
-        malloc_safe(new_size + 1, "eval_string_binary_expr new_value");
-    strcpy(new_value, lhs->value);
-    strcat(new_value, rhs->value);
-    RuntimeVal *result = (RuntimeVal *)MK_STRING(new_value);
-    free_safe(new_value);
-    return result;
-  } else if (!strcmp(operator, "-")) {
-    int len_a = strlen(lhs->value);
-    int len_b = strlen(rhs->value);
-    int i, j;
-    char *result =
-        (char *)malloc_safe(len_a + 1, "eval_string_binary_expr result");
-    int result_index = 0;
-    for (i = 0; i < len_a;) {
-      for (j = 0; j < len_b && lhs->value[i + j] == rhs->value[j]; j++)
-        ;
-      if (j == len_b) {
-        i += len_b;
-      } else {
-        result[result_index++] = lhs->value[i++];
-      }
+static Value string_concat(Value lhs_val, Value rhs_val,
+                           BinaryOperator operator) {
+  StringVal *lhs = AS_STRING(lhs_val);
+  StringVal *rhs = AS_STRING(rhs_val);
+  size_t new_size = strlen(lhs->value) + strlen(rhs->value);
+  char *new_value = malloc_safe(new_size + 1, "string_concat new_value");
+  strcpy(new_value, lhs->value);
+  strcat(new_value, rhs->value);
+  Value result = OBJ_VAL(MK_STRING(new_value));
+  free_safe(new_value);
+  return result;
+}
+
+static Value string_remove(Value lhs_val, Value rhs_val,
+                           BinaryOperator operator) {
+  StringVal *lhs = AS_STRING(lhs_val);
+  StringVal *rhs = AS_STRING(rhs_val);
+  int len_a = strlen(lhs->value);
+  int len_b = strlen(rhs->value);
+  int i, j;
+  char *result = (char *)malloc_safe(len_a + 1, "string_remove result");
+  int result_index = 0;
+  for (i = 0; i < len_a;) {
+    for (j = 0; j < len_b && lhs->value[i + j] == rhs->value[j]; j++)
+      ;
+    if (j == len_b) {
+      i += len_b;
+    } else {
+      result[result_index++] = lhs->value[i++];
     }
-    result[result_index] = '\0';
-    RuntimeVal *r = (RuntimeVal *)MK_STRING(result);
-    free_safe(result);
-    return r;
   }
-  error("Unsupported operator for string binary expression");
-  return NULL;
+  result[result_index] = '\0';
+  Value r = OBJ_VAL(MK_STRING(result));
+  free_safe(result);
+  return r;
 }
 
-RuntimeVal *eval_string_repeat(StringVal *str, NumberVal *num) {
-  int repeat_count = (int)num->value;
+static Value string_repeat(Value lhs, Value rhs, BinaryOperator operator) {
+  StringVal *str = AS_STRING(lhs);
+  int64_t repeat_count = AS_INTEGER(rhs);
   if (repeat_count < 0) {
     error("Cannot repeat string a negative number of times");
   }
+  size_t length = strlen(str->value);
+  if (repeat_count > INT_MAX ||
+      (length > 0 && (uint64_t)repeat_count > (SIZE_MAX - 1) / length)) {
+    error("Cannot repeat string that many times");
+  }
 
-  char *new_value = malloc_safe(strlen(str->value) * repeat_count + 1,
-                                "eval_string_repeat new_value");
+  char *new_value = malloc_safe(length * (size_t)repeat_count + 1,
+                                "string_repeat new_value");
   new_value[0] = '\0';
 
-  for (int i = 0; i < repeat_count; i++) {
+  for (int64_t i = 0; i < repeat_count; i++) {
     strcat(new_value, str->value);
   }
 
-  RuntimeVal *result = (RuntimeVal *)MK_STRING(new_value);
+  Value result = OBJ_VAL(MK_STRING(new_value));
   free_safe(new_value);
   return result;
 }
 
-Expr *runtime_value_to_expr(RuntimeVal *val) {
-  if (val->type == NUMBER_T) {
-    return (Expr *)create_numeric_literal(((NumberVal *)val)->value);
-  } else if (val->type == BOOLEAN_T) {
-    return (Expr *)create_boolean_literal(((BooleanVal *)val)->value);
-  } else if (val->type == STRING_T) {
-    return (Expr *)create_string_literal(((StringVal *)val)->value);
-  } else if (val->type == NIL_T) {
-    return (Expr *)create_nil_literal();
+static void table_append_row(TableVal *table, DictVal *dict) {
+  if (dict->size != table->column_count) {
+    error("Error: Dictionary size does not match table column count.\n");
   }
-  return NULL;
+  if (table->row_count >= table->capacity) {
+    table->capacity = table->capacity == 0 ? 1 : table->capacity * 2;
+    table->rows = realloc_safe(table->rows, sizeof(DictVal *) * table->capacity,
+                               "table_append_row rows");
+  }
+  table->rows[table->row_count++] = dict;
+  gc_write_barrier(&table->base, OBJ_VAL(dict));
 }
 
-RuntimeVal *eval_binary_expr_evaluated(RuntimeVal *lhs, RuntimeVal *rhs,
-                                       const char *operator) {
-  if ((lhs->type == NUMBER_T || lhs->type == BOOLEAN_T) &&
-      (rhs->type == NUMBER_T || rhs->type == BOOLEAN_T)) {
-    NumberVal *lhs_num, *rhs_num;
+static Value table_add_dict(Value lhs, Value rhs, BinaryOperator operator) {
+  table_append_row(AS_TABLE(lhs), AS_DICT(rhs));
+  return lhs;
+}
 
-    if (lhs->type == NUMBER_T) {
-      lhs_num = (NumberVal *)lhs;
+static Value table_add_list(Value lhs, Value rhs, BinaryOperator operator) {
+  TableVal *table = AS_TABLE(lhs);
+  ListVal *list = AS_LIST(rhs);
+  for (size_t i = 0; i < list->size; i++) {
+    DictVal *dict;
+    if (value_type(list->items[i]) == DICT_T) {
+      dict = AS_DICT(list->items[i]);
+    } else if (value_type(list->items[i]) == LIST_T) {
+      ListVal *inner_list = AS_LIST(list->items[i]);
+      if (inner_list->size != table->column_count) {
+        error("Error: Inner list size does not match table column count.\n");
+      }
+      dict = MK_DICT(table->column_count);
+      for (size_t j = 0; j < table->column_count; j++) {
+        dict_set_val(dict, table->columns[j], inner_list->items[j]);
+      }
     } else {
-      lhs_num = MK_NUMBER(((BooleanVal *)lhs)->value ? 1 : 0);
+      error("Error: All items in the list must be dictionaries or lists.\n");
     }
+    table_append_row(table, dict);
+  }
+  return OBJ_VAL(table);
+}
 
-    if (rhs->type == NUMBER_T) {
-      rhs_num = (NumberVal *)rhs;
-    } else {
-      rhs_num = MK_NUMBER(((BooleanVal *)rhs)->value ? 1 : 0);
+void init_binary_operators() {
+  BinaryHandler number_handlers[BINARY_OPERATOR_COUNT] = {
+      [BIN_ADD] = number_add,         [BIN_SUB] = number_sub,
+      [BIN_MUL] = number_mul,         [BIN_DIV] = number_div,
+      [BIN_MOD] = number_mod,         [BIN_POW] = number_pow,
+      [BIN_GT] = number_gt,           [BIN_GE] = number_ge,
+      [BIN_LT] = number_lt,           [BIN_LE] = number_le,
+      [BIN_EQ] = number_eq,           [BIN_NE] = number_ne,
+      [BIN_AND] = number_and,         [BIN_OR] = number_or,
+      [BIN_BIT_AND] = number_bit_and, [BIN_BIT_OR] = number_bit_or,
+      [BIN_BIT_XOR] = number_bit_xor, [BIN_SHL] = number_shl,
+      [BIN_SHR] = number_shr};
+
+  for (int op = 0; op < BINARY_OPERATOR_COUNT; op++) {
+    binary_handlers[NUMBER_T][NUMBER_T][op] = number_handlers[op];
+    if (number_handlers[op] != NULL) {
+      binary_handlers[NUMBER_T][BOOLEAN_T][op] = number_with_boolean;
+      binary_handlers[BOOLEAN_T][NUMBER_T][op] = number_with_boolean;
+      binary_handlers[BOOLEAN_T][BOOLEAN_T][op] = number_with_boolean;
     }
+  }
 
-    RuntimeVal *result =
-        (RuntimeVal *)eval_numeric_binary_expr(lhs_num, rhs_num, operator);
-
-    if (lhs->type == BOOLEAN_T) {
-      free_safe(lhs_num);
+  binary_handlers[STRING_T][STRING_T][BIN_ADD] = string_concat;
+  binary_handlers[STRING_T][STRING_T][BIN_SUB] = string_remove;
+  binary_handlers[STRING_T][NUMBER_T][BIN_MUL] = string_repeat;
+
+  binary_handlers[LIST_T][LIST_T][BIN_MUL] = list_product;
+  binary_handlers[LIST_T][LIST_T][BIN_ADD] = list_concat;
+  binary_handlers[LIST_T][LIST_T][BIN_SUB] = list_difference;
+  binary_handlers[LIST_T][LIST_T][BIN_BIT_XOR] = list_difference;
+  binary_handlers[LIST_T][LIST_T][BIN_BIT_OR] = list_union;
+  binary_handlers[LIST_T][LIST_T][BIN_BIT_AND] = list_intersection;
+  binary_handlers[LIST_T][NUMBER_T][BIN_MUL] = list_repeat;
+  for (int rhs = 0; rhs < VALUE_TYPE_COUNT; rhs++) {
+    binary_handlers[LIST_T][rhs][BIN_SHL] = list_append;
+    for (int op = BIN_EACH_ADD; op <= BIN_EACH_OR; op++) {
+      binary_handlers[LIST_T][rhs][op] = list_element_wise;
     }
-    if (rhs->type == BOOLEAN_T) {
-      free_safe(rhs_num);
+  }
+
+  binary_handlers[DICT_T][DICT_T][BIN_ADD] = dict_merge;
+  binary_handlers[TABLE_T][DICT_T][BIN_ADD] = table_add_dict;
+  binary_handlers[TABLE_T][LIST_T][BIN_ADD] = table_add_list;
+}
+
+Value eval_binary_expr_evaluated(Value lhs, Value rhs,
+                                 BinaryOperator operator) {
+  BinaryHandler handler =
+      binary_handlers[value_type(lhs)][value_type(rhs)][operator];
+  if (handler != NULL) {
+    return handler(lhs, rhs, operator);
+  }
+  if (value_type(lhs) != value_type(rhs)) {
+    return BOOL_VAL(0);
+  }
+  char error_message[100];
+  snprintf(error_message, sizeof(error_message),
+           "Unsupported types (%s, %s) for operator %s\n",
+           type_to_string(value_type(lhs)), type_to_string(value_type(rhs)),
+           binary_operator_to_string(operator));
+  error(error_message);
+  return NIL_VAL;
+}
+
+// Fast path of a BinaryExpr specialized on numbers. Division by zero and
+// the operators without a case here go through their handler.
+static Value eval_number_binary(Value lhs, Value rhs,
+                                BinaryOperator operator) {
+  double a = AS_NUMBER(lhs);
+  double b = AS_NUMBER(rhs);
+  switch (operator) {
+  case BIN_ADD:
+    return NUMBER_VAL(a + b);
+  case BIN_SUB:
+    return NUMBER_VAL(a - b);
+  case BIN_MUL:
+    return NUMBER_VAL(a * b);
+  case BIN_DIV:
+    if (b != 0) {
+      return NUMBER_VAL(a / b);
     }
-    return result;
+    break;
+  case BIN_LT:
+    return BOOL_VAL(a < b);
+  case BIN_LE:
+    return BOOL_VAL(a <= b);
+  case BIN_GT:
+    return BOOL_VAL(a > b);
+  case BIN_GE:
+    return BOOL_VAL(a >= b);
+  case BIN_EQ:
+    return BOOL_VAL(a == b);
+  case BIN_NE:
+    return BOOL_VAL(a != b);
+  default:
+    break;
   }
-  if (lhs->type == STRING_T && rhs->type == STRING_T) {
-    return eval_string_binary_expr((StringVal *)lhs,
-                                   (StringVal *)rhs, operator);
+  return binary_handlers[NUMBER_T][NUMBER_T][operator](lhs, rhs, operator);
+}
+
+static Value eval_specialized_binary(BinaryExpr *binop, Value lhs,
+                                     Value rhs) {
+  if (binop->specialization == PROVEN_NUMBERS) {
+    return eval_number_binary(lhs, rhs, binop->operator);
   }
-  if (lhs->type == STRING_T && rhs->type == NUMBER_T) {
-    if (!strcmp(operator, "*")) {
-      StringVal *str = (StringVal *)lhs;
-      NumberVal *num = (NumberVal *)rhs;
-      return eval_string_repeat((StringVal *)lhs, (NumberVal *)rhs);
+  int numbers = IS_NUMBER(lhs) && IS_NUMBER(rhs);
+  if (binop->specialization == SPECIALIZED_NUMBERS) {
+    if (numbers) {
+      return eval_number_binary(lhs, rhs, binop->operator);
     }
+    binop->specialization = SPECIALIZE_GENERIC;
+  } else if (binop->specialization == SPECIALIZE_PENDING) {
+    binop->specialization =
+        numbers && binary_handlers[NUMBER_T][NUMBER_T][binop->operator]
+            ? SPECIALIZED_NUMBERS
+            : SPECIALIZE_GENERIC;
+  }
+  return eval_binary_expr_evaluated(lhs, rhs, binop->operator);
+}
+
+// Bumped each time a '@' starts, which drops every loop-invariant value
+// computed before.
+static unsigned long loop_epoch;
+
+static int is_scalar(Value value) { return IS_NUMBER(value) || IS_BOOL(value); }
+
+Value eval_binary_expr(BinaryExpr *binop, Environment *env) {
+  if (binop->invariant && binop->invariant_epoch == loop_epoch) {
+    return binop->invariant_value;
   }
-  if (lhs->type == LIST_T && rhs->type == LIST_T) {
-    return (RuntimeVal *)eval_list_binary_expr((ListVal *)lhs,
-                                               (ListVal *)rhs, operator);
+  Value lhs = evaluate(&(binop->left->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
   }
-  if (lhs->type == LIST_T && rhs->type != LIST_T) {
-    return (RuntimeVal *)eval_list_any_binary_expr(operator,(ListVal *) lhs,
-                                                   rhs);
+  gc_push_root(&lhs);
+  Value rhs = evaluate(&(binop->right->stmt), env);
+  gc_pop_roots(1);
+  if (jumped()) {
+    return NIL_VAL;
   }
-  if (lhs->type == DICT_T && rhs->type == DICT_T) {
-    return (RuntimeVal *)eval_dict_binary_expr((DictVal *)lhs,
-                                               (DictVal *)rhs, operator);
+  Value result = eval_specialized_binary(binop, lhs, rhs);
+  // Objects are left out: the loop may mutate them through another name.
+  if (binop->invariant && is_scalar(lhs) && is_scalar(rhs) &&
+      is_scalar(result)) {
+    binop->invariant_value = result;
+    binop->invariant_epoch = loop_epoch;
   }
-  if (lhs->type == TABLE_T && rhs->type == DICT_T) {
-    TableVal *table = (TableVal *)lhs;
-    DictVal *dict = (DictVal *)rhs;
-    if (!strcmp(operator, "+")) {
-      if (dict->size != table->column_count) {
-        error("Error: Dictionary size does not match table column count.\n");
-      }
+  return result;
+}
 
-      if (table->row_count >= table->capacity) {
-        table->capacity = table->capacity == 0 ? 1 : table->capacity * 2;
-        table->rows =
-            realloc_safe(table->rows, sizeof(DictVal *) * table->capacity,
-                         "eval_binary_expr_evaluated table rows");
-      }
+static int is_truthy_scalar(Value value) {
+  return IS_BOOL(value) ? AS_BOOL(value) : AS_NUMBER(value) != 0;
+}
 
-      table->rows[table->row_count++] = dict;
-    }
-    return lhs;
-  }
-  if (lhs->type == TABLE_T && rhs->type == LIST_T) {
-    TableVal *table = (TableVal *)lhs;
-    ListVal *list = (ListVal *)rhs;
-    if (!strcmp(operator, "+")) {
-      for (size_t i = 0; i < list->size; i++) {
-        DictVal *dict;
-        if (list->items[i]->type == DICT_T) {
-          dict = (DictVal *)list->items[i];
-        } else if (list->items[i]->type == LIST_T) {
-          ListVal *inner_list = (ListVal *)list->items[i];
-          if (inner_list->size != table->column_count) {
-            error(
-                "Error: Inner list size does not match table column count.\n");
-          }
-          dict = MK_DICT(table->column_count);
-          for (size_t j = 0; j < table->column_count; j++) {
-            dict_set_val(dict, table->columns[j], inner_list->items[j]);
-          }
-        } else {
-          error(
-              "Error: All items in the list must be dictionaries or lists.\n");
-        }
+// A number or boolean on the left that decides the result skips the right
+// operand. Operands of other types go through the generic handlers, which
+// decide what `&&` and `||` mean for them.
+Value eval_logical_expr(LogicalExpr *logical, Environment *env) {
+  int is_or = logical->operator == BIN_OR;
+  Value lhs = evaluate(&(logical->left->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  if (is_scalar(lhs) && is_truthy_scalar(lhs) == is_or) {
+    return BOOL_VAL(is_or);
+  }
+  gc_push_root(&lhs);
+  Value rhs = evaluate(&(logical->right->stmt), env);
+  gc_pop_roots(1);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  if (is_scalar(lhs) && is_scalar(rhs)) {
+    return BOOL_VAL(is_truthy_scalar(rhs));
+  }
+  return eval_binary_expr_evaluated(lhs, rhs, logical->operator);
+}
 
-        if (dict->size != table->column_count) {
-          error("Error: Dictionary size does not match table column count.\n");
-        }
+Value eval_identifier_expr(Identifier *ident, Environment *env) {
+  GlobalSlot *global = ident_global(ident);
+  if (global != NULL) {
+    return global->value;
+  }
+  return lookup_resolved(env, ident->symbol, ident->depth, ident->slot);
+}
 
-        if (table->row_count >= table->capacity) {
-          table->capacity = table->capacity == 0 ? 1 : table->capacity * 2;
-          table->rows =
-              realloc_safe(table->rows, sizeof(DictVal *) * table->capacity,
-                           "eval_binary_expr table rows");
-        }
+short int is_while_finished(WhileExpr *while_expr, Environment *env) {
+  Value condition_val = evaluate(&(while_expr->condition->stmt), env);
+  if (jumped()) {
+    return 0;
+  }
+  if (!while_expr->boolean_condition &&
+      value_type(condition_val) != BOOLEAN_T) {
+    error("Condition of '#' must be a boolean.\n");
+  }
+  return AS_BOOL(condition_val);
+}
 
-        table->rows[table->row_count++] = dict;
-      }
-    }
-    return (RuntimeVal *)table;
+static Value eval_block(Stmt **body, size_t body_count, Environment *env) {
+  Value lastEvaluated = NIL_VAL;
+  for (size_t i = 0; i < body_count && control.status == CONTROL_NONE; i++) {
+    lastEvaluated = evaluate(body[i], env);
   }
-  if (lhs->type != rhs->type) {
-    return (RuntimeVal *)MK_BOOL(0);
+  return lastEvaluated;
+}
+
+// After a loop body ran: whether the loop goes on.
+static int loop_goes_on() {
+  ControlStatus status = control.status;
+  if (status == CONTROL_BREAK || status == CONTROL_CONTINUE) {
+    control.status = CONTROL_NONE;
   }
-  char error_message[100];
-  snprintf(error_message, sizeof(error_message),
-           "Unsupported types (%s, %s) for operator %s\n",
-           type_to_string(lhs->type), type_to_string(rhs->type), operator);
-  error(error_message);
+  return status == CONTROL_NONE || status == CONTROL_CONTINUE;
 }
 
-RuntimeVal *eval_identifier_expr(Identifier *ident, Environment *env) {
-  return lookup_var(env, ident->symbol);
+Value eval_jump_expr(JumpExpr *jump_expr) {
+  control.status =
+      jump_expr->base.stmt.kind == BreakAst ? CONTROL_BREAK : CONTROL_CONTINUE;
+  return NIL_VAL;
 }
 
-short int is_while_finished(WhileExpr *while_expr, Environment *env) {
-  RuntimeVal *condition_val = evaluate(&(while_expr->condition->stmt), env);
-  if (condition_val->type != BOOLEAN_T) {
-    error("Condition of '#' must be a boolean.\n");
+Value eval_return_expr(ReturnExpr *return_expr, Environment *env) {
+  Value value = evaluate(&(return_expr->value->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  control.value = value;
+  control.status = CONTROL_RETURN;
+  return control.value;
+}
+
+// Blocks that declare nothing run in the environment they appear in.
+static Environment *enter_block(Environment *env, char *scope_name,
+                                int has_scope, size_t slot_count) {
+  if (!has_scope) {
+    return env;
   }
-  return ((BooleanVal *)condition_val)->value;
+  return create_local_environment(env, scope_name, slot_count);
 }
 
-RuntimeVal *eval_while_expr(WhileExpr *while_expr, Environment *env) {
-  Environment *while_env = create_environment(env, "while_env");
-  RuntimeVal *lastEvaluated = (RuntimeVal *)MK_NIL();
+Value eval_while_expr(WhileExpr *while_expr, Environment *env) {
+  Environment *while_env = enter_block(env, "while_env", while_expr->has_scope,
+                                       while_expr->slot_count);
+  Value lastEvaluated = NIL_VAL;
+  gc_push_env(while_env);
+  gc_push_root(&lastEvaluated);
   while (is_while_finished(while_expr, while_env)) {
-    for (size_t i = 0; i < while_expr->body_count; i++) {
-      lastEvaluated = evaluate(while_expr->body[i], while_env);
+    lastEvaluated =
+        eval_block(while_expr->body, while_expr->body_count, while_env);
+    if (!loop_goes_on()) {
+      break;
     }
+    gc_safe_point();
   }
+  gc_pop_roots(1);
+  gc_pop_env();
   return lastEvaluated;
 }
 
-RuntimeVal *eval_if_expr(IfExpr *if_expr, Environment *env) {
-  Environment *if_env = create_environment(env, "if_env");
-  RuntimeVal *condition_val = evaluate(&(if_expr->condition->stmt), if_env);
-  if (condition_val->type != BOOLEAN_T) {
+Value eval_if_expr(IfExpr *if_expr, Environment *env) {
+  Environment *if_env =
+      enter_block(env, "if_env", if_expr->has_scope, if_expr->slot_count);
+  gc_push_env(if_env);
+  Value condition_val = evaluate(&(if_expr->condition->stmt), if_env);
+  if (jumped()) {
+    gc_pop_env();
+    return NIL_VAL;
+  }
+  if (!if_expr->boolean_condition && value_type(condition_val) != BOOLEAN_T) {
     error("Condition of '?' must be a boolean.\n");
   }
-  if (((BooleanVal *)condition_val)->value) {
-    RuntimeVal *lastEvaluated = NULL;
-    for (size_t i = 0; i < if_expr->body_count; i++) {
-      lastEvaluated = evaluate(if_expr->body[i], if_env);
-    }
+  if (AS_BOOL(condition_val)) {
+    Value lastEvaluated =
+        eval_block(if_expr->body, if_expr->body_count, if_env);
+    gc_pop_env();
     return lastEvaluated;
   }
+  gc_pop_env();
   if (if_expr->else_if != NULL) {
-    Environment *else_if_env = create_environment(env, "else_if_env");
-    RuntimeVal *else_if_r = evaluate((Stmt *)if_expr->else_if, else_if_env);
-    if (else_if_r != NULL) {
-      return else_if_r;
-    }
+    return evaluate((Stmt *)if_expr->else_if, env);
   }
   if (if_expr->else_body != NULL) {
-    Environment *else_env = create_environment(env, "else_env");
-    RuntimeVal *lastEvaluated = NULL;
-    for (size_t i = 0; i < if_expr->else_body_count; i++) {
-      lastEvaluated = evaluate(if_expr->else_body[i], else_env);
-    }
+    Environment *else_env =
+        enter_block(env, "else_env", if_expr->else_has_scope,
+                    if_expr->else_slot_count);
+    gc_push_env(else_env);
+    Value lastEvaluated =
+        eval_block(if_expr->else_body, if_expr->else_body_count, else_env);
+    gc_pop_env();
     return lastEvaluated;
   }
-  return NULL;
+  return NIL_VAL;
+}
+
+static int is_counted_loop_done(BinaryOperator operator, double counter,
+                                Value bound) {
+  Value condition_val;
+  if (IS_NUMBER(bound)) {
+    condition_val = eval_number_binary(NUMBER_VAL(counter), bound, operator);
+  } else {
+    condition_val =
+        eval_binary_expr_evaluated(NUMBER_VAL(counter), bound, operator);
+  }
+  if (value_type(condition_val) != BOOLEAN_T) {
+    error("Condition of '@' must be a boolean.\n");
+  }
+  return !AS_BOOL(condition_val);
 }
 
-RuntimeVal *eval_for_expr(ForExpr *for_expr, Environment *env) {
-  Environment *for_env = create_environment(env, "for_env");
-  RuntimeVal *lastEvaluated = (RuntimeVal *)MK_NIL();
+// A loop the resolver marked as counted keeps its counter in a C double and
+// steps it without evaluating the increment; the slot is still written each
+// time so the body sees the counter. Returns 0, before running anything,
+// if the counter does not start out as a number.
+static int run_counted_loop(ForExpr *for_expr, Environment *for_env,
+                            Value *lastEvaluated) {
+  BinaryExpr *test = (BinaryExpr *)for_expr->condition;
+  int slot = ((Identifier *)test->left)->slot;
+  if (!IS_NUMBER(for_env->slots[slot])) {
+    return 0;
+  }
+  double counter = AS_NUMBER(for_env->slots[slot]);
+  Value bound = evaluate(&(test->right->stmt), for_env);
+  gc_push_root(&bound);
+  while (!jumped() && !is_counted_loop_done(test->operator, counter, bound)) {
+    Environment *for_env_loop =
+        enter_block(for_env, "for_env_loop", for_expr->body_has_scope,
+                    for_expr->body_slot_count);
+    gc_push_env(for_env_loop);
+    *lastEvaluated =
+        eval_block(for_expr->body, for_expr->body_count, for_env_loop);
+    gc_pop_env();
+    if (!loop_goes_on()) {
+      break;
+    }
+    counter += for_expr->step;
+    for_env->slots[slot] = NUMBER_VAL(counter);
+    gc_safe_point();
+    if (!for_expr->bound_invariant) {
+      bound = evaluate(&(test->right->stmt), for_env);
+    }
+  }
+  gc_pop_roots(1);
+  return 1;
+}
+
+Value eval_for_expr(ForExpr *for_expr, Environment *env) {
+  Environment *for_env =
+      enter_block(env, "for_env", for_expr->has_scope, for_expr->slot_count);
+  Value lastEvaluated = NIL_VAL;
+  gc_push_env(for_env);
+  gc_push_root(&lastEvaluated);
+  loop_epoch++;
 
   evaluate((Stmt *)for_expr->initialization, for_env);
 
-  while (1) {
-    RuntimeVal *condition_val = evaluate(&(for_expr->condition->stmt), for_env);
-    if (condition_val->type != BOOLEAN_T) {
+  int counted =
+      for_expr->counted && run_counted_loop(for_expr, for_env, &lastEvaluated);
+  while (!counted && !jumped()) {
+    Value condition_val = evaluate(&(for_expr->condition->stmt), for_env);
+    if (jumped()) {
+      break;
+    }
+    if (!for_expr->boolean_condition &&
+        value_type(condition_val) != BOOLEAN_T) {
       error("Condition of '@' must be a boolean.\n");
     }
-    if (!((BooleanVal *)condition_val)->value) {
+    if (!AS_BOOL(condition_val)) {
       break;
     }
-    Environment *for_env_loop = create_environment(for_env, "for_env_loop");
-    for (size_t i = 0; i < for_expr->body_count; i++) {
-      lastEvaluated = evaluate(for_expr->body[i], for_env_loop);
+    Environment *for_env_loop =
+        enter_block(for_env, "for_env_loop", for_expr->body_has_scope,
+                    for_expr->body_slot_count);
+    gc_push_env(for_env_loop);
+    lastEvaluated =
+        eval_block(for_expr->body, for_expr->body_count, for_env_loop);
+    gc_pop_env();
+    if (!loop_goes_on()) {
+      break;
     }
-    free_environment(for_env_loop);
     evaluate((Stmt *)for_expr->increment, for_env);
+    gc_safe_point();
   }
-  free_environment(for_env);
+  gc_pop_roots(1);
+  gc_pop_env();
   return lastEvaluated;
 }
 
-RuntimeVal *eval_func_def(FuncDef *func_def, Environment *env) {
+Value eval_func_def(FuncDef *func_def, Environment *env) {
   FunctionVal *func_val =
       MK_FUNCTION(func_def->params, func_def->param_count, func_def->body,
                   func_def->body_count, env, NULL);
-  declare_var(env, func_def->name, (RuntimeVal *)func_val);
-  return (RuntimeVal *)func_val;
+  func_val->slot_count = func_def->slot_count;
+  func_val->region = func_def->region;
+  if (func_def->slot < 0) {
+    declare_var(env, func_def->name, OBJ_VAL(func_val));
+  } else {
+    define_slot(env, func_def->slot, OBJ_VAL(func_val));
+  }
+  if (func_def->flat) {
+    func_val->env = create_closure_env(env, func_def->scope_depth,
+                                       func_def->captures,
+                                       func_def->capture_count);
+    gc_write_barrier(&func_val->base, OBJ_VAL(func_val->env));
+  }
+  return OBJ_VAL(func_val);
 }
 
-RuntimeVal *eval_call_expr(CallExpr *call_expr, Environment *env) {
-  RuntimeVal *callee = evaluate(&(call_expr->callee->stmt), env);
-  if (callee->type != FUNCTION_T) {
+// A call in tail position (marked by the resolver) only binds its arguments
+// and returns TAIL_CALL_VAL; the eval_call_expr running the enclosing
+// function then runs the callee in its own C frame, so tail recursion needs
+// constant stack space.
+static struct {
+  FunctionVal *func;
+  Environment *env;
+} tail_call;
+
+static FunctionVal *check_callee(CallExpr *call_expr, Value callee) {
+  if (value_type(callee) != FUNCTION_T) {
     error("Attempted to call a non-function value.\n");
   }
-  FunctionVal *func = (FunctionVal *)callee;
+  FunctionVal *func = AS_FUNCTION(callee);
   if (call_expr->arg_count != func->param_count) {
     char error_message[100];
     snprintf(error_message, sizeof(error_message),
@@ -572,39 +938,241 @@ RuntimeVal *eval_call_expr(CallExpr *call_expr, Environment *env) {
              func->param_count, call_expr->arg_count);
     error(error_message);
   }
+  return func;
+}
+
+// Callees looked up by name (builtins, top-level and module functions) are
+// resolved and checked once per call site, until their global slot is
+// written or, for names bound elsewhere, until a named binding changes.
+static FunctionVal *resolve_callee(CallExpr *call_expr, Environment *env) {
+  Identifier *ident = (Identifier *)call_expr->callee;
+  if (ident->base.stmt.kind != IdentifierAst || ident->slot >= 0) {
+    Value callee = evaluate(&(call_expr->callee->stmt), env);
+    return jumped() ? NULL : check_callee(call_expr, callee);
+  }
+  GlobalSlot *global = ident_global(ident);
+  if (global != NULL) {
+    if (call_expr->checked_callee != NULL &&
+        call_expr->callee_version == global->version) {
+      return (FunctionVal *)call_expr->checked_callee;
+    }
+    call_expr->checked_callee = NULL;
+    FunctionVal *func = check_callee(call_expr, global->value);
+    call_expr->checked_callee = &func->base;
+    call_expr->callee_version = global->version;
+    return func;
+  }
+  if (call_expr->checked_callee != NULL && call_expr->callee_version == 0 &&
+      var_cache_hit(env, &call_expr->callee_cache)) {
+    return (FunctionVal *)call_expr->checked_callee;
+  }
+  call_expr->checked_callee = NULL;
+  Value callee =
+      *lookup_var_cached(env, ident->symbol, &call_expr->callee_cache);
+  FunctionVal *func = check_callee(call_expr, callee);
+  call_expr->checked_callee = &func->base;
+  call_expr->callee_version = 0;
+  return func;
+}
+
+// Arguments of builtin calls are evaluated in place on this stack and the
+// builtin gets a pointer into it. It is allocated once and never moves, as
+// a builtin may run further calls (e.g. an import) while holding its
+// arguments; the collector scans everything below `top`.
+static struct {
+  Value *values;
+  size_t top;
+} arg_stack;
+
+static Value *push_args(size_t arg_count) {
+  if (arg_stack.values == NULL) {
+    arg_stack.values =
+        malloc_safe(sizeof(Value) * EVAL_ARG_STACK_SIZE, "eval arg stack");
+  }
+  if (arg_stack.top + arg_count > EVAL_ARG_STACK_SIZE) {
+    error("Stack overflow: too many nested calls.\n");
+  }
+  Value *args = &arg_stack.values[arg_stack.top];
+  for (size_t i = 0; i < arg_count; i++) {
+    args[i] = NIL_VAL;
+  }
+  arg_stack.top += arg_count;
+  return args;
+}
+
+// The tree walker runs every call on the C stack, several C frames deep.
+// A call beyond the depth limit, or one that would leave less than
+// STACK_RESERVE bytes of the C stack, fails with the same error the VM
+// raises when its heap-allocated frame stack is full, instead of crashing.
+#define STACK_RESERVE (256 * 1024)
+#define DEFAULT_STACK_SIZE (8 * 1024 * 1024)
+
+static size_t call_depth;
+static uintptr_t stack_base;
+static size_t stack_budget;
+
+// `base` is an address in main's frame.
+void eval_init_stack(void *base) {
+  size_t stack_size = DEFAULT_STACK_SIZE;
+#ifndef _WIN32
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    stack_size = limit.rlim_cur;
+  }
+#endif
+  stack_base = (uintptr_t)base;
+  stack_budget = stack_size > 2 * STACK_RESERVE ? stack_size - STACK_RESERVE
+                                                : stack_size / 2;
+}
+
+static void enter_call() {
+  char marker;
+  if (++call_depth > global_context.max_call_depth ||
+      (stack_base != 0 && stack_base - (uintptr_t)&marker > stack_budget)) {
+    error("Stack overflow: too many nested calls.\n");
+  }
+}
+
+// Drops the arguments and calls left behind by a runtime error.
+void eval_reset() {
+  arg_stack.top = 0;
+  call_depth = 0;
+  control.status = CONTROL_NONE;
+}
+
+void eval_mark_roots() {
+  for (size_t i = 0; i < arg_stack.top; i++) {
+    gc_mark_value(arg_stack.values[i]);
+  }
+  gc_mark_value(control.value);
+}
+
+void eval_promote_roots() {
+  for (size_t i = 0; i < arg_stack.top; i++) {
+    gc_promote_slot(&arg_stack.values[i]);
+  }
+  gc_promote_slot(&control.value);
+}
+
+// Bumped whenever a call site the resolver marked as an intrinsic calls
+// something else, which might keep what the running region allocated.
+static unsigned long region_escapes;
+
+// What a region function (FuncDef.region) allocated is freed when it
+// returns, unless its result is one of those objects or the call went
+// through an intrinsic call site that called something else.
+static void end_call_region(Region *region, unsigned long escapes,
+                            Value result) {
+  if (escapes != region_escapes || gc_in_region(region, result)) {
+    return;
+  }
+  if (gc_in_region(region, control.value)) {
+    control.value = NIL_VAL;
+  }
+  gc_end_region(region);
+}
+
+Value eval_call_expr(CallExpr *call_expr, Environment *env) {
+  FunctionVal *func = resolve_callee(call_expr, env);
+  if (func == NULL) {
+    return NIL_VAL;
+  }
+  Value callee = OBJ_VAL(func);
+  int intrinsic = call_expr->intrinsic != NO_INTRINSIC &&
+                  is_intrinsic_callee(callee, call_expr->intrinsic);
+  if (call_expr->intrinsic != NO_INTRINSIC && !intrinsic) {
+    region_escapes++;
+  }
+  gc_push_root(&callee);
   if (func->builtin_func != NULL) {
-    RuntimeVal **args = malloc_safe(sizeof(RuntimeVal *) * call_expr->arg_count,
-                                    "eval_call_expr args");
+    Value *args = push_args(call_expr->arg_count);
     for (size_t i = 0; i < call_expr->arg_count; i++) {
       args[i] = evaluate(&(call_expr->arguments[i]->stmt), env);
+      if (jumped()) {
+        arg_stack.top -= call_expr->arg_count;
+        gc_pop_roots(1);
+        return NIL_VAL;
+      }
     }
-    RuntimeVal *result = func->builtin_func(env, args, call_expr->arg_count);
-    free_safe(args);
+    Value result =
+        intrinsic ? run_intrinsic(call_expr->intrinsic, env, args)
+                  : func->builtin_func(env, args, call_expr->arg_count);
+    arg_stack.top -= call_expr->arg_count;
+    gc_pop_roots(1);
     return result;
   }
-  Environment *func_env = create_environment(func->env, "func_env");
+  Environment *func_env =
+      create_local_environment(func->env, "func_env", func->slot_count);
+  gc_push_env(func_env);
   for (size_t i = 0; i < func->param_count; i++) {
-    RuntimeVal *arg_val = evaluate(&(call_expr->arguments[i]->stmt), env);
-    declare_var(func_env, func->params[i], arg_val);
-  }
-  RuntimeVal *lastEvaluated = (RuntimeVal *)MK_NIL();
-  for (size_t i = 0; i < func->body_count; i++) {
-    lastEvaluated = evaluate(func->body[i], func_env);
+    Value arg_val = evaluate(&(call_expr->arguments[i]->stmt), env);
+    if (jumped()) {
+      gc_pop_env();
+      gc_pop_roots(1);
+      return NIL_VAL;
+    }
+    define_slot(func_env, i, arg_val);
+  }
+  if (call_expr->is_tail) {
+    gc_pop_env();
+    gc_pop_roots(1);
+    tail_call.func = func;
+    tail_call.env = func_env;
+    return TAIL_CALL_VAL;
+  }
+  enter_call();
+  Region region;
+  unsigned long escapes = region_escapes;
+  int region_call = func->region;
+  if (region_call) {
+    gc_begin_region(&region, func_env);
+  }
+  Value lastEvaluated;
+  while (1) {
+    gc_safe_point();
+    lastEvaluated = eval_block(func->body, func->body_count, func_env);
+    if (control.status == CONTROL_RETURN) {
+      lastEvaluated = control.value;
+      control.status = CONTROL_NONE;
+    }
+    if (lastEvaluated != TAIL_CALL_VAL) {
+      break;
+    }
+    func = tail_call.func;
+    func_env = tail_call.env;
+    callee = OBJ_VAL(func);
+    gc_pop_env();
+    gc_push_env(func_env);
+    region_call = 0;
+  }
+  call_depth--;
+  gc_pop_env();
+  gc_pop_roots(1);
+  if (region_call) {
+    end_call_region(&region, escapes, lastEvaluated);
   }
-  free_environment(func_env);
   return lastEvaluated;
 }
 
-void list_append_val(ListVal *list, RuntimeVal *item) {
+void list_append_val(ListVal *list, Value item) {
   list->items[list->size++] = item;
+  gc_write_barrier(&list->base, item);
 }
 
-RuntimeVal *eval_list_literal(ListLiteral *list_lit, Environment *env) {
-  ListVal *list = MK_LIST(list_lit->element_count * 2);
+// The list may be promoted while an element is evaluated, so it is always
+// re-read from the rooted value.
+Value eval_list_literal(ListLiteral *list_lit, Environment *env) {
+  Value list_val = OBJ_VAL(MK_LIST(list_lit->element_count * 2));
+  gc_push_root(&list_val);
   for (size_t i = 0; i < list_lit->element_count; i++) {
-    list_append_val(list, evaluate(&(list_lit->elements[i]->stmt), env));
+    Value item = evaluate(&(list_lit->elements[i]->stmt), env);
+    if (jumped()) {
+      break;
+    }
+    list_append_val(AS_LIST(list_val), item);
   }
-  return (RuntimeVal *)list;
+  gc_pop_roots(1);
+  return list_val;
 }
 
 void resize_dict(DictVal *dict) {
@@ -629,57 +1197,57 @@ void resize_dict(DictVal *dict) {
   dict->capacity = new_capacity;
 }
 
-void dict_set_val(DictVal *dict, const char *key, RuntimeVal *value) {
+void dict_set_val(DictVal *dict, const char *key, Value value) {
   size_t slot = hash(key, dict->capacity);
 
   Entry *entry = dict->entries[slot];
   if (entry == NULL) {
-    dict->entries[slot] = MK_ENTRY(key, value);
+    dict->entries[slot] = MK_ENTRY(dict, key, value);
     dict->size++;
   } else {
     Entry *prev;
     while (entry != NULL) {
       if (strcmp(entry->key, key) == 0) {
         entry->value = value;
+        gc_write_barrier(&dict->base, value);
         return;
       }
       prev = entry;
       entry = prev->next;
     }
-    prev->next = MK_ENTRY(key, value);
+    prev->next = MK_ENTRY(dict, key, value);
     dict->size++;
   }
+  gc_write_barrier(&dict->base, value);
 
   // if ((double)dict->capacity / dict->size >= 0.75) {
   //     resize_dict(dict);
   // }
 }
 
-RuntimeVal *eval_table_literal(TableLiteral *table_lit, Environment *env) {
-  return (RuntimeVal *)MK_TABLE(table_lit->columns, table_lit->column_count);
+Value eval_table_literal(TableLiteral *table_lit, Environment *env) {
+  return OBJ_VAL(MK_TABLE(table_lit->columns, table_lit->column_count));
 }
 
-char *runtime_value_to_string(RuntimeVal *val) {
-  switch (val->type) {
+char *runtime_value_to_string(Value val) {
+  switch (value_type(val)) {
   case NIL_T:
     return "nil";
   case BOOLEAN_T: {
-    BooleanVal *bool_val = (BooleanVal *)val;
-    if (bool_val->value) {
+    if (AS_BOOL(val)) {
       return "true";
     }
     return "false";
   }
   case NUMBER_T: {
-    NumberVal *num_val = (NumberVal *)val;
     // Assume 32 bytes are enough to hold the string representation of the
     // number
     char *result = malloc_safe(32, "runtime_value_to_string NUMBER_T");
-    sprintf(result, "%f", num_val->value);
+    sprintf(result, "%f", AS_NUMBER(val));
     return result;
   }
   case STRING_T: {
-    StringVal *str_val = (StringVal *)val;
+    StringVal *str_val = AS_STRING(val);
     return str_val->value;
   }
   default:
@@ -688,17 +1256,27 @@ char *runtime_value_to_string(RuntimeVal *val) {
   }
 }
 
-RuntimeVal *eval_dict_literal(DictLiteral *dict_lit, Environment *env) {
-  DictVal *dict = MK_DICT(dict_lit->element_count * 2);
+Value eval_dict_literal(DictLiteral *dict_lit, Environment *env) {
+  Value dict_val = OBJ_VAL(MK_DICT(dict_lit->element_count * 2));
+  Value key = NIL_VAL;
+  gc_push_root(&dict_val);
+  gc_push_root(&key);
   for (size_t i = 0; i < dict_lit->element_count; i++) {
-    RuntimeVal *key = evaluate(&(dict_lit->keys[i]->stmt), env);
-    RuntimeVal *value = evaluate(&(dict_lit->values[i]->stmt), env);
-    dict_set_val(dict, runtime_value_to_string(key), value);
+    key = evaluate(&(dict_lit->keys[i]->stmt), env);
+    if (jumped()) {
+      break;
+    }
+    Value value = evaluate(&(dict_lit->values[i]->stmt), env);
+    if (jumped()) {
+      break;
+    }
+    dict_set_val(AS_DICT(dict_val), runtime_value_to_string(key), value);
   }
-  return (RuntimeVal *)dict;
+  gc_pop_roots(2);
+  return dict_val;
 }
 
-RuntimeVal *get_list_slice(ListVal *list, int start, int end) {
+Value get_list_slice(ListVal *list, int start, int end) {
   if (start < 0)
     start = list->size + start;
   if (end < 0)
@@ -708,16 +1286,16 @@ RuntimeVal *get_list_slice(ListVal *list, int start, int end) {
   end = (end < 0) ? 0 : (end > list->size) ? list->size : end;
 
   if (start >= end)
-    return (RuntimeVal *)MK_LIST(0);
+    return OBJ_VAL(MK_LIST(0));
 
   ListVal *slice = MK_LIST(end - start);
   for (int i = start; i < end; i++) {
     list_append_val(slice, list->items[i]);
   }
-  return (RuntimeVal *)slice;
+  return OBJ_VAL(slice);
 }
 
-RuntimeVal *get_table_slice(TableVal *table, int start, int end) {
+Value get_table_slice(TableVal *table, int start, int end) {
   if (start < 0)
     start = table->row_count + start;
   if (end < 0)
@@ -729,7 +1307,7 @@ RuntimeVal *get_table_slice(TableVal *table, int start, int end) {
   end = (end < 0) ? 0 : (end > table->row_count) ? table->row_count : end;
 
   if (start >= end)
-    return (RuntimeVal *)MK_TABLE(table->columns, table->column_count);
+    return OBJ_VAL(MK_TABLE(table->columns, table->column_count));
 
   TableVal *slice = MK_TABLE(table->columns, table->column_count);
   for (int i = start; i < end; i++) {
@@ -740,11 +1318,12 @@ RuntimeVal *get_table_slice(TableVal *table, int start, int end) {
                        "get_table_slice rows");
     }
     slice->rows[slice->row_count++] = table->rows[i];
+    gc_write_barrier(&slice->base, OBJ_VAL(table->rows[i]));
   }
-  return (RuntimeVal *)slice;
+  return OBJ_VAL(slice);
 }
 
-RuntimeVal *get_string_slice(StringVal *str, int start, int end) {
+Value get_string_slice(StringVal *str, int start, int end) {
   size_t size = strlen(str->value);
   if (start < 0)
     start = size + start;
@@ -757,100 +1336,156 @@ RuntimeVal *get_string_slice(StringVal *str, int start, int end) {
     error("String index out of bounds.\n");
   }
   if (start >= end)
-    return (RuntimeVal *)MK_STRING("");
+    return OBJ_VAL(MK_STRING(""));
 
   char *slice = malloc_safe(end - start + 1, "get_string_slice slice");
   strncpy(slice, str->value + start, end - start);
   slice[end - start] = '\0';
-  return (RuntimeVal *)MK_STRING(slice);
+  Value result = OBJ_VAL(MK_STRING(slice));
+  free_safe(slice);
+  return result;
 }
 
-RuntimeVal *eval_list_index(ListIndex *list_index, Environment *env) {
-  RuntimeVal *list_val = evaluate(&(list_index->list->stmt), env);
-  if (list_val->type != LIST_T && list_val->type != TABLE_T &&
-      list_val->type != STRING_T) {
-    error("Attempted to index a non-list value.\n");
+// Slices take int bounds; clamping keeps a bound that is out of range just
+// as far out.
+static int clamp_index(int64_t index) {
+  return index > INT_MAX ? INT_MAX : index < INT_MIN ? INT_MIN : (int)index;
+}
+
+static int index_end(Value end_val, int default_end,
+                     const char *error_message) {
+  if (end_val == EMPTY_VAL) {
+    return default_end;
+  }
+  if (value_type(end_val) != NUMBER_T) {
+    error(error_message);
   }
+  return clamp_index(AS_INTEGER(end_val));
+}
 
-  RuntimeVal *start_val = evaluate(&(list_index->start->stmt), env);
-  if (start_val->type != NUMBER_T) {
+Value eval_index_evaluated(Value list_val, Value start_val,
+                           Value end_val, short int is_slice) {
+  if (value_type(list_val) != LIST_T && value_type(list_val) != TABLE_T &&
+      value_type(list_val) != STRING_T) {
+    error("Attempted to index a non-list value.\n");
+  }
+  if (value_type(start_val) != NUMBER_T) {
     error("Start index must be a number.\n");
   }
-  int start = (int)((NumberVal *)start_val)->value;
+  int64_t start = AS_INTEGER(start_val);
 
-  if (list_val->type == STRING_T) {
-    StringVal *str = (StringVal *)list_val;
-    if (!list_index->is_slice) {
+  if (value_type(list_val) == STRING_T) {
+    StringVal *str = AS_STRING(list_val);
+    if (!is_slice) {
       if (start < 0)
         start = strlen(str->value) + start;
       if (start < 0 || start >= strlen(str->value)) {
         error("String index out of bounds.\n");
       }
       char single_char[2] = {str->value[start], '\0'};
-      return (RuntimeVal *)MK_STRING(single_char);
+      return OBJ_VAL(MK_STRING(single_char));
     } else {
-      int end = strlen(str->value);
-      if (list_index->end != NULL) {
-        RuntimeVal *end_val = evaluate(&(list_index->end->stmt), env);
-        if (end_val->type != NUMBER_T) {
-          error("String end index must be a number.\n");
-        }
-        end = (int)((NumberVal *)end_val)->value;
-      }
-      return get_string_slice(str, start, end);
+      int end = index_end(end_val, strlen(str->value),
+                          "String end index must be a number.\n");
+      return get_string_slice(str, clamp_index(start), end);
     }
-  } else if (list_val->type == LIST_T) {
-    ListVal *list = (ListVal *)list_val;
-    if (!list_index->is_slice) {
+  } else if (value_type(list_val) == LIST_T) {
+    ListVal *list = AS_LIST(list_val);
+    if (!is_slice) {
       if (start < 0)
         start = list->size + start;
       if (start < 0 || start >= list->size) {
         error("List index out of bounds.\n");
       }
-      if (start < 0)
-        start = list->size + start;
       return list->items[start];
     } else {
-      int end = list->size;
-      if (list_index->end != NULL) {
-        RuntimeVal *end_val = evaluate(&(list_index->end->stmt), env);
-        if (end_val->type != NUMBER_T) {
-          error("List end index must be a number.\n");
-        }
-        end = (int)((NumberVal *)end_val)->value;
-      }
-      return get_list_slice(list, start, end);
+      int end = index_end(end_val, list->size,
+                          "List end index must be a number.\n");
+      return get_list_slice(list, clamp_index(start), end);
     }
   } else {
-    TableVal *table = (TableVal *)list_val;
-    if (!list_index->is_slice) {
+    TableVal *table = AS_TABLE(list_val);
+    if (!is_slice) {
       if (start < -table->row_count || start >= table->row_count) {
         error("List index out of bounds.\n");
       }
       if (start < 0)
         start = table->row_count + start;
-      return (RuntimeVal *)table->rows[start];
+      return OBJ_VAL(table->rows[start]);
     } else {
-      int end = table->row_count;
-      if (list_index->end != NULL) {
-        RuntimeVal *end_val = evaluate(&(list_index->end->stmt), env);
-        if (end_val->type != NUMBER_T) {
-          error("List end index must be a number.\n");
-        }
-        end = (int)((NumberVal *)end_val)->value;
-      }
-      return get_table_slice(table, start, end);
+      int end = index_end(end_val, table->row_count,
+                          "List end index must be a number.\n");
+      return get_table_slice(table, clamp_index(start), end);
     }
   }
 }
 
-RuntimeVal *eval_dict_key(DictKey *dict_key, Environment *env) {
-  RuntimeVal *dict_val = evaluate(&(dict_key->dict->stmt), env);
-  if (dict_val->type != DICT_T) {
+// A plain index that found a list and a number specializes on that; an
+// index out of bounds still takes the generic path to report it.
+static int index_list_fast(ListIndex *list_index, Value list_val,
+                           Value start_val, Value *result) {
+  if (list_index->specialization != PROVEN_LIST_INDEX) {
+    int list_number =
+        value_type(list_val) == LIST_T && IS_NUMBER(start_val);
+    if (list_index->specialization == SPECIALIZE_PENDING) {
+      list_index->specialization = list_number && !list_index->is_slice
+                                       ? SPECIALIZED_LIST_INDEX
+                                       : SPECIALIZE_GENERIC;
+    } else if (!list_number) {
+      list_index->specialization = SPECIALIZE_GENERIC;
+    }
+    if (list_index->specialization != SPECIALIZED_LIST_INDEX) {
+      return 0;
+    }
+  }
+  ListVal *list = AS_LIST(list_val);
+  int64_t index = AS_INTEGER(start_val);
+  if (index < 0) {
+    index += list->size;
+  }
+  if (index < 0 || index >= list->size) {
+    return 0;
+  }
+  *result = list->items[index];
+  return 1;
+}
+
+Value eval_list_index(ListIndex *list_index, Environment *env) {
+  Value list_val = evaluate(&(list_index->list->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  gc_push_root(&list_val);
+  Value start_val = evaluate(&(list_index->start->stmt), env);
+  if (jumped()) {
+    gc_pop_roots(1);
+    return NIL_VAL;
+  }
+  Value result;
+  if (list_index->specialization != SPECIALIZE_GENERIC &&
+      index_list_fast(list_index, list_val, start_val, &result)) {
+    gc_pop_roots(1);
+    return result;
+  }
+  Value end_val = EMPTY_VAL;
+  if (list_index->is_slice && list_index->end != NULL) {
+    gc_push_root(&start_val);
+    end_val = evaluate(&(list_index->end->stmt), env);
+    gc_pop_roots(1);
+  }
+  gc_pop_roots(1);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  return eval_index_evaluated(list_val, start_val, end_val,
+                              list_index->is_slice);
+}
+
+Value eval_dict_key_evaluated(Value dict_val, Value key_val) {
+  if (value_type(dict_val) != DICT_T) {
     error("Attempted to key a non-dict value.\n");
   }
-  DictVal *dict = (DictVal *)dict_val;
-  RuntimeVal *key_val = evaluate(&(dict_key->key->stmt), env);
+  DictVal *dict = AS_DICT(dict_val);
   char *key = runtime_value_to_string(key_val);
   if (key == NULL) {
     error("Dict key must be convertible to a hashable string.\n");
@@ -861,7 +1496,21 @@ RuntimeVal *eval_dict_key(DictKey *dict_key, Environment *env) {
       return entry->value;
     }
   }
-  return NULL;
+  return NIL_VAL;
+}
+
+Value eval_dict_key(DictKey *dict_key, Environment *env) {
+  Value dict_val = evaluate(&(dict_key->dict->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  gc_push_root(&dict_val);
+  Value key_val = evaluate(&(dict_key->key->stmt), env);
+  gc_pop_roots(1);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  return eval_dict_key_evaluated(dict_val, key_val);
 }
 
 char *find_module_path(const char *module_name) {
@@ -898,7 +1547,7 @@ char *find_module_path(const char *module_name) {
   return NULL;
 }
 
-RuntimeVal *eval_import_stmt(ImportStmt *import_stmt, Environment *env) {
+Value eval_import_stmt(ImportStmt *import_stmt, Environment *env) {
   char *module_path = find_module_path(import_stmt->module_name);
   if (!module_path) {
     char error_msg[256];
@@ -917,22 +1566,15 @@ RuntimeVal *eval_import_stmt(ImportStmt *import_stmt, Environment *env) {
         if (import_stmt->import_count > 0) {
           for (size_t j = 0; j < import_stmt->import_count; j++) {
             ImportItem *item = import_stmt->imports[j];
-            RuntimeVal *imported_value = lookup_var(module_env, item->name);
-            if (imported_value == NULL) {
-              char error_msg[256];
-              snprintf(error_msg, sizeof(error_msg),
-                       "Cannot find '%s' in module '%s'", item->name,
-                       import_stmt->module_name);
-              error(error_msg);
-            }
+            Value imported_value = lookup_var(module_env, item->name);
             declare_var(env, item->alias ? item->alias : item->name,
                         imported_value);
           }
         } else {
-          declare_var(env, import_stmt->module_name, (RuntimeVal *)module_env);
+          declare_var(env, import_stmt->module_name, OBJ_VAL(module_env));
         }
         free_safe(module_path);
-        return (RuntimeVal *)MK_NIL();
+        return NIL_VAL;
       }
     }
   }
@@ -944,26 +1586,19 @@ RuntimeVal *eval_import_stmt(ImportStmt *import_stmt, Environment *env) {
   Token *tokens = tokenize(module_code, &token_count);
   Parser *parser = create_parser(tokens, token_count);
   Program *program = produce_ast(parser, module_code);
-  eval_program(program, module_env);
+  gc_push_env(module_env);
+  run_program(program, module_env);
+  gc_pop_env();
 
   if (import_stmt->import_count > 0) {
     for (size_t i = 0; i < import_stmt->import_count; i++) {
       ImportItem *item = import_stmt->imports[i];
       char *name = item->name;
-      RuntimeVal *imported_value = lookup_var(module_env, name);
-
-      if (imported_value == NULL) {
-        char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg),
-                 "Cannot find '%s' in module '%s'", name,
-                 import_stmt->module_name);
-        error(error_msg);
-      }
-
+      Value imported_value = lookup_var(module_env, name);
       declare_var(env, item->alias ? item->alias : name, imported_value);
     }
   } else {
-    declare_var(env, import_stmt->module_name, (RuntimeVal *)module_env);
+    declare_var(env, import_stmt->module_name, OBJ_VAL(module_env));
   }
 
   free_safe(module_code);
@@ -971,46 +1606,47 @@ RuntimeVal *eval_import_stmt(ImportStmt *import_stmt, Environment *env) {
   free_safe(parser);
   free_program(program);
 
-  return (RuntimeVal *)MK_NIL();
+  return NIL_VAL;
 }
 
-RuntimeVal *eval_unary_expr(UnaryExpr *unary_expr, Environment *env) {
-  RuntimeVal *value = evaluate(&(unary_expr->expr->stmt), env);
-  if (value->type != NUMBER_T) {
+Value eval_unary_expr(UnaryExpr *unary_expr, Environment *env) {
+  Value value = evaluate(&(unary_expr->expr->stmt), env);
+  if (jumped()) {
+    return NIL_VAL;
+  }
+  if (!unary_expr->number_operand && value_type(value) != NUMBER_T) {
     error("Unary operator not applicable to non-number type");
   }
-  NumberVal *num_val = (NumberVal *)value;
-  double result = num_val->value;
+  double result = AS_NUMBER(value);
 
   if (strcmp(unary_expr->operator, "-") == 0) {
     result = -result;
   }
-  return (RuntimeVal *)MK_NUMBER(result);
+  return NUMBER_VAL(result);
 }
 
-RuntimeVal *evaluate(Stmt *astNode, Environment *env) {
+Value evaluate(Stmt *astNode, Environment *env) {
   switch (astNode->kind) {
   case ProgramAst: {
     return eval_program((Program *)astNode, env);
   }
   case BooleanLiteralAst: {
-    return (RuntimeVal *)MK_BOOL(((BooleanLiteral *)astNode)->value);
+    return BOOL_VAL(((BooleanLiteral *)astNode)->value);
   }
   case NilAst: {
-    printf("NIL");
-    return (RuntimeVal *)MK_NIL();
+    return NIL_VAL;
   }
   case NumericLiteralAst: {
-    return (RuntimeVal *)MK_NUMBER(((NumericLiteral *)astNode)->value);
+    return NUMBER_VAL(((NumericLiteral *)astNode)->value);
   }
   case IdentifierAst: {
     return eval_identifier_expr((Identifier *)astNode, env);
   }
   case BinaryExprAst: {
-    BinaryExpr *binop = (BinaryExpr *)astNode;
-    RuntimeVal *lhs = evaluate(&(binop->left->stmt), env);
-    RuntimeVal *rhs = evaluate(&(binop->right->stmt), env);
-    return eval_binary_expr_evaluated(lhs, rhs, binop->operator);
+    return eval_binary_expr((BinaryExpr *)astNode, env);
+  }
+  case LogicalExprAst: {
+    return eval_logical_expr((LogicalExpr *)astNode, env);
   }
   case VarDeclarationAst: {
     return eval_var_expr((VarDeclaration *)astNode, env);
@@ -1063,6 +1699,13 @@ RuntimeVal *evaluate(Stmt *astNode, Environment *env) {
   case UnaryExprAst: {
     return eval_unary_expr((UnaryExpr *)astNode, env);
   }
+  case BreakAst:
+  case ContinueAst: {
+    return eval_jump_expr((JumpExpr *)astNode);
+  }
+  case ReturnAst: {
+    return eval_return_expr((ReturnExpr *)astNode, env);
+  }
   default: {
     error("This AST Node has not yet been setup for interpretation.\n");
   }
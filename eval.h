@@ -5,12 +5,23 @@
 #include "env.h"
 #include "values.h"
 
-RuntimeVal *eval_program(Program *program, Environment *env);
-NumberVal *eval_numeric_binary_expr(NumberVal *lhs, NumberVal *rhs,
-                                    const char *operator);
-RuntimeVal *eval_binary_expr(BinaryExpr *binop, Environment *env);
-RuntimeVal *evaluate(Stmt *astNode, Environment *env);
-RuntimeVal *eval_list_literal(ListLiteral *list_lit, Environment *env);
-void dict_set_val(DictVal *dict, const char *key, RuntimeVal *value);
+#define EVAL_ARG_STACK_SIZE (1 << 16)
+
+Value eval_program(Program *program, Environment *env);
+Value eval_binary_expr(BinaryExpr *binop, Environment *env);
+void init_binary_operators();
+Value eval_binary_expr_evaluated(Value lhs, Value rhs,
+                                 BinaryOperator operator);
+Value eval_index_evaluated(Value list_val, Value start_val, Value end_val,
+                           short int is_slice);
+Value eval_dict_key_evaluated(Value dict_val, Value key_val);
+char *runtime_value_to_string(Value val);
+Value evaluate(Stmt *astNode, Environment *env);
+Value eval_list_literal(ListLiteral *list_lit, Environment *env);
+void dict_set_val(DictVal *dict, const char *key, Value value);
+void eval_init_stack(void *base);
+void eval_reset();
+void eval_mark_roots();
+void eval_promote_roots();
 
 #endif  // EVALUATOR_H
@@ -0,0 +1,602 @@
+#include "gc.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "malloc_safe.h"
+#include "vm.h"
+
+struct NurseryBlock {
+  NurseryBlock *next;
+};
+
+Heap heap = {.nursery_size = GC_DEFAULT_NURSERY_SIZE,
+             .threshold = GC_DEFAULT_THRESHOLD,
+             .next_collection = GC_DEFAULT_THRESHOLD,
+             .growth_factor = GC_DEFAULT_GROWTH_FACTOR};
+
+void gc_configure(size_t threshold, double growth_factor,
+                  size_t nursery_size) {
+  heap.threshold = threshold;
+  heap.next_collection = threshold;
+  heap.growth_factor = growth_factor;
+  heap.nursery_size = nursery_size;
+}
+
+void gc_set_globals(Environment *env) { heap.globals = env; }
+
+RuntimeVal *gc_allocate(size_t size, ValueType type) {
+  RuntimeVal *object = (RuntimeVal *)malloc_safe(size, "gc_allocate");
+  object->type = type;
+  object->marked = 0;
+  object->young = 0;
+  object->remembered = 0;
+  object->pinned = 0;
+  object->next = heap.objects;
+  heap.objects = object;
+  heap.bytes_allocated += size;
+  return object;
+}
+
+// Allocation cannot collect, so once the nursery is exhausted young objects
+// go to extra blocks until the next safe point runs a minor collection.
+void *gc_nursery_overflow(size_t size) {
+  if (heap.nursery == NULL) {
+    heap.nursery = malloc_safe(heap.nursery_size, "gc nursery");
+    heap.nursery_top = heap.nursery;
+    heap.nursery_end = heap.nursery + heap.nursery_size;
+    return gc_nursery_alloc(size);
+  }
+  size_t block_size = size > heap.nursery_size ? size : heap.nursery_size;
+  NurseryBlock *block =
+      malloc_safe(sizeof(NurseryBlock) + block_size, "gc nursery block");
+  block->next = heap.overflow;
+  heap.overflow = block;
+  heap.nursery_top = (char *)(block + 1) + size;
+  heap.nursery_end = (char *)(block + 1) + block_size;
+  return block + 1;
+}
+
+static void reset_nursery() {
+  while (heap.overflow != NULL) {
+    NurseryBlock *next = heap.overflow->next;
+    free_safe(heap.overflow);
+    heap.overflow = next;
+  }
+  heap.nursery_top = heap.nursery;
+  heap.nursery_end =
+      heap.nursery == NULL ? NULL : heap.nursery + heap.nursery_size;
+}
+
+// Environments are referenced by raw pointers all over the evaluators, so
+// they are allocated young but outside the nursery; their slots still count
+// against it. The slots share the environment's allocation, which comes
+// from the environment pool.
+Environment *gc_allocate_env(size_t slot_count) {
+  Environment *env = env_pool_alloc(slot_count);
+  env->base.type = ENVIRONMENT_T;
+  env->base.marked = 0;
+  env->base.young = 1;
+  env->base.remembered = 0;
+  env->base.pinned = 0;
+  env->base.next = heap.young_envs;
+  heap.young_envs = &env->base;
+  heap.young_env_bytes += sizeof(Environment) + sizeof(Value) * slot_count;
+  return env;
+}
+
+void gc_remember(RuntimeVal *object) {
+  object->remembered = 1;
+  if (heap.remembered_count == heap.remembered_capacity) {
+    heap.remembered_capacity =
+        heap.remembered_capacity == 0 ? 64 : heap.remembered_capacity * 2;
+    heap.remembered =
+        realloc_safe(heap.remembered,
+                     sizeof(RuntimeVal *) * heap.remembered_capacity,
+                     "gc_remember");
+  }
+  heap.remembered[heap.remembered_count++] = object;
+}
+
+void gc_grow_roots() {
+  if (heap.root_count == heap.root_capacity) {
+    heap.root_capacity = heap.root_capacity == 0 ? 64 : heap.root_capacity * 2;
+    heap.roots = realloc_safe(heap.roots, sizeof(Value *) * heap.root_capacity,
+                              "gc_grow_roots roots");
+  }
+  if (heap.env_root_count == heap.env_root_capacity) {
+    heap.env_root_capacity =
+        heap.env_root_capacity == 0 ? 64 : heap.env_root_capacity * 2;
+    heap.env_roots =
+        realloc_safe(heap.env_roots,
+                     sizeof(Environment *) * heap.env_root_capacity,
+                     "gc_grow_roots env_roots");
+  }
+}
+
+// Drops the roots of evaluations that a runtime error longjmp'd out of.
+void gc_reset_roots() {
+  heap.root_count = 0;
+  heap.env_root_count = 0;
+}
+
+static void push_gray(RuntimeVal *object) {
+  if (heap.gray_count == heap.gray_capacity) {
+    heap.gray_capacity = heap.gray_capacity == 0 ? 256 : heap.gray_capacity * 2;
+    heap.gray = realloc_safe(heap.gray,
+                             sizeof(RuntimeVal *) * heap.gray_capacity,
+                             "gc_mark_object gray");
+  }
+  heap.gray[heap.gray_count++] = object;
+}
+
+void gc_mark_object(RuntimeVal *object) {
+  if (object == NULL || object->marked) {
+    return;
+  }
+  object->marked = 1;
+  push_gray(object);
+}
+
+void gc_mark_value(Value value) {
+  if (IS_OBJ(value)) {
+    gc_mark_object(AS_OBJ(value));
+  }
+}
+
+// String constants live in the chunk that loaded them; nested functions'
+// chunks hang off the prototypes.
+void gc_mark_chunk(Chunk *chunk) {
+  for (size_t i = 0; i < chunk->constant_count; i++) {
+    gc_mark_value(chunk->constants[i]);
+  }
+  for (size_t i = 0; i < chunk->proto_count; i++) {
+    if (chunk->protos[i]->chunk != NULL) {
+      gc_mark_chunk(chunk->protos[i]->chunk);
+    }
+  }
+}
+
+static void blacken_object(RuntimeVal *object) {
+  switch (object->type) {
+  case LIST_T: {
+    ListVal *list = (ListVal *)object;
+    for (size_t i = 0; i < list->size; i++) {
+      gc_mark_value(list->items[i]);
+    }
+    break;
+  }
+  case DICT_T: {
+    DictVal *dict = (DictVal *)object;
+    for (size_t i = 0; i < dict->capacity; i++) {
+      for (Entry *entry = dict->entries[i]; entry != NULL;
+           entry = entry->next) {
+        gc_mark_value(entry->value);
+      }
+    }
+    break;
+  }
+  case TABLE_T: {
+    TableVal *table = (TableVal *)object;
+    for (size_t i = 0; i < table->row_count; i++) {
+      gc_mark_object(&table->rows[i]->base);
+    }
+    break;
+  }
+  case FUNCTION_T: {
+    FunctionVal *func = (FunctionVal *)object;
+    if (func->env != NULL) {
+      gc_mark_object(&func->env->base);
+    }
+    if (func->chunk != NULL) {
+      gc_mark_chunk(func->chunk);
+    }
+    break;
+  }
+  case ENVIRONMENT_T: {
+    Environment *env = (Environment *)object;
+    if (env->parent != NULL) {
+      gc_mark_object(&env->parent->base);
+    }
+    for (size_t i = 0; i < env->slot_count; i++) {
+      gc_mark_value(env->slots[i]);
+    }
+    for (size_t i = 0; i < env->capacity; i++) {
+      if (env->entries[i].key != NULL) {
+        gc_mark_value(env->entries[i].value);
+      }
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static size_t object_size(RuntimeVal *object) {
+  switch (object->type) {
+  case STRING_T:
+    return sizeof(StringVal) + strlen(((StringVal *)object)->value) + 1;
+  case LIST_T:
+    return sizeof(ListVal) + sizeof(Value) * ((ListVal *)object)->capacity;
+  case DICT_T: {
+    DictVal *dict = (DictVal *)object;
+    return sizeof(DictVal) + sizeof(Entry *) * dict->capacity +
+           sizeof(Entry) * dict->size;
+  }
+  case TABLE_T: {
+    TableVal *table = (TableVal *)object;
+    return sizeof(TableVal) + sizeof(char *) * table->column_count +
+           sizeof(DictVal *) * table->capacity;
+  }
+  case FUNCTION_T:
+    return sizeof(FunctionVal);
+  case FILE_T:
+    return sizeof(FileHandle);
+  case ENVIRONMENT_T: {
+    Environment *env = (Environment *)object;
+    return sizeof(Environment) + sizeof(Value) * env->slot_count +
+           sizeof(HashEntry) * env->capacity;
+  }
+  default:
+    return sizeof(RuntimeVal);
+  }
+}
+
+static void free_object(RuntimeVal *object) {
+  switch (object->type) {
+  case STRING_T:
+    free_safe(((StringVal *)object)->value);
+    break;
+  case LIST_T:
+    free_safe(((ListVal *)object)->items);
+    break;
+  case DICT_T: {
+    DictVal *dict = (DictVal *)object;
+    for (size_t i = 0; i < dict->capacity; i++) {
+      Entry *entry = dict->entries[i];
+      while (entry != NULL) {
+        Entry *next = entry->next;
+        free_safe(entry->key);
+        free_safe(entry);
+        entry = next;
+      }
+    }
+    free_safe(dict->entries);
+    break;
+  }
+  case TABLE_T: {
+    TableVal *table = (TableVal *)object;
+    for (size_t i = 0; i < table->column_count; i++) {
+      free_safe(table->columns[i]);
+    }
+    free_safe(table->columns);
+    free_safe(table->rows);
+    break;
+  }
+  case FILE_T: {
+    FileHandle *handle = (FileHandle *)object;
+    if (handle->fp != NULL) {
+      fclose(handle->fp);
+    }
+    free_safe(handle->mode);
+    break;
+  }
+  case ENVIRONMENT_T:
+    free_environment((Environment *)object);
+    return;
+  default:
+    break;
+  }
+  free_safe(object);
+}
+
+// Copies a young object and its payload to the old space, leaving a
+// forwarding pointer behind. The copy is queued so that the young objects
+// it references get promoted as well.
+static RuntimeVal *promote_object(RuntimeVal *object) {
+  if (object->type == ENVIRONMENT_T) {
+    if (!object->marked) {
+      object->marked = 1;
+      push_gray(object);
+    }
+    return object;
+  }
+  if (object->marked) {
+    return object->next;
+  }
+  RuntimeVal *copy;
+  switch (object->type) {
+  case STRING_T: {
+    StringVal *string = malloc_safe(sizeof(StringVal), "promote string");
+    string->value = strdup(((StringVal *)object)->value);
+    copy = &string->base;
+    break;
+  }
+  case LIST_T: {
+    ListVal *young = (ListVal *)object;
+    ListVal *list = malloc_safe(sizeof(ListVal), "promote list");
+    *list = *young;
+    list->items = malloc_safe(
+        sizeof(Value) * (young->capacity > 0 ? young->capacity : 1),
+        "promote list items");
+    memcpy(list->items, young->items, sizeof(Value) * young->size);
+    copy = &list->base;
+    break;
+  }
+  default: {
+    DictVal *young = (DictVal *)object;
+    DictVal *dict = malloc_safe(sizeof(DictVal), "promote dict");
+    *dict = *young;
+    dict->entries = malloc_safe(
+        sizeof(Entry *) * (young->capacity > 0 ? young->capacity : 1),
+        "promote dict entries");
+    for (size_t i = 0; i < young->capacity; i++) {
+      Entry **link = &dict->entries[i];
+      for (Entry *entry = young->entries[i]; entry != NULL;
+           entry = entry->next) {
+        Entry *entry_copy = malloc_safe(sizeof(Entry), "promote entry");
+        entry_copy->key = strdup(entry->key);
+        entry_copy->value = entry->value;
+        *link = entry_copy;
+        link = &entry_copy->next;
+      }
+      *link = NULL;
+    }
+    copy = &dict->base;
+    break;
+  }
+  }
+  copy->type = object->type;
+  copy->marked = 0;
+  copy->young = 0;
+  copy->remembered = 0;
+  copy->next = heap.objects;
+  heap.objects = copy;
+  heap.bytes_allocated += object_size(copy);
+  object->marked = 1;
+  object->next = copy;
+  push_gray(copy);
+  return copy;
+}
+
+void gc_promote_slot(Value *slot) {
+  if (IS_OBJ(*slot) && AS_OBJ(*slot)->young) {
+    *slot = OBJ_VAL(promote_object(AS_OBJ(*slot)));
+  }
+}
+
+void gc_promote_env(Environment *env) {
+  if (env->base.young) {
+    promote_object(&env->base);
+  }
+}
+
+static void promote_children(RuntimeVal *object) {
+  switch (object->type) {
+  case LIST_T: {
+    ListVal *list = (ListVal *)object;
+    for (size_t i = 0; i < list->size; i++) {
+      gc_promote_slot(&list->items[i]);
+    }
+    break;
+  }
+  case DICT_T: {
+    DictVal *dict = (DictVal *)object;
+    for (size_t i = 0; i < dict->capacity; i++) {
+      for (Entry *entry = dict->entries[i]; entry != NULL;
+           entry = entry->next) {
+        gc_promote_slot(&entry->value);
+      }
+    }
+    break;
+  }
+  case TABLE_T: {
+    TableVal *table = (TableVal *)object;
+    for (size_t i = 0; i < table->row_count; i++) {
+      if (table->rows[i]->base.young) {
+        table->rows[i] = (DictVal *)promote_object(&table->rows[i]->base);
+      }
+    }
+    break;
+  }
+  case FUNCTION_T: {
+    FunctionVal *func = (FunctionVal *)object;
+    if (func->env != NULL) {
+      gc_promote_env(func->env);
+    }
+    break;
+  }
+  case ENVIRONMENT_T: {
+    Environment *env = (Environment *)object;
+    if (env->parent != NULL) {
+      gc_promote_env(env->parent);
+    }
+    for (size_t i = 0; i < env->slot_count; i++) {
+      gc_promote_slot(&env->slots[i]);
+    }
+    for (size_t i = 0; i < env->capacity; i++) {
+      if (env->entries[i].key != NULL) {
+        gc_promote_slot(&env->entries[i].value);
+      }
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static void sweep_young_envs() {
+  RuntimeVal *object = heap.young_envs;
+  while (object != NULL) {
+    RuntimeVal *next = object->next;
+    if (object->marked) {
+      object->marked = 0;
+      object->young = 0;
+      object->next = heap.objects;
+      heap.objects = object;
+      heap.bytes_allocated += object_size(object);
+    } else {
+      free_environment((Environment *)object);
+    }
+    object = next;
+  }
+  heap.young_envs = NULL;
+  heap.young_env_bytes = 0;
+}
+
+// Minor collection: everything reachable from the roots or the remembered
+// set is promoted, and the rest of the nursery is dropped wholesale. Young
+// strings, lists and dicts own no malloc'd memory, so only the dead
+// environments have to be freed one by one.
+static void collect_young() {
+  if (heap.nursery_top == heap.nursery && heap.overflow == NULL &&
+      heap.young_envs == NULL) {
+    return;
+  }
+  if (heap.globals != NULL) {
+    gc_promote_env(heap.globals);
+  }
+  env_promote_globals();
+  for (size_t i = 0; i < heap.root_count; i++) {
+    gc_promote_slot(heap.roots[i]);
+  }
+  for (size_t i = 0; i < heap.env_root_count; i++) {
+    gc_promote_env(heap.env_roots[i]);
+  }
+  vm_promote_roots();
+  eval_promote_roots();
+  for (size_t i = 0; i < heap.remembered_count; i++) {
+    heap.remembered[i]->remembered = 0;
+    promote_children(heap.remembered[i]);
+  }
+  heap.remembered_count = 0;
+  while (heap.gray_count > 0) {
+    promote_children(heap.gray[--heap.gray_count]);
+  }
+  sweep_young_envs();
+  reset_nursery();
+  heap.minor_collections++;
+}
+
+static int region_is_intact(Region *region) {
+  return region->nursery_top != NULL &&
+         region->minor_collections == heap.minor_collections &&
+         region->overflow == heap.overflow;
+}
+
+// Whether `value` is an object allocated in the region.
+int gc_in_region(Region *region, Value value) {
+  if (!IS_OBJ(value) || !region_is_intact(region)) {
+    return 0;
+  }
+  char *object = (char *)AS_OBJ(value);
+  return object >= region->nursery_top && object < heap.nursery_top;
+}
+
+// Environments are pushed on the front of young_envs, so the region's are
+// the ones before the first that was already there.
+void gc_end_region(Region *region) {
+  if (!region_is_intact(region)) {
+    return;
+  }
+  heap.nursery_top = region->nursery_top;
+  while (heap.young_envs != region->young_envs) {
+    RuntimeVal *env = heap.young_envs;
+    heap.young_envs = env->next;
+    free_environment((Environment *)env);
+  }
+  heap.young_env_bytes = region->young_env_bytes;
+  if (region->env != NULL) {
+    heap.young_envs = region->env->base.next;
+    heap.young_env_bytes -=
+        sizeof(Environment) + sizeof(Value) * region->env->slot_count;
+    free_environment(region->env);
+  }
+}
+
+static void sweep() {
+  RuntimeVal **link = &heap.objects;
+  size_t live_bytes = 0;
+  while (*link != NULL) {
+    RuntimeVal *object = *link;
+    if (object->marked || object->pinned) {
+      object->marked = 0;
+      live_bytes += object_size(object);
+      link = &object->next;
+    } else {
+      *link = object->next;
+      free_object(object);
+    }
+  }
+  heap.bytes_allocated = live_bytes;
+}
+
+static void collect_old() {
+  if (heap.globals != NULL) {
+    gc_mark_object(&heap.globals->base);
+  }
+  env_mark_globals();
+  for (size_t i = 0; i < heap.root_count; i++) {
+    gc_mark_value(*heap.roots[i]);
+  }
+  for (size_t i = 0; i < heap.env_root_count; i++) {
+    gc_mark_object(&heap.env_roots[i]->base);
+  }
+  vm_mark_roots();
+  eval_mark_roots();
+  while (heap.gray_count > 0) {
+    blacken_object(heap.gray[--heap.gray_count]);
+  }
+  sweep();
+  heap.next_collection = (size_t)(heap.bytes_allocated * heap.growth_factor);
+  if (heap.next_collection < heap.threshold) {
+    heap.next_collection = heap.threshold;
+  }
+}
+
+// The nursery is always emptied first, so the old space is traced without
+// ever meeting a young object.
+void gc_collect() {
+  collect_young();
+  if (heap.bytes_allocated > heap.next_collection) {
+    collect_old();
+  }
+}
+
+void gc_free_all() {
+  RuntimeVal *object = heap.objects;
+  while (object != NULL) {
+    RuntimeVal *next = object->next;
+    free_object(object);
+    object = next;
+  }
+  heap.objects = NULL;
+  heap.bytes_allocated = 0;
+  object = heap.young_envs;
+  while (object != NULL) {
+    RuntimeVal *next = object->next;
+    free_environment((Environment *)object);
+    object = next;
+  }
+  heap.young_envs = NULL;
+  env_pool_free_all();
+  env_free_globals();
+  reset_nursery();
+  free_safe(heap.nursery);
+  heap.nursery = heap.nursery_top = heap.nursery_end = NULL;
+  free_safe(heap.remembered);
+  heap.remembered = NULL;
+  heap.remembered_count = heap.remembered_capacity = 0;
+  free_safe(heap.roots);
+  free_safe(heap.env_roots);
+  free_safe(heap.gray);
+  heap.roots = NULL;
+  heap.env_roots = NULL;
+  heap.gray = NULL;
+  heap.root_capacity = heap.env_root_capacity = heap.gray_capacity = 0;
+}
@@ -0,0 +1,162 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+#include "chunk.h"
+#include "env.h"
+#include "values.h"
+
+#define GC_DEFAULT_THRESHOLD (1024 * 1024)
+#define GC_DEFAULT_GROWTH_FACTOR 2.0
+#define GC_DEFAULT_NURSERY_SIZE (256 * 1024)
+
+typedef struct NurseryBlock NurseryBlock;
+
+// Precise generational collector for every RuntimeVal and Environment.
+//
+// Strings, lists and dicts are born in the nursery, a bump-allocated arena
+// that also holds their payload (characters, items, entries). Once it fills
+// up, a minor collection copies the survivors to the old space, where
+// tables, functions and files are allocated directly and reclaimed by
+// mark-and-sweep. Environments are young too but never move: the minor
+// collection frees the unreachable ones and moves the others to the old
+// list. Old objects that start pointing at young ones are recorded by
+// gc_write_barrier (values.h) so minor collections need not trace the old
+// space.
+//
+// Collections only happen at safe points: loop back-edges, function entry and
+// between REPL lines. Code that merely allocates therefore never sees an
+// object disappear or move, but a value held in a C local across a call that
+// can reach a safe point (evaluate, run_program) must be registered with
+// gc_push_root for that long, and raw string/list/dict pointers must be
+// re-read from the rooted value afterwards since the object may have been
+// promoted. Environments never move; gc_push_env keeps them alive.
+typedef struct {
+  char *nursery;
+  char *nursery_top;
+  char *nursery_end;
+  size_t nursery_size;
+  NurseryBlock *overflow;  // blocks allocated once the nursery is full
+  RuntimeVal *young_envs;
+  size_t young_env_bytes;
+  RuntimeVal **remembered;
+  size_t remembered_count;
+  size_t remembered_capacity;
+  RuntimeVal *objects;
+  size_t bytes_allocated;
+  size_t next_collection;
+  size_t threshold;
+  double growth_factor;
+  Environment *globals;
+  Value **roots;
+  size_t root_count;
+  size_t root_capacity;
+  Environment **env_roots;
+  size_t env_root_count;
+  size_t env_root_capacity;
+  RuntimeVal **gray;
+  size_t gray_count;
+  size_t gray_capacity;
+  unsigned long minor_collections;
+} Heap;
+
+// The nursery memory and young environments allocated since
+// gc_begin_region. gc_end_region gives them back at once, without a
+// collection, as long as no collection ran (and the nursery did not
+// overflow) in between. The environment passed to gc_begin_region goes too
+// when it was the last one allocated before. The caller must know that
+// nothing allocated there is still referenced; see FuncDef.region.
+typedef struct {
+  char *nursery_top;
+  NurseryBlock *overflow;
+  RuntimeVal *young_envs;
+  size_t young_env_bytes;
+  unsigned long minor_collections;
+  Environment *env;
+} Region;
+
+extern Heap heap;
+
+void gc_configure(size_t threshold, double growth_factor,
+                  size_t nursery_size);
+void gc_set_globals(Environment *env);
+RuntimeVal *gc_allocate(size_t size, ValueType type);
+Environment *gc_allocate_env(size_t slot_count);
+void *gc_nursery_overflow(size_t size);
+void gc_collect();
+void gc_promote_slot(Value *slot);
+void gc_promote_env(Environment *env);
+void gc_mark_value(Value value);
+void gc_mark_object(RuntimeVal *object);
+void gc_mark_chunk(Chunk *chunk);
+int gc_in_region(Region *region, Value value);
+void gc_end_region(Region *region);
+void gc_grow_roots();
+void gc_reset_roots();
+void gc_free_all();
+
+// Payload allocated next to an object (list items, string bytes, ...) counts
+// towards the next collection too.
+static inline void gc_track_bytes(size_t bytes) {
+  heap.bytes_allocated += bytes;
+}
+
+// Raw nursery memory, 8-byte aligned. Young objects keep their payload here
+// too, so the nursery can be reset without looking at the dead ones.
+static inline void *gc_nursery_alloc(size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  if ((size_t)(heap.nursery_end - heap.nursery_top) < size) {
+    return gc_nursery_overflow(size);
+  }
+  void *memory = heap.nursery_top;
+  heap.nursery_top += size;
+  return memory;
+}
+
+static inline RuntimeVal *gc_allocate_young(size_t size, ValueType type) {
+  RuntimeVal *object = (RuntimeVal *)gc_nursery_alloc(size);
+  object->type = type;
+  object->marked = 0;
+  object->young = 1;
+  object->remembered = 0;
+  object->pinned = 0;
+  object->next = NULL;
+  return object;
+}
+
+static inline void gc_begin_region(Region *region, Environment *env) {
+  region->nursery_top = heap.nursery_top;
+  region->overflow = heap.overflow;
+  region->young_envs = heap.young_envs;
+  region->young_env_bytes = heap.young_env_bytes;
+  region->minor_collections = heap.minor_collections;
+  region->env = heap.young_envs == &env->base ? env : NULL;
+}
+
+static inline void gc_safe_point() {
+  if (heap.overflow != NULL || heap.young_env_bytes > heap.nursery_size ||
+      heap.bytes_allocated > heap.next_collection) {
+    gc_collect();
+  }
+}
+
+static inline void gc_push_root(Value *root) {
+  if (heap.root_count == heap.root_capacity) {
+    gc_grow_roots();
+  }
+  heap.roots[heap.root_count++] = root;
+}
+
+static inline void gc_pop_roots(size_t count) { heap.root_count -= count; }
+
+static inline void gc_push_env(Environment *env) {
+  if (heap.env_root_count == heap.env_root_capacity) {
+    gc_grow_roots();
+  }
+  heap.env_roots[heap.env_root_count++] = env;
+}
+
+static inline void gc_pop_env() { heap.env_root_count--; }
+
+#endif  // GC_H
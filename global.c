@@ -11,7 +11,7 @@
 
 extern ExecutionContext global_context;
 
-unsigned short int compare_runtimeval(RuntimeVal *a, RuntimeVal *b);
+unsigned short int compare_runtimeval(Value a, Value b);
 
 unsigned short int compare_lists(ListVal *a, ListVal *b) {
   if (a->size != b->size) {
@@ -40,21 +40,21 @@ unsigned short int compare_dicts(DictVal *a, DictVal *b) {
   return 1;
 }
 
-unsigned short int compare_runtimeval(RuntimeVal *a, RuntimeVal *b) {
-  if (a->type != b->type) {
+unsigned short int compare_runtimeval(Value a, Value b) {
+  if (value_type(a) != value_type(b)) {
     return 0;
   }
-  switch (a->type) {
+  switch (value_type(a)) {
     case NUMBER_T:
-      return ((NumberVal *)a)->value == ((NumberVal *)b)->value;
+      return AS_NUMBER(a) == AS_NUMBER(b);
     case BOOLEAN_T:
-      return ((BooleanVal *)a)->value == ((BooleanVal *)b)->value;
+      return a == b;
     case STRING_T:
-      return strcmp(((StringVal *)a)->value, ((StringVal *)b)->value) == 0;
+      return strcmp(AS_STRING(a)->value, AS_STRING(b)->value) == 0;
     case LIST_T:
-      return compare_lists((ListVal *)a, (ListVal *)b);
+      return compare_lists(AS_LIST(a), AS_LIST(b));
     case DICT_T:
-      return compare_dicts((DictVal *)a, (DictVal *)b);
+      return compare_dicts(AS_DICT(a), AS_DICT(b));
   }
   return 0;
 }
@@ -65,19 +65,19 @@ ListVal *dict_to_keys(DictVal *dict) {
   for (size_t i = 0; i < dict->capacity; i++) {
     Entry *entry = dict->entries[i];
     while (entry != NULL) {
-      keys_list->items[keys_list->size++] = (RuntimeVal *)MK_STRING(entry->key);
+      keys_list->items[keys_list->size++] = OBJ_VAL(MK_STRING(entry->key));
       entry = entry->next;
     }
   }
   return keys_list;
 }
 
-unsigned short int contains(RuntimeVal *obj, RuntimeVal *value) {
+unsigned short int contains(Value obj, Value value) {
   ListVal *list;
-  if(obj->type == LIST_T) {
-    list = (ListVal *)obj;
-  } else if (obj->type == DICT_T) {
-    list = dict_to_keys((DictVal *)obj);
+  if(value_type(obj) == LIST_T) {
+    list = AS_LIST(obj);
+  } else if (value_type(obj) == DICT_T) {
+    list = dict_to_keys(AS_DICT(obj));
   } else {
     error("contains function only works on lists and dictionaries");
   }
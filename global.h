@@ -8,8 +8,16 @@
 
 #include "lexer.h"
 #include "values.h"
+#define DEFAULT_MAX_CALL_DEPTH (1 << 16)
+
 typedef struct {
   int is_repl;
+  int use_tree_walker;
+  int dump_bytecode;
+  int no_optimize;
+  int trace_inline;  // report the inliner's decisions on stderr
+  int env_stats;
+  size_t max_call_depth;  // nested calls before "Stack overflow"
   jmp_buf error_jmp;
 } ExecutionContext;
 
@@ -19,8 +27,8 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream);
 void parser_error(const char *message, Token *token, TokenType type);
 void error(const char *message);
 char *read_file(const char *filename);
-unsigned short int compare_runtimeval(RuntimeVal *a, RuntimeVal *b);
-unsigned short int contains(RuntimeVal *obj, RuntimeVal *value);
+unsigned short int compare_runtimeval(Value a, Value b);
+unsigned short int contains(Value obj, Value value);
 ListVal *dict_to_keys(DictVal *dict);
 
 #endif  // GLOBAL_H
\ No newline at end of file
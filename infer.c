@@ -0,0 +1,481 @@
+#include "infer.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "malloc_safe.h"
+#include "values.h"
+
+// Runs after the resolver and works out the types (ValueType) each
+// expression and each slot variable can have, so the tree walker can drop
+// the type checks that cannot fail: see PROVEN_NUMBERS, PROVEN_LIST_INDEX,
+// number_operand and boolean_condition in ast.h.
+//
+// The types of a variable are those of every value stored in it, wherever
+// that happens. A store can only add types, so the program is visited again
+// until a pass adds none; the flags set by that last pass then hold for any
+// run. Only the slots of the function being visited are followed. A global
+// can be assigned from anywhere, and a nested function may run before a
+// variable of the function around it is bound, so reading either gives
+// every type. A program that imports a module inside a block or function,
+// which binds names the resolver never sees, is left alone.
+//
+// The same pass finds the functions whose allocations cannot escape a call
+// (FuncDef.region): the body defines no closure, calls nothing but
+// intrinsics, assigns objects to none but its own variables, overwrites
+// list items only with numbers, booleans and nil, and never appends to a
+// list or adds to a dict or table (either may allocate). Whatever it
+// allocates is then reachable after the call only through its result,
+// which the tree walker checks when the call returns.
+
+// One bit per ValueType.
+typedef unsigned int TypeSet;
+
+#define TYPE(type) (1u << (type))
+#define ANY_TYPE ((1u << VALUE_TYPE_COUNT) - 1)
+#define SCALAR_TYPES (TYPE(NUMBER_T) | TYPE(BOOLEAN_T))
+#define IMMEDIATE_TYPES (SCALAR_TYPES | TYPE(NIL_T))
+// Marks types that hold only while the intrinsics a value comes from are
+// not rebound. The tree walker notices that at run time (region_escapes in
+// eval.c), so escape analysis can count on them, but they never prove a
+// check away: no set with this bit equals a single type.
+#define ASSUMED (1u << VALUE_TYPE_COUNT)
+
+// An environment around the node being visited. Its slots start at `offset`
+// in inference.types; `function` is the function it belongs to, or -1 for
+// the values a flat closure copies.
+typedef struct {
+  size_t offset;
+  int function;
+} Frame;
+
+static struct {
+  TypeSet *types;  // the slots of every scope
+  size_t type_count;
+  size_t *scopes;  // where each scope starts in types, in visiting order
+  size_t scope_count;
+  size_t next_scope;
+  Frame *frames;
+  size_t frame_count;
+  size_t frame_capacity;
+  size_t base;    // the first frame the function being visited can see
+  int function;   // the function being visited, 0 at the top level
+  int functions;  // functions visited so far in this pass
+  int jumps;      // a break, continue or return was visited
+  int escapes;    // an allocation of the function may outlive its call
+  int changed;
+} inference;
+
+static TypeSet infer_node(Stmt *node);
+
+static TypeSet infer_expr(Expr *expr) { return infer_node(&(expr->stmt)); }
+
+// The types of the last statement of a block; nil for an empty one.
+static TypeSet infer_block(Stmt **body, size_t body_count) {
+  TypeSet types = TYPE(NIL_T);
+  for (size_t i = 0; i < body_count; i++) {
+    types = infer_node(body[i]);
+  }
+  return types;
+}
+
+// The n-th scope entered in a pass is the same one in every pass, so it
+// finds the slot types the previous passes left.
+static void enter_scope(size_t slot_count, int function) {
+  if (inference.next_scope == inference.scope_count) {
+    inference.scopes =
+        realloc_safe(inference.scopes,
+                     sizeof(size_t) * (inference.scope_count + 1),
+                     "enter_scope scopes");
+    inference.scopes[inference.scope_count++] = inference.type_count;
+    if (slot_count > 0) {
+      inference.types = realloc_safe(
+          inference.types,
+          sizeof(TypeSet) * (inference.type_count + slot_count),
+          "enter_scope types");
+      memset(inference.types + inference.type_count, 0,
+             sizeof(TypeSet) * slot_count);
+      inference.type_count += slot_count;
+    }
+  }
+  if (inference.frame_count == inference.frame_capacity) {
+    inference.frame_capacity = inference.frame_capacity * 2 + 8;
+    inference.frames =
+        realloc_safe(inference.frames,
+                     sizeof(Frame) * inference.frame_capacity,
+                     "enter_scope frames");
+  }
+  inference.frames[inference.frame_count++] =
+      (Frame){inference.scopes[inference.next_scope++], function};
+}
+
+static void enter_block(int has_scope, size_t slot_count) {
+  if (has_scope) {
+    enter_scope(slot_count, inference.function);
+  }
+}
+
+static void leave_block(int has_scope) {
+  if (has_scope) {
+    inference.frame_count--;
+  }
+}
+
+static TypeSet *slot_types(int depth, int slot) {
+  if (slot < 0 || depth < 0 ||
+      (size_t)depth >= inference.frame_count - inference.base) {
+    return NULL;
+  }
+  Frame *frame = &inference.frames[inference.frame_count - 1 - depth];
+  return &inference.types[frame->offset + slot];
+}
+
+static int is_local(int depth, int slot) {
+  return slot_types(depth, slot) != NULL &&
+         inference.frames[inference.frame_count - 1 - depth].function ==
+             inference.function;
+}
+
+static TypeSet read_slot(int depth, int slot) {
+  return is_local(depth, slot) ? *slot_types(depth, slot) : ANY_TYPE;
+}
+
+static void store_slot(int depth, int slot, TypeSet stored) {
+  TypeSet *types = slot_types(depth, slot);
+  if (types != NULL && (*types | stored) != *types) {
+    *types |= stored;
+    inference.changed = 1;
+  }
+}
+
+// What the handlers of eval.c return for operands of these types.
+static TypeSet operator_types(BinaryOperator operator, TypeSet left,
+                              TypeSet right) {
+  if (operator <= BIN_SHR && ((left | right) & ~SCALAR_TYPES) == 0) {
+    return operator >= BIN_GT && operator <= BIN_OR ? TYPE(BOOLEAN_T)
+                                                    : TYPE(NUMBER_T);
+  }
+  if (left == TYPE(LIST_T)) {
+    if (operator == BIN_SHL || operator >= BIN_EACH_ADD ||
+        (operator == BIN_MUL && right == TYPE(NUMBER_T))) {
+      return TYPE(LIST_T);
+    }
+    if (right == TYPE(LIST_T) &&
+        (operator == BIN_ADD || operator == BIN_SUB || operator == BIN_MUL ||
+         operator == BIN_BIT_AND || operator == BIN_BIT_OR ||
+         operator == BIN_BIT_XOR)) {
+      return TYPE(LIST_T);
+    }
+  }
+  if (left == TYPE(STRING_T) &&
+      ((right == TYPE(STRING_T) &&
+        (operator == BIN_ADD || operator == BIN_SUB)) ||
+       (right == TYPE(NUMBER_T) && operator == BIN_MUL))) {
+    return TYPE(STRING_T);
+  }
+  return ANY_TYPE;
+}
+
+// Whether the operator may store the right operand, or memory allocated for
+// it, into an object that already exists: `<<` appends to a list (which may
+// grow), `&<<` to every list in one, and `+` adds a row to a table.
+static int stores_operand(BinaryOperator operator, TypeSet left,
+                          TypeSet right) {
+  int lists = (left & TYPE(LIST_T)) != 0;
+  int objects = (right & ~(IMMEDIATE_TYPES | ASSUMED)) != 0;
+  switch (operator) {
+  case BIN_SHL:
+  case BIN_EACH_SHL:
+    return lists;
+  case BIN_ADD:
+    return (left & TYPE(TABLE_T)) != 0 && objects;
+  default:
+    return operator >= BIN_EACH_ADD && lists && objects;
+  }
+}
+
+static TypeSet binary_types(BinaryOperator operator, TypeSet left,
+                            TypeSet right) {
+  TypeSet assumed = (left | right) & ASSUMED;
+  return operator_types(operator, left & ~ASSUMED, right & ~ASSUMED) |
+         assumed;
+}
+
+static TypeSet intrinsic_types(Intrinsic intrinsic) {
+  switch (intrinsic) {
+  case LEN_INTRINSIC:
+  case SUM_INTRINSIC:
+    return TYPE(NUMBER_T) | ASSUMED;
+  case KEYS_INTRINSIC:
+  case VALUES_INTRINSIC:
+    return TYPE(LIST_T) | ASSUMED;
+  default:
+    return ANY_TYPE;
+  }
+}
+
+static TypeSet infer_binary(BinaryExpr *binop) {
+  TypeSet left = infer_expr(binop->left);
+  TypeSet right = infer_expr(binop->right);
+  if (stores_operand(binop->operator, left, right)) {
+    inference.escapes = 1;
+  }
+  if (left == TYPE(NUMBER_T) && right == TYPE(NUMBER_T) &&
+      binop->operator <= BIN_SHR) {
+    binop->specialization = PROVEN_NUMBERS;
+  } else if (binop->specialization == PROVEN_NUMBERS) {
+    binop->specialization = SPECIALIZE_PENDING;
+  }
+  return binary_types(binop->operator, left, right);
+}
+
+static TypeSet infer_list_index(ListIndex *list_index) {
+  TypeSet list = infer_expr(list_index->list);
+  TypeSet start = infer_expr(list_index->start);
+  if (list_index->is_slice && list_index->end != NULL) {
+    infer_expr(list_index->end);
+  }
+  if (!list_index->is_slice && list == TYPE(LIST_T) &&
+      start == TYPE(NUMBER_T)) {
+    list_index->specialization = PROVEN_LIST_INDEX;
+  } else if (list_index->specialization == PROVEN_LIST_INDEX) {
+    list_index->specialization = SPECIALIZE_PENDING;
+  }
+  return ANY_TYPE;
+}
+
+static int is_true_literal(Expr *expr) {
+  return expr->stmt.kind == BooleanLiteralAst &&
+         ((BooleanLiteral *)expr)->value;
+}
+
+// A branch cut short by break, continue or return leaves the value of an
+// earlier statement, so its types are not known.
+static TypeSet infer_if(IfExpr *if_expr) {
+  int jumps = inference.jumps;
+  inference.jumps = 0;
+  enter_block(if_expr->has_scope, if_expr->slot_count);
+  if_expr->boolean_condition =
+      infer_expr(if_expr->condition) == TYPE(BOOLEAN_T);
+  TypeSet types = infer_block(if_expr->body, if_expr->body_count);
+  leave_block(if_expr->has_scope);
+  if (if_expr->else_if != NULL) {
+    types |= infer_if((IfExpr *)if_expr->else_if);
+  } else if (if_expr->else_body != NULL) {
+    enter_block(if_expr->else_has_scope, if_expr->else_slot_count);
+    types |= infer_block(if_expr->else_body, if_expr->else_body_count);
+    leave_block(if_expr->else_has_scope);
+  } else if (!is_true_literal(if_expr->condition)) {
+    types |= TYPE(NIL_T);
+  }
+  if (inference.jumps) {
+    types = ANY_TYPE;
+  }
+  inference.jumps |= jumps;
+  return types;
+}
+
+static TypeSet infer_while(WhileExpr *while_expr) {
+  enter_block(while_expr->has_scope, while_expr->slot_count);
+  while_expr->boolean_condition =
+      infer_expr(while_expr->condition) == TYPE(BOOLEAN_T);
+  infer_block(while_expr->body, while_expr->body_count);
+  leave_block(while_expr->has_scope);
+  return ANY_TYPE;
+}
+
+static TypeSet infer_for(ForExpr *for_expr) {
+  enter_block(for_expr->has_scope, for_expr->slot_count);
+  infer_expr(for_expr->initialization);
+  for_expr->boolean_condition =
+      infer_expr(for_expr->condition) == TYPE(BOOLEAN_T);
+  enter_block(for_expr->body_has_scope, for_expr->body_slot_count);
+  infer_block(for_expr->body, for_expr->body_count);
+  leave_block(for_expr->body_has_scope);
+  infer_expr(for_expr->increment);
+  leave_block(for_expr->has_scope);
+  return ANY_TYPE;
+}
+
+// Parameters can be anything. A flat function sees only the values it
+// copies and its own scopes (see capture_scope in resolver.c). Defining a
+// function lets the environment it is defined in escape.
+static TypeSet infer_function(FuncDef *func_def) {
+  store_slot(0, func_def->slot, TYPE(FUNCTION_T));
+  size_t frame_count = inference.frame_count;
+  size_t base = inference.base;
+  int function = inference.function;
+  int jumps = inference.jumps;
+  inference.escapes = 0;
+  if (func_def->flat) {
+    inference.base = inference.frame_count;
+    enter_scope(func_def->capture_count, -1);
+  }
+  inference.function = ++inference.functions;
+  enter_scope(func_def->slot_count, inference.function);
+  for (size_t i = 0; i < func_def->param_count; i++) {
+    store_slot(0, (int)i, ANY_TYPE);
+  }
+  infer_block(func_def->body, func_def->body_count);
+  func_def->region = !inference.escapes;
+  inference.frame_count = frame_count;
+  inference.base = base;
+  inference.function = function;
+  inference.jumps = jumps;
+  inference.escapes = 1;
+  return ANY_TYPE;
+}
+
+static TypeSet infer_node(Stmt *node) {
+  switch (node->kind) {
+  case NumericLiteralAst:
+    return TYPE(NUMBER_T);
+  case BooleanLiteralAst:
+    return TYPE(BOOLEAN_T);
+  case NilAst:
+    return TYPE(NIL_T);
+  case StringLiteralAst:
+    return TYPE(STRING_T);
+  case TableLiteralAst:
+    return TYPE(TABLE_T);
+  case IdentifierAst: {
+    Identifier *ident = (Identifier *)node;
+    return read_slot(ident->depth, ident->slot);
+  }
+  case UnaryExprAst: {
+    UnaryExpr *unary_expr = (UnaryExpr *)node;
+    unary_expr->number_operand =
+        infer_expr(unary_expr->expr) == TYPE(NUMBER_T);
+    return TYPE(NUMBER_T);
+  }
+  case BinaryExprAst:
+    return infer_binary((BinaryExpr *)node);
+  case LogicalExprAst: {
+    LogicalExpr *logical = (LogicalExpr *)node;
+    TypeSet types = infer_expr(logical->left);
+    types |= infer_expr(logical->right);
+    return (types & ~SCALAR_TYPES) == 0 ? TYPE(BOOLEAN_T) : ANY_TYPE;
+  }
+  case VarDeclarationAst: {
+    VarDeclaration *var = (VarDeclaration *)node;
+    TypeSet types = infer_expr(var->value);
+    store_slot(0, var->slot, types);
+    return types;
+  }
+  case AssignVarAst: {
+    AssignVar *var = (AssignVar *)node;
+    TypeSet types = infer_expr(var->value);
+    store_slot(var->depth, var->slot, types);
+    if (!is_local(var->depth, var->slot) &&
+        (types & ~(IMMEDIATE_TYPES | ASSUMED))) {
+      inference.escapes = 1;
+    }
+    return types;
+  }
+  case AssignListVarAst: {
+    AssignListVar *var = (AssignListVar *)node;
+    infer_expr(var->index);
+    TypeSet types = infer_expr(var->value);
+    if (types & ~(IMMEDIATE_TYPES | ASSUMED)) {
+      inference.escapes = 1;
+    }
+    return types;
+  }
+  case AssignDictVarAst: {
+    AssignDictVar *var = (AssignDictVar *)node;
+    infer_expr(var->key);
+    inference.escapes = 1;
+    return infer_expr(var->value);
+  }
+  case IfAst:
+    return infer_if((IfExpr *)node);
+  case WhileAst:
+    return infer_while((WhileExpr *)node);
+  case ForAst:
+    return infer_for((ForExpr *)node);
+  case FuncDefAst:
+    return infer_function((FuncDef *)node);
+  case CallExprAst: {
+    CallExpr *call_expr = (CallExpr *)node;
+    if (call_expr->intrinsic == NO_INTRINSIC) {
+      inference.escapes = 1;
+    }
+    infer_expr(call_expr->callee);
+    for (size_t i = 0; i < call_expr->arg_count; i++) {
+      infer_expr(call_expr->arguments[i]);
+    }
+    return intrinsic_types(call_expr->intrinsic);
+  }
+  case ListLiteralAst: {
+    ListLiteral *list_lit = (ListLiteral *)node;
+    for (size_t i = 0; i < list_lit->element_count; i++) {
+      infer_expr(list_lit->elements[i]);
+    }
+    return TYPE(LIST_T);
+  }
+  case DictLiteralAst: {
+    DictLiteral *dict_lit = (DictLiteral *)node;
+    for (size_t i = 0; i < dict_lit->element_count; i++) {
+      infer_expr(dict_lit->keys[i]);
+      infer_expr(dict_lit->values[i]);
+    }
+    return TYPE(DICT_T);
+  }
+  case ListIndexAst:
+    return infer_list_index((ListIndex *)node);
+  case DictKeyAst: {
+    DictKey *dict_key = (DictKey *)node;
+    infer_expr(dict_key->dict);
+    infer_expr(dict_key->key);
+    return ANY_TYPE;
+  }
+  case BreakAst:
+  case ContinueAst:
+    inference.jumps = 1;
+    return ANY_TYPE;
+  case ReturnAst:
+    infer_expr(((ReturnExpr *)node)->value);
+    inference.jumps = 1;
+    return ANY_TYPE;
+  default:
+    return ANY_TYPE;
+  }
+}
+
+static void find_nested_import(Stmt *node, void *context) {
+  if (node->kind == ImportAst) {
+    *(int *)context = 1;
+  }
+  visit_children(node, find_nested_import, context);
+}
+
+void infer_types(Program *program) {
+  int nested_import = 0;
+  for (size_t i = 0; i < program->body_count; i++) {
+    visit_children(program->body[i], find_nested_import, &nested_import);
+  }
+  if (nested_import) {
+    return;
+  }
+  do {
+    inference.changed = 0;
+    inference.next_scope = 0;
+    inference.frame_count = 0;
+    inference.base = 0;
+    inference.function = 0;
+    inference.functions = 0;
+    inference.jumps = 0;
+    infer_block(program->body, program->body_count);
+  } while (inference.changed);
+  free_safe(inference.types);
+  inference.types = NULL;
+  inference.type_count = 0;
+  free_safe(inference.scopes);
+  inference.scopes = NULL;
+  inference.scope_count = 0;
+  free_safe(inference.frames);
+  inference.frames = NULL;
+  inference.frame_capacity = 0;
+}
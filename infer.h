@@ -0,0 +1,8 @@
+#ifndef INFER_H
+#define INFER_H
+
+#include "ast.h"
+
+void infer_types(Program *program);
+
+#endif  // INFER_H
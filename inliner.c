@@ -0,0 +1,680 @@
+#include "inliner.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "malloc_safe.h"
+
+// Runs before the optimizer and replaces calls to small functions defined at
+// the top level of the same program by their body:
+//
+//   f(a, b)   becomes   ? (true) { let x_1 = a; let y_1 = b; <body of f> }
+//
+// where x and y are the parameters of f. Every name the body declares gets a
+// suffix no identifier can contain, so it can neither hide a name used by an
+// argument nor clash with one of the caller's. The rewrite must not change
+// what the program does, so a call is only inlined when:
+// - the function is defined by a top-level statement before the one holding
+//   the call, and nothing in the program assigns its name;
+// - its body has at most INLINE_MAX_NODES nodes, does not mention the
+//   function itself, has no return, break, continue, nested function, `@`
+//   loop or import, and only declares variables at its top level, each after
+//   every use of its name;
+// - the statement holding the call declares neither the function's name nor
+//   any name the body uses without declaring it;
+// - it passes as many arguments as the function has parameters.
+// Programs that import a module (which could assign the function) and REPL
+// lines (a later line could) are left alone. --trace-inline reports every
+// decision on stderr.
+
+#define INLINE_MAX_NODES 40
+
+typedef struct {
+  char **items;
+  size_t count;
+} Names;
+
+static void add_name(Names *names, char *name) {
+  names->items = realloc_safe(names->items,
+                              sizeof(char *) * (names->count + 1), "add_name");
+  names->items[names->count++] = name;
+}
+
+static int has_name(Names *names, const char *name) {
+  for (size_t i = 0; i < names->count; i++) {
+    if (strcmp(names->items[i], name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void free_names(Names *names) {
+  free_safe(names->items);
+  names->items = NULL;
+  names->count = 0;
+}
+
+typedef struct {
+  FuncDef *func;
+  Names locals;  // the parameters, then every name the body declares
+  Names free;    // names the body uses without declaring them
+} Inlinable;
+
+static struct {
+  Inlinable *functions;
+  size_t function_count;
+  Names assigned;     // every name an assignment rebinds
+  Names declared;     // names declared inside the statement being rewritten
+  const char *site;   // what that statement defines, for --trace-inline
+  int has_import;
+  unsigned long renames;
+} inliner;
+
+static void trace(const char *format, ...) {
+  if (global_context.trace_inline) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "inline: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+  }
+}
+
+static void collect_assigned(Stmt *node, void *context) {
+  if (node->kind == AssignVarAst) {
+    add_name((Names *)context, ((AssignVar *)node)->varname);
+  } else if (node->kind == ImportAst) {
+    inliner.has_import = 1;
+  }
+  visit_children(node, collect_assigned, context);
+}
+
+static void collect_declared(Stmt *node, void *context) {
+  Names *names = (Names *)context;
+  if (node->kind == VarDeclarationAst) {
+    add_name(names, ((VarDeclaration *)node)->varname);
+  } else if (node->kind == FuncDefAst) {
+    FuncDef *func_def = (FuncDef *)node;
+    add_name(names, func_def->name);
+    for (size_t i = 0; i < func_def->param_count; i++) {
+      add_name(names, func_def->params[i]);
+    }
+  }
+  visit_children(node, collect_declared, context);
+}
+
+static void collect_used(Stmt *node, void *context) {
+  Names *names = (Names *)context;
+  switch (node->kind) {
+  case IdentifierAst:
+    add_name(names, ((Identifier *)node)->symbol);
+    break;
+  case AssignVarAst:
+    add_name(names, ((AssignVar *)node)->varname);
+    break;
+  case AssignListVarAst:
+    add_name(names, ((AssignListVar *)node)->varname);
+    break;
+  case AssignDictVarAst:
+    add_name(names, ((AssignDictVar *)node)->varname);
+    break;
+  default:
+    break;
+  }
+  visit_children(node, collect_used, context);
+}
+
+typedef struct {
+  Inlinable *inlinable;
+  size_t size;
+  const char *problem;
+} BodyCheck;
+
+// Variables declared below the top level of the body are only accepted from
+// calls inlined into it earlier, whose names are unique already.
+static void check_body_node(Stmt *node, void *context) {
+  BodyCheck *check = (BodyCheck *)context;
+  check->size++;
+  switch (node->kind) {
+  case IdentifierAst:
+    if (strcmp(((Identifier *)node)->symbol,
+               check->inlinable->func->name) == 0) {
+      check->problem = "mentions itself";
+    }
+    break;
+  case VarDeclarationAst: {
+    char *varname = ((VarDeclaration *)node)->varname;
+    if (strchr(varname, '_') == NULL) {
+      check->problem = "declares a variable in a nested block";
+    } else {
+      add_name(&check->inlinable->locals, varname);
+    }
+    break;
+  }
+  case FuncDefAst:
+    check->problem = "defines a function";
+    break;
+  case ReturnAst:
+    check->problem = "returns early";
+    break;
+  case BreakAst:
+  case ContinueAst:
+    check->problem = "breaks out of a loop";
+    break;
+  case ForAst:
+    check->problem = "has an '@' loop";
+    break;
+  case TableLiteralAst:
+  case ImportAst:
+    check->problem = "builds a table or imports a module";
+    break;
+  default:
+    break;
+  }
+  visit_children(node, check_body_node, context);
+}
+
+// Returns why the function cannot be inlined, or NULL if it can.
+static const char *analyze(Inlinable *inlinable, size_t *size) {
+  FuncDef *func = inlinable->func;
+  if (has_name(&inliner.assigned, func->name)) {
+    return "is assigned";
+  }
+  if (func->body_count == 0 ||
+      func->body[func->body_count - 1]->kind == VarDeclarationAst) {
+    return "does not end with an expression";
+  }
+  BodyCheck check = {inlinable, 0, NULL};
+  Names used = {0};
+  for (size_t p = 0; p < func->param_count; p++) {
+    add_name(&inlinable->locals, func->params[p]);
+  }
+  for (size_t i = 0; i < func->body_count && check.problem == NULL; i++) {
+    if (func->body[i]->kind != VarDeclarationAst) {
+      check_body_node(func->body[i], &check);
+      collect_used(func->body[i], &used);
+      continue;
+    }
+    VarDeclaration *var = (VarDeclaration *)func->body[i];
+    check.size++;
+    check_body_node(&(var->value->stmt), &check);
+    collect_used(&(var->value->stmt), &used);
+    if (has_name(&used, var->varname) ||
+        has_name(&inlinable->locals, var->varname)) {
+      check.problem = "uses or declares a variable before declaring it";
+    }
+    add_name(&inlinable->locals, var->varname);
+  }
+  for (size_t i = 0; i < used.count; i++) {
+    if (!has_name(&inlinable->locals, used.items[i]) &&
+        !has_name(&inlinable->free, used.items[i])) {
+      add_name(&inlinable->free, used.items[i]);
+    }
+  }
+  free_names(&used);
+  *size = check.size;
+  if (check.problem == NULL && check.size > INLINE_MAX_NODES) {
+    return "is too large";
+  }
+  return check.problem;
+}
+
+static Inlinable *find_inlinable(CallExpr *call_expr) {
+  if (call_expr->callee->stmt.kind != IdentifierAst) {
+    return NULL;
+  }
+  const char *name = ((Identifier *)call_expr->callee)->symbol;
+  for (size_t i = 0; i < inliner.function_count; i++) {
+    Inlinable *inlinable = &inliner.functions[i];
+    if (strcmp(inlinable->func->name, name) != 0) {
+      continue;
+    }
+    if (call_expr->arg_count != inlinable->func->param_count) {
+      trace("'%s' not inlined into '%s': wrong argument count", name,
+            inliner.site);
+      return NULL;
+    }
+    if (has_name(&inliner.declared, name)) {
+      trace("'%s' not inlined into '%s': the name is declared there", name,
+            inliner.site);
+      return NULL;
+    }
+    for (size_t f = 0; f < inlinable->free.count; f++) {
+      if (has_name(&inliner.declared, inlinable->free.items[f])) {
+        trace("'%s' not inlined into '%s': '%s' is declared there", name,
+              inliner.site, inlinable->free.items[f]);
+        return NULL;
+      }
+    }
+    return inlinable;
+  }
+  return NULL;
+}
+
+typedef struct {
+  Names *from;
+  char **to;
+} Renaming;
+
+static const char *renamed(Renaming *renaming, const char *name) {
+  for (size_t i = 0; i < renaming->from->count; i++) {
+    if (strcmp(renaming->from->items[i], name) == 0) {
+      return renaming->to[i];
+    }
+  }
+  return name;
+}
+
+static Stmt *clone_node(Stmt *node, Renaming *renaming);
+
+static Expr *clone_expr(Expr *expr, Renaming *renaming) {
+  return (Expr *)clone_node(&(expr->stmt), renaming);
+}
+
+static Expr **clone_exprs(Expr **exprs, size_t count, Renaming *renaming) {
+  Expr **copy = malloc_safe(sizeof(Expr *) * count, "clone_exprs");
+  for (size_t i = 0; i < count; i++) {
+    copy[i] = clone_expr(exprs[i], renaming);
+  }
+  return copy;
+}
+
+static Stmt **clone_block(Stmt **body, size_t count, Renaming *renaming) {
+  if (body == NULL) {
+    return NULL;
+  }
+  Stmt **copy = malloc_safe(sizeof(Stmt *) * count, "clone_block");
+  for (size_t i = 0; i < count; i++) {
+    copy[i] = clone_node(body[i], renaming);
+  }
+  return copy;
+}
+
+// Covers every node analyze accepts in a body.
+static Stmt *clone_node(Stmt *node, Renaming *renaming) {
+  Expr *copy;
+  switch (node->kind) {
+  case NumericLiteralAst:
+    copy = &(create_numeric_literal(((NumericLiteral *)node)->value)->base);
+    break;
+  case StringLiteralAst:
+    copy = &(create_string_literal(((StringLiteral *)node)->value)->base);
+    break;
+  case BooleanLiteralAst:
+    copy = &(create_boolean_literal(((BooleanLiteral *)node)->value)->base);
+    break;
+  case NilAst:
+    copy = &(create_nil_literal()->base);
+    break;
+  case IdentifierAst:
+    copy = &(create_identifier(
+                 renamed(renaming, ((Identifier *)node)->symbol))
+                 ->base);
+    break;
+  case UnaryExprAst: {
+    UnaryExpr *unary_expr = (UnaryExpr *)node;
+    copy = &(create_unary_expr(unary_expr->operator,
+                               clone_expr(unary_expr->expr, renaming))
+                 ->base);
+    break;
+  }
+  case BinaryExprAst: {
+    BinaryExpr *binop = (BinaryExpr *)node;
+    copy = &(create_binary_expr(clone_expr(binop->left, renaming),
+                                clone_expr(binop->right, renaming),
+                                binop->operator)
+                 ->base);
+    break;
+  }
+  case LogicalExprAst: {
+    LogicalExpr *logical = (LogicalExpr *)node;
+    copy = &(create_logical_expr(clone_expr(logical->left, renaming),
+                                 clone_expr(logical->right, renaming),
+                                 logical->operator)
+                 ->base);
+    break;
+  }
+  case VarDeclarationAst: {
+    VarDeclaration *var = (VarDeclaration *)node;
+    copy = &(create_var_expr(renamed(renaming, var->varname),
+                             clone_expr(var->value, renaming))
+                 ->base);
+    break;
+  }
+  case AssignVarAst: {
+    AssignVar *var = (AssignVar *)node;
+    copy = &(assign_var_expr(renamed(renaming, var->varname),
+                             clone_expr(var->value, renaming))
+                 ->base);
+    break;
+  }
+  case AssignListVarAst: {
+    AssignListVar *var = (AssignListVar *)node;
+    copy = &(assign_list_expr(renamed(renaming, var->varname),
+                              clone_expr(var->index, renaming),
+                              clone_expr(var->value, renaming))
+                 ->base);
+    break;
+  }
+  case AssignDictVarAst: {
+    AssignDictVar *var = (AssignDictVar *)node;
+    copy = &(assign_dict_expr(renamed(renaming, var->varname),
+                              clone_expr(var->key, renaming),
+                              clone_expr(var->value, renaming))
+                 ->base);
+    break;
+  }
+  case IfAst: {
+    IfExpr *if_expr = (IfExpr *)node;
+    IfExpr *else_if =
+        if_expr->else_if == NULL
+            ? NULL
+            : (IfExpr *)clone_node((Stmt *)if_expr->else_if, renaming);
+    copy = &(create_if(clone_expr(if_expr->condition, renaming),
+                       clone_block(if_expr->body, if_expr->body_count,
+                                   renaming),
+                       if_expr->body_count, else_if,
+                       clone_block(if_expr->else_body,
+                                   if_expr->else_body_count, renaming),
+                       if_expr->else_body_count)
+                 ->base);
+    break;
+  }
+  case WhileAst: {
+    WhileExpr *while_expr = (WhileExpr *)node;
+    copy = &(create_while(clone_expr(while_expr->condition, renaming),
+                          clone_block(while_expr->body,
+                                      while_expr->body_count, renaming),
+                          while_expr->body_count)
+                 ->base);
+    break;
+  }
+  case CallExprAst: {
+    CallExpr *call_expr = (CallExpr *)node;
+    copy = &(create_call_expr(clone_expr(call_expr->callee, renaming),
+                              clone_exprs(call_expr->arguments,
+                                          call_expr->arg_count, renaming),
+                              call_expr->arg_count)
+                 ->base);
+    break;
+  }
+  case ListLiteralAst: {
+    ListLiteral *list_lit = (ListLiteral *)node;
+    copy = &(create_list_literal(clone_exprs(list_lit->elements,
+                                             list_lit->element_count,
+                                             renaming),
+                                 list_lit->element_count)
+                 ->base);
+    break;
+  }
+  case DictLiteralAst: {
+    DictLiteral *dict_lit = (DictLiteral *)node;
+    copy = &(create_dict_literal(
+                 clone_exprs(dict_lit->keys, dict_lit->element_count,
+                             renaming),
+                 clone_exprs(dict_lit->values, dict_lit->element_count,
+                             renaming),
+                 dict_lit->element_count)
+                 ->base);
+    break;
+  }
+  case ListIndexAst: {
+    ListIndex *list_index = (ListIndex *)node;
+    Expr *end = list_index->is_slice && list_index->end != NULL
+                    ? clone_expr(list_index->end, renaming)
+                    : NULL;
+    copy = &(create_list_index(clone_expr(list_index->list, renaming),
+                               clone_expr(list_index->start, renaming), end,
+                               list_index->is_slice)
+                 ->base);
+    break;
+  }
+  case DictKeyAst: {
+    DictKey *dict_key = (DictKey *)node;
+    copy = &(create_dict_key(clone_expr(dict_key->dict, renaming),
+                             clone_expr(dict_key->key, renaming))
+                 ->base);
+    break;
+  }
+  default:
+    error("Cannot inline this node.\n");
+    return NULL;
+  }
+  return &(copy->stmt);
+}
+
+// The arguments move into the declarations of the parameters; the rest of
+// the call is freed.
+static Stmt *inline_call(CallExpr *call_expr, Inlinable *inlinable) {
+  FuncDef *func = inlinable->func;
+  Renaming renaming = {&inlinable->locals,
+                       malloc_safe(sizeof(char *) * inlinable->locals.count,
+                                   "inline_call renaming")};
+  inliner.renames++;
+  for (size_t i = 0; i < inlinable->locals.count; i++) {
+    const char *name = inlinable->locals.items[i];
+    size_t length = strlen(name) + 24;
+    renaming.to[i] = malloc_safe(length, "inline_call name");
+    snprintf(renaming.to[i], length, "%s_%lu", name, inliner.renames);
+  }
+  size_t body_count = func->param_count + func->body_count;
+  Stmt **body = malloc_safe(sizeof(Stmt *) * body_count, "inline_call body");
+  for (size_t p = 0; p < func->param_count; p++) {
+    body[p] = &(create_var_expr(renaming.to[p], call_expr->arguments[p])
+                    ->base.stmt);
+  }
+  for (size_t i = 0; i < func->body_count; i++) {
+    body[func->param_count + i] = clone_node(func->body[i], &renaming);
+  }
+  for (size_t i = 0; i < inlinable->locals.count; i++) {
+    free_safe(renaming.to[i]);
+  }
+  free_safe(renaming.to);
+  free_stmt(&(call_expr->callee->stmt));
+  free_safe(call_expr->arguments);
+  free_safe(call_expr);
+  trace("'%s' inlined into '%s'", func->name, inliner.site);
+  return &(create_if(&(create_boolean_literal(1)->base), body, body_count,
+                     NULL, NULL, 0)
+               ->base.stmt);
+}
+
+static Stmt *inline_node(Stmt *node);
+
+static Expr *inline_expr(Expr *expr) {
+  return (Expr *)inline_node(&(expr->stmt));
+}
+
+static void inline_block(Stmt **body, size_t body_count) {
+  for (size_t i = 0; i < body_count; i++) {
+    body[i] = inline_node(body[i]);
+  }
+}
+
+static void inline_exprs(Expr **exprs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    exprs[i] = inline_expr(exprs[i]);
+  }
+}
+
+static Stmt *inline_node(Stmt *node) {
+  switch (node->kind) {
+  case UnaryExprAst: {
+    UnaryExpr *unary_expr = (UnaryExpr *)node;
+    unary_expr->expr = inline_expr(unary_expr->expr);
+    break;
+  }
+  case BinaryExprAst: {
+    BinaryExpr *binop = (BinaryExpr *)node;
+    binop->left = inline_expr(binop->left);
+    binop->right = inline_expr(binop->right);
+    break;
+  }
+  case LogicalExprAst: {
+    LogicalExpr *logical = (LogicalExpr *)node;
+    logical->left = inline_expr(logical->left);
+    logical->right = inline_expr(logical->right);
+    break;
+  }
+  case VarDeclarationAst: {
+    VarDeclaration *var = (VarDeclaration *)node;
+    var->value = inline_expr(var->value);
+    break;
+  }
+  case AssignVarAst: {
+    AssignVar *var = (AssignVar *)node;
+    var->value = inline_expr(var->value);
+    break;
+  }
+  case AssignListVarAst: {
+    AssignListVar *var = (AssignListVar *)node;
+    var->value = inline_expr(var->value);
+    var->index = inline_expr(var->index);
+    break;
+  }
+  case AssignDictVarAst: {
+    AssignDictVar *var = (AssignDictVar *)node;
+    var->value = inline_expr(var->value);
+    var->key = inline_expr(var->key);
+    break;
+  }
+  case IfAst: {
+    IfExpr *if_expr = (IfExpr *)node;
+    if_expr->condition = inline_expr(if_expr->condition);
+    inline_block(if_expr->body, if_expr->body_count);
+    if (if_expr->else_if != NULL) {
+      inline_node((Stmt *)if_expr->else_if);
+    }
+    inline_block(if_expr->else_body, if_expr->else_body_count);
+    break;
+  }
+  case WhileAst: {
+    WhileExpr *while_expr = (WhileExpr *)node;
+    while_expr->condition = inline_expr(while_expr->condition);
+    inline_block(while_expr->body, while_expr->body_count);
+    break;
+  }
+  case ForAst: {
+    ForExpr *for_expr = (ForExpr *)node;
+    for_expr->initialization = inline_expr(for_expr->initialization);
+    for_expr->condition = inline_expr(for_expr->condition);
+    for_expr->increment = inline_expr(for_expr->increment);
+    inline_block(for_expr->body, for_expr->body_count);
+    break;
+  }
+  case FuncDefAst: {
+    FuncDef *func_def = (FuncDef *)node;
+    inline_block(func_def->body, func_def->body_count);
+    break;
+  }
+  case CallExprAst: {
+    CallExpr *call_expr = (CallExpr *)node;
+    call_expr->callee = inline_expr(call_expr->callee);
+    inline_exprs(call_expr->arguments, call_expr->arg_count);
+    Inlinable *inlinable = find_inlinable(call_expr);
+    if (inlinable != NULL) {
+      return inline_call(call_expr, inlinable);
+    }
+    break;
+  }
+  case ListLiteralAst: {
+    ListLiteral *list_lit = (ListLiteral *)node;
+    inline_exprs(list_lit->elements, list_lit->element_count);
+    break;
+  }
+  case DictLiteralAst: {
+    DictLiteral *dict_lit = (DictLiteral *)node;
+    inline_exprs(dict_lit->keys, dict_lit->element_count);
+    inline_exprs(dict_lit->values, dict_lit->element_count);
+    break;
+  }
+  case ListIndexAst: {
+    ListIndex *list_index = (ListIndex *)node;
+    list_index->list = inline_expr(list_index->list);
+    list_index->start = inline_expr(list_index->start);
+    if (list_index->is_slice && list_index->end != NULL) {
+      list_index->end = inline_expr(list_index->end);
+    }
+    break;
+  }
+  case DictKeyAst: {
+    DictKey *dict_key = (DictKey *)node;
+    dict_key->dict = inline_expr(dict_key->dict);
+    dict_key->key = inline_expr(dict_key->key);
+    break;
+  }
+  case ReturnAst: {
+    ReturnExpr *return_expr = (ReturnExpr *)node;
+    return_expr->value = inline_expr(return_expr->value);
+    break;
+  }
+  default:
+    break;
+  }
+  return node;
+}
+
+// A function defined at the top level becomes a candidate once its own body
+// has been rewritten, so it is never inlined into itself or into code that
+// comes before it.
+static void add_candidate(FuncDef *func) {
+  Inlinable inlinable = {func, {0}, {0}};
+  size_t size = 0;
+  const char *problem = analyze(&inlinable, &size);
+  if (problem != NULL) {
+    trace("'%s' cannot be inlined: it %s", func->name, problem);
+    free_names(&inlinable.locals);
+    free_names(&inlinable.free);
+    return;
+  }
+  trace("'%s' can be inlined (%zu nodes)", func->name, size);
+  inliner.functions = realloc_safe(inliner.functions,
+                                   sizeof(Inlinable) *
+                                       (inliner.function_count + 1),
+                                   "add_candidate");
+  inliner.functions[inliner.function_count++] = inlinable;
+}
+
+void inline_program(Program *program) {
+  if (global_context.is_repl) {
+    return;
+  }
+  inliner.has_import = 0;
+  for (size_t i = 0; i < program->body_count; i++) {
+    collect_assigned(program->body[i], &inliner.assigned);
+  }
+  if (inliner.has_import) {
+    trace("nothing inlined: the program imports a module");
+  }
+  for (size_t i = 0; i < program->body_count && !inliner.has_import; i++) {
+    Stmt *stmt = program->body[i];
+    inliner.site = "top level";
+    if (stmt->kind == FuncDefAst) {
+      FuncDef *func_def = (FuncDef *)stmt;
+      inliner.site = func_def->name;
+      for (size_t p = 0; p < func_def->param_count; p++) {
+        add_name(&inliner.declared, func_def->params[p]);
+      }
+    }
+    visit_children(stmt, collect_declared, &inliner.declared);
+    program->body[i] = inline_node(stmt);
+    free_names(&inliner.declared);
+    if (program->body[i]->kind == FuncDefAst) {
+      add_candidate((FuncDef *)program->body[i]);
+    }
+  }
+  for (size_t i = 0; i < inliner.function_count; i++) {
+    free_names(&inliner.functions[i].locals);
+    free_names(&inliner.functions[i].free);
+  }
+  free_safe(inliner.functions);
+  inliner.functions = NULL;
+  inliner.function_count = 0;
+  free_names(&inliner.assigned);
+}
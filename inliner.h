@@ -0,0 +1,8 @@
+#ifndef INLINER_H
+#define INLINER_H
+
+#include "ast.h"
+
+void inline_program(Program *program);
+
+#endif  // INLINER_H
@@ -0,0 +1,725 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "env.h"
+#include "gc.h"
+#include "malloc_safe.h"
+#include "values.h"
+
+unsigned long jit_threshold = JIT_DEFAULT_THRESHOLD;
+
+void jit_configure(unsigned long threshold) { jit_threshold = threshold; }
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+// Native code is entered with the frame's registers, the frame and the
+// chunk's constants, plus the address of the instruction to start at. It
+// returns the pc of the instruction the interpreter has to run next, shifted
+// left once; the low bit is set when it stopped because an operand had an
+// unexpected type.
+typedef uint32_t (*JitFunction)(Value *regs, CallFrame *frame,
+                                Value *constants, void *target);
+
+struct JitCode {
+  unsigned char *memory;
+  size_t size;
+  JitFunction function;
+  void **entries;  // per pc, NULL where the interpreter has to run anyway
+  unsigned long guard_failures;
+};
+
+// While native code runs, rbx holds the registers, r12 the frame, r13 the
+// constants, r14 the frame's environment and r15 the QNAN mask.
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+enum { CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_AE = 0x3, CC_P = 0xa,
+       CC_NP = 0xb };
+
+typedef struct {
+  size_t at;  // offset of the rel32 to patch
+  uint32_t target;
+  int is_exit;  // target is an exit code rather than a pc
+} Fixup;
+
+typedef struct {
+  unsigned char *code;
+  size_t count;
+  size_t capacity;
+  Fixup *fixups;
+  size_t fixup_count;
+  size_t fixup_capacity;
+  size_t epilogue;
+} Assembler;
+
+static void emit_byte(Assembler *a, unsigned char byte) {
+  if (a->count == a->capacity) {
+    a->capacity = a->capacity == 0 ? 1024 : a->capacity * 2;
+    a->code = realloc_safe(a->code, a->capacity, "jit code");
+  }
+  a->code[a->count++] = byte;
+}
+
+static void emit_u32(Assembler *a, uint32_t value) {
+  for (int shift = 0; shift < 32; shift += 8) {
+    emit_byte(a, (unsigned char)(value >> shift));
+  }
+}
+
+static void emit_u64(Assembler *a, uint64_t value) {
+  emit_u32(a, (uint32_t)value);
+  emit_u32(a, (uint32_t)(value >> 32));
+}
+
+static void emit_rex(Assembler *a, int wide, int reg, int rm) {
+  unsigned char rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) |
+                      ((rm & 8) ? 1 : 0);
+  if (rex != 0x40) {
+    emit_byte(a, rex);
+  }
+}
+
+// [base + disp32]
+static void emit_mem(Assembler *a, int reg, int base, int32_t disp) {
+  emit_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emit_byte(a, 0x24);
+  }
+  emit_u32(a, (uint32_t)disp);
+}
+
+static void emit_modrm_reg(Assembler *a, int reg, int rm) {
+  emit_byte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void mov_load(Assembler *a, int reg, int base, int32_t disp) {
+  emit_rex(a, 1, reg, base);
+  emit_byte(a, 0x8b);
+  emit_mem(a, reg, base, disp);
+}
+
+static void mov_store(Assembler *a, int base, int32_t disp, int reg) {
+  emit_rex(a, 1, reg, base);
+  emit_byte(a, 0x89);
+  emit_mem(a, reg, base, disp);
+}
+
+static void mov_reg(Assembler *a, int dst, int src) {
+  emit_rex(a, 1, src, dst);
+  emit_byte(a, 0x89);
+  emit_modrm_reg(a, src, dst);
+}
+
+static void mov_imm64(Assembler *a, int reg, uint64_t value) {
+  emit_rex(a, 1, 0, reg);
+  emit_byte(a, 0xb8 | (reg & 7));
+  emit_u64(a, value);
+}
+
+static void mov_imm32(Assembler *a, int reg, uint32_t value) {
+  emit_rex(a, 0, 0, reg);
+  emit_byte(a, 0xb8 | (reg & 7));
+  emit_u32(a, value);
+}
+
+// and/cmp/add dst, src
+static void alu_reg(Assembler *a, unsigned char opcode, int dst, int src) {
+  emit_rex(a, 1, src, dst);
+  emit_byte(a, opcode);
+  emit_modrm_reg(a, src, dst);
+}
+
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_OR 0x09
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+
+// cmp reg, [base + disp32]
+static void cmp_load(Assembler *a, int reg, int base, int32_t disp) {
+  emit_rex(a, 1, reg, base);
+  emit_byte(a, 0x3b);
+  emit_mem(a, reg, base, disp);
+}
+
+static void push_reg(Assembler *a, int reg) {
+  emit_rex(a, 0, 0, reg);
+  emit_byte(a, 0x50 | (reg & 7));
+}
+
+static void pop_reg(Assembler *a, int reg) {
+  emit_rex(a, 0, 0, reg);
+  emit_byte(a, 0x58 | (reg & 7));
+}
+
+static void sse_mem(Assembler *a, unsigned char prefix, unsigned char opcode,
+                    int xmm, int base, int32_t disp) {
+  emit_byte(a, prefix);
+  emit_rex(a, 0, xmm, base);
+  emit_byte(a, 0x0f);
+  emit_byte(a, opcode);
+  emit_mem(a, xmm, base, disp);
+}
+
+static void sse_reg(Assembler *a, unsigned char prefix, unsigned char opcode,
+                    int dst, int src) {
+  emit_byte(a, prefix);
+  emit_byte(a, 0x0f);
+  emit_byte(a, opcode);
+  emit_modrm_reg(a, dst, src);
+}
+
+#define SSE_MOVSD_LOAD 0x10
+#define SSE_MOVSD_STORE 0x11
+#define SSE_UCOMISD 0x2e
+#define SSE_XORPD 0x57
+#define SSE_ADDSD 0x58
+#define SSE_MULSD 0x59
+#define SSE_SUBSD 0x5c
+#define SSE_DIVSD 0x5e
+
+// movq xmm, reg
+static void movq_to_xmm(Assembler *a, int xmm, int reg) {
+  emit_byte(a, 0x66);
+  emit_rex(a, 1, xmm, reg);
+  emit_byte(a, 0x0f);
+  emit_byte(a, 0x6e);
+  emit_modrm_reg(a, xmm, reg);
+}
+
+// cvttsd2si reg, xmm (64-bit, truncating)
+static void cvt_to_integer(Assembler *a, int reg, int xmm) {
+  emit_byte(a, 0xf2);
+  emit_rex(a, 1, reg, xmm);
+  emit_byte(a, 0x0f);
+  emit_byte(a, 0x2c);
+  emit_modrm_reg(a, reg, xmm);
+}
+
+// cvtsi2sd xmm, reg (64-bit)
+static void cvt_to_double(Assembler *a, int xmm, int reg) {
+  emit_byte(a, 0xf2);
+  emit_rex(a, 1, xmm, reg);
+  emit_byte(a, 0x0f);
+  emit_byte(a, 0x2a);
+  emit_modrm_reg(a, xmm, reg);
+}
+
+static void setcc(Assembler *a, int cc, int reg8) {
+  emit_byte(a, 0x0f);
+  emit_byte(a, 0x90 | cc);
+  emit_modrm_reg(a, 0, reg8);
+}
+
+static void add_fixup(Assembler *a, uint32_t target, int is_exit) {
+  if (a->fixup_count == a->fixup_capacity) {
+    a->fixup_capacity = a->fixup_capacity == 0 ? 64 : a->fixup_capacity * 2;
+    a->fixups = realloc_safe(a->fixups, sizeof(Fixup) * a->fixup_capacity,
+                             "jit fixups");
+  }
+  a->fixups[a->fixup_count++] = (Fixup){a->count, target, is_exit};
+  emit_u32(a, 0);
+}
+
+static void jump_to_pc(Assembler *a, size_t pc) {
+  emit_byte(a, 0xe9);
+  add_fixup(a, (uint32_t)pc, 0);
+}
+
+static void jcc_to_pc(Assembler *a, int cc, size_t pc) {
+  emit_byte(a, 0x0f);
+  emit_byte(a, 0x80 | cc);
+  add_fixup(a, (uint32_t)pc, 0);
+}
+
+static void jcc_exit(Assembler *a, int cc, size_t pc, int guard) {
+  emit_byte(a, 0x0f);
+  emit_byte(a, 0x80 | cc);
+  add_fixup(a, (uint32_t)(pc << 1 | guard), 1);
+}
+
+static void exit_at(Assembler *a, size_t pc) {
+  emit_byte(a, 0xe9);
+  add_fixup(a, (uint32_t)(pc << 1), 1);
+}
+
+static void call_helper(Assembler *a, void *helper, Instruction i) {
+  mov_reg(a, RDI, R12);
+  mov_imm32(a, RSI, i);
+  mov_imm64(a, RAX, (uint64_t)(uintptr_t)helper);
+  emit_byte(a, 0xff);
+  emit_byte(a, 0xd0);
+}
+
+#define REG(r) ((int32_t)((r) * sizeof(Value)))
+
+// Leaves for the interpreter unless rax holds a number.
+static void guard_number(Assembler *a, size_t pc) {
+  mov_reg(a, RCX, RAX);
+  alu_reg(a, ALU_AND, RCX, R15);
+  alu_reg(a, ALU_CMP, RCX, R15);
+  jcc_exit(a, CC_E, pc, 1);
+}
+
+// Objects need a write barrier, so only other values are stored natively.
+static void guard_not_object(Assembler *a, size_t pc) {
+  mov_imm64(a, RDX, QNAN | SIGN_BIT);
+  mov_reg(a, RCX, RAX);
+  alu_reg(a, ALU_AND, RCX, RDX);
+  alu_reg(a, ALU_CMP, RCX, RDX);
+  jcc_exit(a, CC_E, pc, 1);
+}
+
+static int is_number_operand(Chunk *chunk, int operand) {
+  return !(operand & RK_CONSTANT) ||
+         IS_NUMBER(chunk->constants[operand & ~RK_CONSTANT]);
+}
+
+static void load_number(Assembler *a, int xmm, int operand, size_t pc) {
+  if (operand & RK_CONSTANT) {
+    sse_mem(a, 0xf2, SSE_MOVSD_LOAD, xmm, R13,
+            REG(operand & ~RK_CONSTANT));
+    return;
+  }
+  mov_load(a, RAX, RBX, REG(operand));
+  guard_number(a, pc);
+  movq_to_xmm(a, xmm, RAX);
+}
+
+// rax = environment `depth` levels up
+static void load_env(Assembler *a, int depth) {
+  mov_reg(a, RAX, R14);
+  for (int d = 0; d < depth; d++) {
+    mov_load(a, RAX, RAX, offsetof(Environment, parent));
+  }
+}
+
+static Value jit_get_var(CallFrame *frame, Instruction i) {
+  return frame->regs[GET_A(i)] =
+             lookup_name(frame->env, frame->chunk->names[GET_BX(i)],
+                         frame->chunk->name_ids[GET_BX(i)],
+                         &frame->chunk->name_caches[GET_BX(i)]);
+}
+
+static void jit_set_var(CallFrame *frame, Instruction i) {
+  assign_var(frame->env, frame->chunk->names[GET_BX(i)],
+             frame->regs[GET_A(i)]);
+}
+
+static int jit_intrinsic(CallFrame *frame, Instruction i) {
+  Value *base = &frame->regs[GET_A(i)];
+  if (!is_intrinsic_callee(*base, GET_B(i))) {
+    return 0;
+  }
+  *base = run_intrinsic(GET_B(i), frame->env, base + 1);
+  return 1;
+}
+
+static void jit_push_env(CallFrame *frame, Instruction i) {
+  frame->env = create_local_environment(frame->env, scope_names[GET_A(i)],
+                                        GET_BX(i));
+}
+
+static void compile_arith(Assembler *a, Instruction i, size_t pc,
+                          unsigned char opcode) {
+  load_number(a, 0, GET_B(i), pc);
+  load_number(a, 1, GET_C(i), pc);
+  if (opcode == SSE_DIVSD) {
+    // Division by zero (and by NaN) is reported by the interpreter.
+    sse_reg(a, 0x66, SSE_XORPD, 2, 2);
+    sse_reg(a, 0x66, SSE_UCOMISD, 1, 2);
+    jcc_exit(a, CC_E, pc, 0);
+  }
+  sse_reg(a, 0xf2, opcode, 0, 1);
+  sse_mem(a, 0xf2, SSE_MOVSD_STORE, 0, RBX, REG(GET_A(i)));
+}
+
+// Operands are swapped where needed so that every comparison is "above" or
+// "above or equal", which is false for NaN like its C counterpart.
+static void compile_compare(Assembler *a, Instruction i, size_t pc, int cc,
+                            int swap) {
+  load_number(a, 0, GET_B(i), pc);
+  load_number(a, 1, GET_C(i), pc);
+  sse_reg(a, 0x66, SSE_UCOMISD, swap ? 1 : 0, swap ? 0 : 1);
+  setcc(a, cc, RAX);
+  if (cc == CC_E) {
+    setcc(a, CC_NP, RCX);
+    emit_byte(a, 0x20);  // and al, cl
+    emit_byte(a, 0xc8);
+  } else if (cc == CC_NE) {
+    setcc(a, CC_P, RCX);
+    emit_byte(a, 0x08);  // or al, cl
+    emit_byte(a, 0xc8);
+  }
+  emit_byte(a, 0x0f);  // movzx eax, al
+  emit_byte(a, 0xb6);
+  emit_byte(a, 0xc0);
+  mov_imm64(a, RCX, FALSE_VAL);
+  alu_reg(a, ALU_ADD, RAX, RCX);
+  mov_store(a, RBX, REG(GET_A(i)), RAX);
+}
+
+// Jumps when R[A] is the boolean `taken`, falls through on the other one;
+// anything else (a number under JMPAND/JMPOR, or the error a non-boolean
+// condition raises) is left to the interpreter.
+static void compile_jump_if(Assembler *a, Instruction i, size_t pc,
+                            Value taken) {
+  mov_load(a, RAX, RBX, REG(GET_A(i)));
+  mov_imm64(a, RCX, taken);
+  alu_reg(a, ALU_CMP, RAX, RCX);
+  jcc_to_pc(a, CC_E, pc + 1 + GET_SBX(i));
+  mov_imm64(a, RCX, taken ^ 1);
+  alu_reg(a, ALU_CMP, RAX, RCX);
+  jcc_exit(a, CC_NE, pc, 1);
+}
+
+// BINARY `&&` or `||` on two booleans. FALSE_VAL and TRUE_VAL only differ in
+// the lowest bit, so the result is their bitwise and/or.
+static void compile_logical(Assembler *a, Instruction i, size_t pc, int alu) {
+  mov_imm64(a, RDX, ~(uint64_t)1);
+  mov_imm64(a, RSI, FALSE_VAL);
+  mov_load(a, RAX, RBX, REG(GET_B(i)));
+  mov_reg(a, RCX, RAX);
+  alu_reg(a, ALU_AND, RCX, RDX);
+  alu_reg(a, ALU_CMP, RCX, RSI);
+  jcc_exit(a, CC_NE, pc, 1);
+  mov_load(a, RDI, RBX, REG(GET_C(i)));
+  mov_reg(a, RCX, RDI);
+  alu_reg(a, ALU_AND, RCX, RDX);
+  alu_reg(a, ALU_CMP, RCX, RSI);
+  jcc_exit(a, CC_NE, pc, 1);
+  alu_reg(a, alu, RAX, RDI);
+  mov_store(a, RBX, REG(GET_A(i)), RAX);
+}
+
+// BINARY %, &, | or ^ on two numbers, as 64-bit integers (see
+// number_to_integer). Numbers the conversion would saturate, a zero divisor
+// and a divisor of -1 are left to the interpreter.
+static void compile_integer(Assembler *a, Instruction i, size_t pc,
+                            BinaryOperator operator) {
+  load_number(a, 0, GET_B(i), pc);
+  load_number(a, 1, GET_C(i), pc);
+  cvt_to_integer(a, RAX, 0);
+  cvt_to_integer(a, RCX, 1);
+  mov_imm64(a, RDX, (uint64_t)INT64_MIN);
+  alu_reg(a, ALU_CMP, RAX, RDX);
+  jcc_exit(a, CC_E, pc, 0);
+  alu_reg(a, ALU_CMP, RCX, RDX);
+  jcc_exit(a, CC_E, pc, 0);
+  switch (operator) {
+  case BIN_BIT_AND:
+    alu_reg(a, ALU_AND, RAX, RCX);
+    break;
+  case BIN_BIT_OR:
+    alu_reg(a, ALU_OR, RAX, RCX);
+    break;
+  case BIN_BIT_XOR:
+    alu_reg(a, ALU_XOR, RAX, RCX);
+    break;
+  default:
+    mov_imm64(a, RDX, 0);
+    alu_reg(a, ALU_CMP, RCX, RDX);
+    jcc_exit(a, CC_E, pc, 0);
+    mov_imm64(a, RDX, (uint64_t)-1);
+    alu_reg(a, ALU_CMP, RCX, RDX);
+    jcc_exit(a, CC_E, pc, 0);
+    emit_byte(a, 0x48);  // cqo
+    emit_byte(a, 0x99);
+    emit_byte(a, 0x48);  // idiv rcx
+    emit_byte(a, 0xf7);
+    emit_byte(a, 0xf9);
+    mov_reg(a, RAX, RDX);
+    break;
+  }
+  cvt_to_double(a, 0, RAX);
+  sse_mem(a, 0xf2, SSE_MOVSD_STORE, 0, RBX, REG(GET_A(i)));
+}
+
+// The back-edge leaves for the interpreter when a collection is due, so the
+// safe point runs there.
+static void compile_loop(Assembler *a, Instruction i, size_t pc) {
+  mov_imm64(a, RAX, (uint64_t)(uintptr_t)&heap);
+  mov_imm32(a, RCX, 0);
+  cmp_load(a, RCX, RAX, offsetof(Heap, overflow));
+  jcc_exit(a, CC_NE, pc, 0);
+  mov_load(a, RCX, RAX, offsetof(Heap, young_env_bytes));
+  cmp_load(a, RCX, RAX, offsetof(Heap, nursery_size));
+  jcc_exit(a, CC_A, pc, 0);
+  mov_load(a, RCX, RAX, offsetof(Heap, bytes_allocated));
+  cmp_load(a, RCX, RAX, offsetof(Heap, next_collection));
+  jcc_exit(a, CC_A, pc, 0);
+  jump_to_pc(a, pc + 1 + GET_SBX(i));
+}
+
+// Returns 0 when the instruction is left to the interpreter.
+static int compile_instruction(Assembler *a, Chunk *chunk, size_t pc) {
+  Instruction i = chunk->code[pc];
+  switch (GET_OP(i)) {
+  case OP_MOVE:
+    mov_load(a, RAX, RBX, REG(GET_B(i)));
+    mov_store(a, RBX, REG(GET_A(i)), RAX);
+    return 1;
+  case OP_LOADK:
+    mov_load(a, RAX, R13, REG(GET_BX(i)));
+    mov_store(a, RBX, REG(GET_A(i)), RAX);
+    return 1;
+  case OP_LOADNIL:
+  case OP_LOADBOOL:
+    mov_imm64(a, RAX,
+              GET_OP(i) == OP_LOADNIL ? NIL_VAL : BOOL_VAL(GET_B(i)));
+    mov_store(a, RBX, REG(GET_A(i)), RAX);
+    return 1;
+  case OP_GETVAR:
+    call_helper(a, (void *)jit_get_var, i);
+    return 1;
+  case OP_SETVAR:
+    call_helper(a, (void *)jit_set_var, i);
+    return 1;
+  case OP_GETLOCAL:
+    load_env(a, GET_B(i));
+    mov_load(a, RAX, RAX, offsetof(Environment, slots));
+    mov_load(a, RAX, RAX, REG(GET_C(i)));
+    mov_imm64(a, RCX, EMPTY_VAL);
+    alu_reg(a, ALU_CMP, RAX, RCX);
+    jcc_exit(a, CC_E, pc, 0);
+    mov_store(a, RBX, REG(GET_A(i)), RAX);
+    return 1;
+  case OP_SETLOCAL:
+  case OP_DEFLOCAL: {
+    int slot = GET_OP(i) == OP_SETLOCAL ? GET_C(i) : GET_BX(i);
+    mov_load(a, RAX, RBX, REG(GET_A(i)));
+    guard_not_object(a, pc);
+    mov_reg(a, RSI, RAX);
+    load_env(a, GET_OP(i) == OP_SETLOCAL ? GET_B(i) : 0);
+    mov_load(a, RAX, RAX, offsetof(Environment, slots));
+    if (GET_OP(i) == OP_SETLOCAL) {
+      mov_load(a, RCX, RAX, REG(slot));
+      mov_imm64(a, RDX, EMPTY_VAL);
+      alu_reg(a, ALU_CMP, RCX, RDX);
+      jcc_exit(a, CC_E, pc, 0);
+    }
+    mov_store(a, RAX, REG(slot), RSI);
+    return 1;
+  }
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV: {
+    if (!is_number_operand(chunk, GET_B(i)) ||
+        !is_number_operand(chunk, GET_C(i))) {
+      return 0;
+    }
+    static const unsigned char opcodes[] = {SSE_ADDSD, SSE_SUBSD, SSE_MULSD,
+                                            SSE_DIVSD};
+    compile_arith(a, i, pc, opcodes[GET_OP(i) - OP_ADD]);
+    return 1;
+  }
+  case OP_LT:
+  case OP_LE:
+  case OP_GT:
+  case OP_GE:
+  case OP_EQ:
+  case OP_NE: {
+    if (!is_number_operand(chunk, GET_B(i)) ||
+        !is_number_operand(chunk, GET_C(i))) {
+      return 0;
+    }
+    static const int conditions[] = {CC_A, CC_AE, CC_A, CC_AE, CC_E, CC_NE};
+    static const int swaps[] = {1, 1, 0, 0, 0, 0};
+    compile_compare(a, i, pc, conditions[GET_OP(i) - OP_LT],
+                    swaps[GET_OP(i) - OP_LT]);
+    return 1;
+  }
+  case OP_UNM:
+  case OP_UPLUS:
+    mov_load(a, RAX, RBX, REG(GET_B(i)));
+    guard_number(a, pc);
+    if (GET_OP(i) == OP_UNM) {
+      emit_byte(a, 0x48);  // btc rax, 63
+      emit_byte(a, 0x0f);
+      emit_byte(a, 0xba);
+      emit_byte(a, 0xf8);
+      emit_byte(a, 63);
+    }
+    mov_store(a, RBX, REG(GET_A(i)), RAX);
+    return 1;
+  case OP_JMP:
+    jump_to_pc(a, pc + 1 + GET_SBX(i));
+    return 1;
+  case OP_LOOP:
+    compile_loop(a, i, pc);
+    return 1;
+  case OP_JMPFALSE_IF:
+  case OP_JMPFALSE_WHILE:
+  case OP_JMPFALSE_FOR:
+  case OP_JMPAND:
+    compile_jump_if(a, i, pc, FALSE_VAL);
+    return 1;
+  case OP_JMPOR:
+    compile_jump_if(a, i, pc, TRUE_VAL);
+    return 1;
+  case OP_BINARY: {
+    BinaryOperator operator = (BinaryOperator)chunk->code[pc + 1];
+    if (operator == BIN_AND || operator == BIN_OR) {
+      compile_logical(a, i, pc, operator == BIN_AND ? ALU_AND : ALU_OR);
+      return 1;
+    }
+    if (operator == BIN_MOD || operator == BIN_BIT_AND ||
+        operator == BIN_BIT_OR || operator == BIN_BIT_XOR) {
+      compile_integer(a, i, pc, operator);
+      return 1;
+    }
+    return 0;
+  }
+  case OP_INTRINSIC:
+    // Skips the call when the helper ran the builtin itself.
+    call_helper(a, (void *)jit_intrinsic, i);
+    emit_byte(a, 0x85);  // test eax, eax
+    emit_byte(a, 0xc0);
+    jcc_to_pc(a, CC_NE, pc + 2);
+    return 1;
+  case OP_PUSHENV:
+    call_helper(a, (void *)jit_push_env, i);
+    mov_load(a, R14, R12, offsetof(CallFrame, env));
+    return 1;
+  case OP_POPENV:
+    mov_load(a, R14, R14, offsetof(Environment, parent));
+    mov_store(a, R12, offsetof(CallFrame, env), R14);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static const int saved_registers[] = {RBX, R12, R13, R14, R15};
+#define SAVED_REGISTER_COUNT 5
+
+static void emit_prologue(Assembler *a) {
+  for (int r = 0; r < SAVED_REGISTER_COUNT; r++) {
+    push_reg(a, saved_registers[r]);
+  }
+  mov_reg(a, RBX, RDI);
+  mov_reg(a, R12, RSI);
+  mov_reg(a, R13, RDX);
+  mov_load(a, R14, R12, offsetof(CallFrame, env));
+  mov_imm64(a, R15, QNAN);
+  emit_byte(a, 0xff);  // jmp rcx
+  emit_byte(a, 0xe1);
+  a->epilogue = a->count;
+  for (int r = SAVED_REGISTER_COUNT - 1; r >= 0; r--) {
+    pop_reg(a, saved_registers[r]);
+  }
+  emit_byte(a, 0xc3);
+}
+
+static void patch(Assembler *a, size_t at, size_t target) {
+  uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(at + 4));
+  memcpy(a->code + at, &rel, sizeof(rel));
+}
+
+void jit_compile(Chunk *chunk) {
+  Assembler a = {0};
+  size_t *offsets = malloc_safe(sizeof(size_t) * chunk->count, "jit offsets");
+  int *native = malloc_safe(sizeof(int) * chunk->count, "jit native");
+  emit_prologue(&a);
+  for (size_t pc = 0; pc < chunk->count; pc++) {
+    offsets[pc] = a.count;
+    native[pc] = compile_instruction(&a, chunk, pc);
+    if (!native[pc]) {
+      exit_at(&a, pc);
+    }
+    if (GET_OP(chunk->code[pc]) == OP_BINARY) {
+      // The operator word that follows is never jumped to.
+      offsets[++pc] = a.count;
+      native[pc] = 0;
+    }
+  }
+  for (size_t f = 0; f < a.fixup_count; f++) {
+    Fixup *fixup = &a.fixups[f];
+    if (!fixup->is_exit) {
+      patch(&a, fixup->at, offsets[fixup->target]);
+      continue;
+    }
+    patch(&a, fixup->at, a.count);
+    mov_imm32(&a, RAX, fixup->target);
+    emit_byte(&a, 0xe9);
+    emit_u32(&a, 0);
+    patch(&a, a.count - 4, a.epilogue);
+  }
+
+  unsigned char *memory = mmap(NULL, a.count, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED) {
+    memcpy(memory, a.code, a.count);
+    if (mprotect(memory, a.count, PROT_READ | PROT_EXEC) == 0) {
+      JitCode *code = malloc_safe(sizeof(JitCode), "JitCode");
+      code->memory = memory;
+      code->size = a.count;
+      code->function = (JitFunction)(void *)memory;
+      code->entries = malloc_safe(sizeof(void *) * chunk->count, "jit entries");
+      for (size_t pc = 0; pc < chunk->count; pc++) {
+        code->entries[pc] = native[pc] ? memory + offsets[pc] : NULL;
+      }
+      code->guard_failures = 0;
+      chunk->jit = code;
+    } else {
+      munmap(memory, a.count);
+    }
+  }
+  free_safe(a.code);
+  free_safe(a.fixups);
+  free_safe(offsets);
+  free_safe(native);
+}
+
+// Code that keeps meeting other types than it was compiled for is dropped;
+// the chunk's hotness is past the threshold by then, so it stays
+// interpreted.
+Instruction *jit_run(CallFrame *frame, Instruction *ip) {
+  Chunk *chunk = frame->chunk;
+  JitCode *code = chunk->jit;
+  void *target = code->entries[ip - chunk->code];
+  if (target == NULL) {
+    return ip;
+  }
+  uint32_t exit =
+      code->function(frame->regs, frame, chunk->constants, target);
+  if ((exit & 1) && ++code->guard_failures > JIT_MAX_GUARD_FAILURES) {
+    jit_free(code);
+    chunk->jit = NULL;
+  }
+  return chunk->code + (exit >> 1);
+}
+
+void jit_free(JitCode *code) {
+  if (code == NULL) {
+    return;
+  }
+  munmap(code->memory, code->size);
+  free_safe(code->entries);
+  free_safe(code);
+}
+
+#else
+
+// Other platforms always interpret; jit_compile leaves chunk->jit NULL.
+struct JitCode {
+  int unused;
+};
+
+void jit_compile(Chunk *chunk) {}
+
+Instruction *jit_run(CallFrame *frame, Instruction *ip) { return ip; }
+
+void jit_free(JitCode *code) {}
+
+#endif
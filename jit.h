@@ -0,0 +1,31 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "chunk.h"
+#include "vm.h"
+
+#define JIT_DEFAULT_THRESHOLD 1000
+// Type guard failures a chunk's native code may take before it is dropped
+// and the chunk stays interpreted.
+#define JIT_MAX_GUARD_FAILURES 64
+
+// Baseline compiler from bytecode to x86-64 (jit.c). A chunk is compiled
+// once it has been entered or has looped jit_threshold times; a threshold of
+// 0 turns the JIT off. The native code works on the frame's registers and
+// environment slots in place, so it can hand control back to the
+// interpreter before any instruction it does not handle or whose operands
+// are not numbers and booleans.
+extern unsigned long jit_threshold;
+
+void jit_configure(unsigned long threshold);
+void jit_compile(Chunk *chunk);
+Instruction *jit_run(CallFrame *frame, Instruction *ip);
+void jit_free(JitCode *code);
+
+static inline void jit_tick(Chunk *chunk) {
+  if (++chunk->hotness == jit_threshold) {
+    jit_compile(chunk);
+  }
+}
+
+#endif  // JIT_H
@@ -222,10 +222,10 @@ Token *tokenize(const char *sourceCode, size_t *tokenCount) {
       handle_operator(&src, &line, &column, "<<", &tokens, &capacity,
                       tokenCount, 2, BinaryOperatorTk);
     } else if (*src == '>' && *(src + 1) == '>') {
-      handle_operator(&src, &line, &column, "<<", &tokens, &capacity,
+      handle_operator(&src, &line, &column, ">>", &tokens, &capacity,
                       tokenCount, 2, BinaryOperatorTk);
     } else if (*src == '*' && *(src + 1) == '*') {
-      handle_operator(&src, &line, &column, "<<", &tokens, &capacity,
+      handle_operator(&src, &line, &column, "**", &tokens, &capacity,
                       tokenCount, 2, BinaryOperatorTk);
     } else if (*src == '%') {
       handle_operator(&src, &line, &column, "%", &tokens, &capacity, tokenCount,
@@ -286,6 +286,12 @@ Token *tokenize(const char *sourceCode, size_t *tokenCount) {
         reserved = BooleanLiteralTk;
       } else if (!strcmp(ident, "nil")) {
         reserved = NilTk;
+      } else if (!strcmp(ident, "break")) {
+        reserved = BreakTk;
+      } else if (!strcmp(ident, "continue")) {
+        reserved = ContinueTk;
+      } else if (!strcmp(ident, "return")) {
+        reserved = ReturnTk;
       } else if (!strchr(ident, '.')) {
         reserved = IdentifierTk;
       }
@@ -33,7 +33,10 @@ typedef enum {
   AsTk,                // 26
   DotTk,               // 27
   UnaryOperatorTk,     // 28
-  EOFTk                // 29
+  BreakTk,             // 29
+  ContinueTk,          // 30
+  ReturnTk,            // 31
+  EOFTk                // 32
 } TokenType;
 
 typedef struct {
@@ -8,24 +8,27 @@
 #include "builtins.h"
 #include "env.h"
 #include "eval.h"
+#include "gc.h"
 #include "global.h"
+#include "jit.h"
 #include "lexer.h"
 #include "malloc_safe.h"
 #include "parser.h"
+#include "vm.h"
 
 #define MAX_LINE_LENGTH 1024
 
 void run_repl(Environment *env);
 void run_file(const char *source_code, Environment *env);
 
-ExecutionContext global_context = {0};
+ExecutionContext global_context = {.max_call_depth = DEFAULT_MAX_CALL_DEPTH};
 
 void run_file(const char *source_code, Environment *env) {
   size_t token_count;
   Token *tokens = tokenize(source_code, &token_count);
   Parser *parser = create_parser(tokens, token_count);
   Program *program = produce_ast(parser, source_code);
-  eval_program(program, env);
+  run_program(program, env);
   free_program(program);
   free_tokens(tokens, token_count);
   free_safe(parser);
@@ -52,38 +55,116 @@ void run_repl(Environment *env) {
     if (strlen(line) == 0 || (strlen(line) == 1 && line[0] == ';')) {
       continue;
     }
+    vm_reset();
+    eval_reset();
+    gc_reset_roots();
     if (setjmp(global_context.error_jmp) == 0) {
       size_t token_count;
       Token *tokens = tokenize(line, &token_count);
       Parser *parser = create_parser(tokens, token_count);
       Program *program = produce_ast(parser, line);
-      RuntimeVal *result = eval_program(program, env);
-      if (result->type != NIL_T) {
-        RuntimeVal *args[] = {result};
+      Value result = run_program(program, env);
+      if (!IS_NIL(result)) {
+        Value args[] = {result};
         builtin_println_value(env, args, 1);
       }
       free_program(program);
       free_tokens(tokens, token_count);
       free_safe(parser);
     }
+    gc_safe_point();
   }
   free_safe(line);
 }
 
+static int parse_options(int argc, char **argv, const char **filename) {
+  *filename = NULL;
+  size_t gc_threshold = GC_DEFAULT_THRESHOLD;
+  double gc_growth_factor = GC_DEFAULT_GROWTH_FACTOR;
+  size_t gc_nursery_size = GC_DEFAULT_NURSERY_SIZE;
+  for (int i = 1; i < argc; i++) {
+    char *end;
+    if (strcmp(argv[i], "--tree-walk") == 0) {
+      global_context.use_tree_walker = 1;
+    } else if (strcmp(argv[i], "--dump-bytecode") == 0) {
+      global_context.dump_bytecode = 1;
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      global_context.no_optimize = 1;
+    } else if (strcmp(argv[i], "--trace-inline") == 0) {
+      global_context.trace_inline = 1;
+    } else if (strcmp(argv[i], "--env-stats") == 0) {
+      global_context.env_stats = 1;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      jit_configure(0);
+    } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+      unsigned long threshold = strtoul(argv[i] + 16, &end, 10);
+      if (*end != '\0' || threshold == 0) {
+        fprintf(stderr, "Invalid JIT threshold: %s\n", argv[i] + 16);
+        return 0;
+      }
+      jit_configure(threshold);
+    } else if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+      global_context.max_call_depth = strtoul(argv[i] + 12, &end, 10);
+      if (*end != '\0' || global_context.max_call_depth == 0) {
+        fprintf(stderr, "Invalid call depth: %s\n", argv[i] + 12);
+        return 0;
+      }
+    } else if (strncmp(argv[i], "--gc-threshold=", 15) == 0) {
+      gc_threshold = strtoul(argv[i] + 15, &end, 10);
+      if (*end != '\0' || gc_threshold == 0) {
+        fprintf(stderr, "Invalid GC threshold: %s\n", argv[i] + 15);
+        return 0;
+      }
+    } else if (strncmp(argv[i], "--gc-growth=", 12) == 0) {
+      gc_growth_factor = strtod(argv[i] + 12, &end);
+      if (*end != '\0' || gc_growth_factor <= 1.0) {
+        fprintf(stderr, "Invalid GC growth factor: %s\n", argv[i] + 12);
+        return 0;
+      }
+    } else if (strncmp(argv[i], "--gc-nursery=", 13) == 0) {
+      gc_nursery_size = strtoul(argv[i] + 13, &end, 10);
+      if (*end != '\0' || gc_nursery_size == 0) {
+        fprintf(stderr, "Invalid GC nursery size: %s\n", argv[i] + 13);
+        return 0;
+      }
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 0;
+    } else if (*filename == NULL) {
+      *filename = argv[i];
+    }
+  }
+  gc_configure(gc_threshold, gc_growth_factor, gc_nursery_size);
+  return 1;
+}
+
 int main(int argc, char **argv) {
-  Environment *env = create_environment(NULL, "global");
+  const char *filename;
+  eval_init_stack(&filename);
+  if (!parse_options(argc, argv, &filename)) {
+    fprintf(stderr,
+            "Usage: %s [--tree-walk] [--dump-bytecode] [--no-opt] [--no-jit] "
+            "[--jit-threshold=COUNT] [--gc-threshold=BYTES] "
+            "[--gc-growth=FACTOR] [--gc-nursery=BYTES] [--max-depth=CALLS] "
+            "[--trace-inline] [--env-stats] [file]\n",
+            argv[0]);
+    return 1;
+  }
+
+  Environment *env = create_global_environment();
+  gc_set_globals(env);
   register_builtins(env);
-  declare_var(env, "nil", (RuntimeVal *)MK_NIL());
-  declare_var(env, "true", (RuntimeVal *)MK_BOOL(1));
-  declare_var(env, "false", (RuntimeVal *)MK_BOOL(0));
-  declare_var(env, "PI", (RuntimeVal *)MK_NUMBER(3.14159265359));
+  init_binary_operators();
+  declare_var(env, "nil", NIL_VAL);
+  declare_var(env, "true", TRUE_VAL);
+  declare_var(env, "false", FALSE_VAL);
+  declare_var(env, "PI", NUMBER_VAL(3.14159265359));
 
-  if (argc < 2) {
+  if (filename == NULL) {
     global_context.is_repl = 1;
     run_repl(env);
   } else {
     global_context.is_repl = 0;
-    const char *filename = argv[1];
     char *source_code = read_file(filename);
     if (!source_code) {
       return 1;
@@ -92,6 +173,13 @@ int main(int argc, char **argv) {
     free_safe(source_code);
   }
 
-  free_environment(env);
+  if (global_context.env_stats) {
+    fprintf(stderr,
+            "environments: %lu pooled, %lu allocated; "
+            "tables: %lu pooled, %lu allocated\n",
+            env_pool_stats.env_hits, env_pool_stats.env_misses,
+            env_pool_stats.table_hits, env_pool_stats.table_misses);
+  }
+  gc_free_all();
   return 0;
 }
@@ -5,32 +5,30 @@
 #include <string.h>
 
 #include "env.h"
+#include "gc.h"
 #include "global.h"
 #include "malloc_safe.h"
 #include "values.h"
 
 #define MATH_FUNC_1ARG(name, func)                                             \
-  static RuntimeVal *math_##name(Environment *env, RuntimeVal **args,          \
-                                 size_t arg_count) {                           \
-    if (arg_count != 1 || args[0]->type != NUMBER_T) {                         \
+  static Value math_##name(Environment *env, Value *args, size_t arg_count) {  \
+    if (arg_count != 1 || !IS_NUMBER(args[0])) {                               \
       error(#name "() expects one number argument");                           \
-      return (RuntimeVal *)MK_NIL();                                           \
+      return NIL_VAL;                                                          \
     }                                                                          \
-    double value = ((NumberVal *)args[0])->value;                              \
-    return (RuntimeVal *)MK_NUMBER(func(value));                               \
+    double value = AS_NUMBER(args[0]);                                         \
+    return NUMBER_VAL(func(value));                                            \
   }
 
 #define MATH_FUNC_2ARG(name, func)                                             \
-  static RuntimeVal *math_##name(Environment *env, RuntimeVal **args,          \
-                                 size_t arg_count) {                           \
-    if (arg_count != 2 || args[0]->type != NUMBER_T ||                         \
-        args[1]->type != NUMBER_T) {                                           \
+  static Value math_##name(Environment *env, Value *args, size_t arg_count) {  \
+    if (arg_count != 2 || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {        \
       error(#name "() expects two number arguments");                          \
-      return (RuntimeVal *)MK_NIL();                                           \
+      return NIL_VAL;                                                          \
     }                                                                          \
-    double value1 = ((NumberVal *)args[0])->value;                             \
-    double value2 = ((NumberVal *)args[1])->value;                             \
-    return (RuntimeVal *)MK_NUMBER(func(value1, value2));                      \
+    double value1 = AS_NUMBER(args[0]);                                        \
+    double value2 = AS_NUMBER(args[1]);                                        \
+    return NUMBER_VAL(func(value1, value2));                                   \
   }
 
 MATH_FUNC_1ARG(abs, fabs)
@@ -48,20 +46,20 @@ MATH_FUNC_2ARG(pow, pow)
 
 typedef struct {
   const char *name;
-  RuntimeVal *(*func)(Environment *, RuntimeVal **, size_t);
+  NativeFn func;
   size_t arg_count;
 } MathFunction;
 
 int compare_runtime_vals(const void *a, const void *b) {
-  RuntimeVal *val1 = *(RuntimeVal **)a;
-  RuntimeVal *val2 = *(RuntimeVal **)b;
+  Value val1 = *(Value *)a;
+  Value val2 = *(Value *)b;
 
-  if (val1->type != NUMBER_T || val2->type != NUMBER_T) {
+  if (!IS_NUMBER(val1) || !IS_NUMBER(val2)) {
     return 0;
   }
 
-  double num1 = ((NumberVal *)val1)->value;
-  double num2 = ((NumberVal *)val2)->value;
+  double num1 = AS_NUMBER(val1);
+  double num2 = AS_NUMBER(val2);
 
   if (num1 < num2)
     return -1;
@@ -70,24 +68,24 @@ int compare_runtime_vals(const void *a, const void *b) {
   return 0;
 }
 
-static RuntimeVal *math_list_min_max(char *op, Environment *env, RuntimeVal **args,
-                                size_t arg_count) {
-  if (arg_count != 1 || args[0]->type != LIST_T) {
+static Value math_list_min_max(char *op, Environment *env, Value *args,
+                               size_t arg_count) {
+  if (arg_count != 1 || value_type(args[0]) != LIST_T) {
     char error_message[100];
     snprintf(error_message, sizeof(error_message),
              "%s() expects one list argument.\n", op);
     error(error_message);
   }
 
-  ListVal *list = (ListVal *)args[0];
+  ListVal *list = AS_LIST(args[0]);
 
   if (list == NULL || list->size == 0) {
-    return (RuntimeVal *)MK_NIL();
+    return NIL_VAL;
   }
-  double min_max = ((NumberVal *)list->items[0])->value;
+  double min_max = AS_NUMBER(list->items[0]);
   for (size_t i = 1; i < list->size; i++) {
-    if (list->items[i]->type == NUMBER_T) {
-      double numVal = ((NumberVal *)list->items[i])->value;
+    if (IS_NUMBER(list->items[i])) {
+      double numVal = AS_NUMBER(list->items[i]);
       if (strcmp(op, "min") == 0) {
         if (i == 0 || numVal < min_max) {
           min_max = numVal;
@@ -99,87 +97,81 @@ static RuntimeVal *math_list_min_max(char *op, Environment *env, RuntimeVal **ar
       }
     }
   }
-  return (RuntimeVal *)MK_NUMBER(min_max);
+  return NUMBER_VAL(min_max);
 }
 
-static RuntimeVal *math_list_min(Environment *env, RuntimeVal **args,
-                                 size_t arg_count) {
+static Value math_list_min(Environment *env, Value *args, size_t arg_count) {
   return math_list_min_max("min", env, args, arg_count);
 }
 
-static RuntimeVal *math_list_max(Environment *env, RuntimeVal **args,
-                                 size_t arg_count) {
+static Value math_list_max(Environment *env, Value *args, size_t arg_count) {
   return math_list_min_max("max", env, args, arg_count);
 }
 
 
-static RuntimeVal *math_median(Environment *env, RuntimeVal **args,
-                               size_t arg_count) {
-  if (arg_count != 1 || args[0]->type != LIST_T) {
+static Value math_median(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 1 || value_type(args[0]) != LIST_T) {
     error("median() expects one list argument");
   }
 
-  ListVal *list = (ListVal *)args[0];
+  ListVal *list = AS_LIST(args[0]);
 
   if (list == NULL || list->size == 0) {
-    return (RuntimeVal *)MK_NUMBER(0);
+    return NUMBER_VAL(0);
   }
 
-  RuntimeVal **num_items = (RuntimeVal **)malloc_safe(
-      list->size * sizeof(RuntimeVal *), "math_median");
+  Value *num_items =
+      (Value *)malloc_safe(list->size * sizeof(Value), "math_median");
   size_t count = 0;
 
   for (size_t i = 0; i < list->size; i++) {
-    if (list->items[i]->type == NUMBER_T) {
+    if (IS_NUMBER(list->items[i])) {
       num_items[count++] = list->items[i];
     }
   }
 
   if (count == 0) {
     free_safe(num_items);
-    return (RuntimeVal *)MK_NUMBER(0);
+    return NUMBER_VAL(0);
   }
 
-  qsort(num_items, count, sizeof(RuntimeVal *), compare_runtime_vals);
+  qsort(num_items, count, sizeof(Value), compare_runtime_vals);
 
   double median;
   if (count % 2 == 1) {
-    median = ((NumberVal *)num_items[count / 2])->value;
+    median = AS_NUMBER(num_items[count / 2]);
   } else {
-    double middle1 = ((NumberVal *)num_items[(count / 2) - 1])->value;
-    double middle2 = ((NumberVal *)num_items[count / 2])->value;
+    double middle1 = AS_NUMBER(num_items[(count / 2) - 1]);
+    double middle2 = AS_NUMBER(num_items[count / 2]);
     median = (middle1 + middle2) / 2.0;
   }
 
   free_safe(num_items);
 
-  return (RuntimeVal *)MK_NUMBER(median);
+  return NUMBER_VAL(median);
 }
 
-static RuntimeVal *math_average(Environment *env, RuntimeVal **args,
-                                size_t arg_count) {
-  if (arg_count != 1 || args[0]->type != LIST_T) {
+static Value math_average(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 1 || value_type(args[0]) != LIST_T) {
     error("average() expects one list argument");
   }
-  ListVal *list = (ListVal *)args[0];
+  ListVal *list = AS_LIST(args[0]);
 
   if (list == NULL || list->size == 0) {
-    return (RuntimeVal *)MK_NUMBER(0);
+    return NUMBER_VAL(0);
   }
 
   double soma = 0.0;
   size_t count = 0;
 
   for (size_t i = 0; i < list->size; i++) {
-    RuntimeVal *item = list->items[i];
-    if (item->type == NUMBER_T) {
-      NumberVal *numVal = (NumberVal *)item;
-      soma += numVal->value;
+    Value item = list->items[i];
+    if (IS_NUMBER(item)) {
+      soma += AS_NUMBER(item);
       count++;
     }
   }
-  return (count > 0) ? (RuntimeVal *)MK_NUMBER(soma / count)
-                     : (RuntimeVal *)MK_NUMBER(0);
+  return (count > 0) ? NUMBER_VAL(soma / count) : NUMBER_VAL(0);
 }
 
 static MathFunction math_functions[] = {
@@ -197,52 +189,45 @@ void init_math_module(Environment *env) {
     char **params = (func->arg_count == 1) ? single_param : double_param;
     declare_var(
         env, func->name,
-        (RuntimeVal *)MK_NATIVE_FN(params, func->arg_count, func->func));
+        OBJ_VAL(MK_NATIVE_FN(params, func->arg_count, func->func)));
   }
   declare_var(env, "average",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, math_average));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, math_average)));
   declare_var(env, "median",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, math_median));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, math_median)));
   declare_var(env, "lmin",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, math_list_min));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, math_list_min)));
   declare_var(env, "lmax",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, math_list_max));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, math_list_max)));
 }
 
-typedef struct {
-  FILE *fp;
-  char *mode;
-} FileHandle;
-
-static RuntimeVal *file_open(Environment *env, RuntimeVal **args,
-                             size_t arg_count) {
-  if (arg_count != 2 || args[0]->type != STRING_T ||
-      args[1]->type != STRING_T) {
+static Value file_open(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 2 || value_type(args[0]) != STRING_T ||
+      value_type(args[1]) != STRING_T) {
     error("open() expects two string arguments: path and mode");
   }
 
-  char *path = ((StringVal *)args[0])->value;
-  char *mode = ((StringVal *)args[1])->value;
+  char *path = AS_STRING(args[0])->value;
+  char *mode = AS_STRING(args[1])->value;
 
   FILE *fp = fopen(path, mode);
   if (!fp) {
     error("Does not possible open the file");
   }
 
-  FileHandle *handle = malloc_safe(sizeof(FileHandle), "FileHandle");
+  FileHandle *handle = (FileHandle *)gc_allocate(sizeof(FileHandle), FILE_T);
   handle->fp = fp;
   handle->mode = strdup(mode);
 
-  return (RuntimeVal *)handle;
+  return OBJ_VAL(handle);
 }
 
-static RuntimeVal *file_close(Environment *env, RuntimeVal **args,
-                              size_t arg_count) {
+static Value file_close(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 1) {
     error("fClose() expect one argument of type file");
   }
 
-  FileHandle *handle = ((FileHandle *)args[0]);
+  FileHandle *handle = (FileHandle *)AS_OBJ(args[0]);
 
   if (handle->fp == NULL) {
     error("The file is already closed");
@@ -255,19 +240,18 @@ static RuntimeVal *file_close(Environment *env, RuntimeVal **args,
   if (fclose(handle->fp) != 0) {
     error("Error closing the file");
   }
-  free_safe(handle->mode);
-  free_safe(handle);
+  // The handle itself belongs to the collector.
+  handle->fp = NULL;
 
-  return (RuntimeVal *)MK_NIL();
+  return NIL_VAL;
 }
 
-static RuntimeVal *file_read(Environment *env, RuntimeVal **args,
-                             size_t arg_count) {
+static Value file_read(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 1) {
     error("fRead() expect one argument of type file");
   }
 
-  FileHandle *handle = (FileHandle *)args[0];
+  FileHandle *handle = (FileHandle *)AS_OBJ(args[0]);
   if (strcmp(handle->mode, "r") != 0 && strcmp(handle->mode, "r+") != 0) {
     error("The file does not open for reading");
   }
@@ -280,16 +264,17 @@ static RuntimeVal *file_read(Environment *env, RuntimeVal **args,
   size_t bytes_read = fread(content, 1, fsize, handle->fp);
   content[bytes_read] = '\0';
 
-  return (RuntimeVal *)MK_STRING(content);
+  Value result = OBJ_VAL(MK_STRING(content));
+  free_safe(content);
+  return result;
 }
 
-static RuntimeVal *file_readline(Environment *env, RuntimeVal **args,
-                                 size_t arg_count) {
+static Value file_readline(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 1) {
     error("fReadLine() expect one argument of type file");
   }
 
-  FileHandle *handle = (FileHandle *)args[0];
+  FileHandle *handle = (FileHandle *)AS_OBJ(args[0]);
   if (strcmp(handle->mode, "r") != 0 && strcmp(handle->mode, "r+") != 0) {
     error("The file does not open for reading");
   }
@@ -301,7 +286,7 @@ static RuntimeVal *file_readline(Environment *env, RuntimeVal **args,
   read = getline(&line, &len, handle->fp);
   if (read == -1) {
     free_safe(line);
-    return (RuntimeVal *)MK_NUMBER(-1);
+    return NUMBER_VAL(-1);
   }
 
   if (read > 0 && line[read - 1] == '\n') {
@@ -315,92 +300,88 @@ static RuntimeVal *file_readline(Environment *env, RuntimeVal **args,
 
   free_safe(line);
 
-  return (RuntimeVal *)MK_STRING(utf8_line);
+  Value result = OBJ_VAL(MK_STRING(utf8_line));
+  free_safe(utf8_line);
+  return result;
 }
 
-static RuntimeVal *file_write(Environment *env, RuntimeVal **args,
-                              size_t arg_count) {
+static Value file_write(Environment *env, Value *args, size_t arg_count) {
   if (arg_count != 2) {
     error("fWrite() expect two arguments: file and string");
   }
 
-  FileHandle *handle = (FileHandle *)args[0];
+  FileHandle *handle = (FileHandle *)AS_OBJ(args[0]);
   if (strcmp(handle->mode, "w") != 0 && strcmp(handle->mode, "w+") != 0 &&
       strcmp(handle->mode, "a") != 0 && strcmp(handle->mode, "a+") != 0) {
     error("The file does not open for writing");
   }
 
-  char *content = ((StringVal *)args[1])->value;
+  char *content = AS_STRING(args[1])->value;
   fputs(content, handle->fp);
 
-  return (RuntimeVal *)MK_NIL();
+  return NIL_VAL;
 }
 
-static RuntimeVal *file_seek(Environment *env, RuntimeVal **args,
-                             size_t arg_count) {
-  if (arg_count != 2 || args[1]->type != NUMBER_T) {
+static Value file_seek(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 2 || !IS_NUMBER(args[1])) {
     error("fSeek() expect two arguments: file and number");
   }
 
-  FileHandle *handle = (FileHandle *)args[0];
-  long offset = (long)((NumberVal *)args[1])->value;
+  FileHandle *handle = (FileHandle *)AS_OBJ(args[0]);
+  long offset = (long)AS_NUMBER(args[1]);
 
   fseek(handle->fp, offset, SEEK_SET);
 
-  return (RuntimeVal *)MK_NIL();
+  return NIL_VAL;
 }
 
-static RuntimeVal *file_exists(Environment *env, RuntimeVal **args,
-                               size_t arg_count) {
-  if (arg_count != 1 || args[0]->type != STRING_T) {
+static Value file_exists(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 1 || value_type(args[0]) != STRING_T) {
     error("fExists() expect one arguments: path");
   }
-  char *path = ((StringVal *)args[0])->value;
+  char *path = AS_STRING(args[0])->value;
   FILE *file = fopen(path, "r");
   if (file != NULL) {
     fclose(file);
-    return (RuntimeVal *)MK_BOOL(1);
+    return TRUE_VAL;
   }
-  return (RuntimeVal *)MK_BOOL(0);
+  return FALSE_VAL;
 }
 
-static RuntimeVal *file_delete(Environment *env, RuntimeVal **args,
-                               size_t arg_count) {
-  if (arg_count != 1 || args[0]->type != STRING_T) {
+static Value file_delete(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 1 || value_type(args[0]) != STRING_T) {
     error("fDelete() expect one arguments: path");
   }
-  char *path = ((StringVal *)args[0])->value;
+  char *path = AS_STRING(args[0])->value;
   if (remove(path) == 0) {
-    return (RuntimeVal *)MK_BOOL(1);
+    return TRUE_VAL;
   }
-  return (RuntimeVal *)MK_BOOL(0);
+  return FALSE_VAL;
 }
 
-static RuntimeVal *file_move(Environment *env, RuntimeVal **args,
-                             size_t arg_count) {
-  if (arg_count != 2 || args[0]->type != STRING_T ||
-      args[1]->type != STRING_T) {
+static Value file_move(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 2 || value_type(args[0]) != STRING_T ||
+      value_type(args[1]) != STRING_T) {
     error("fCopy() expect two path arguments");
   }
 
-  char *path1 = ((StringVal *)args[0])->value;
-  char *path2 = ((StringVal *)args[1])->value;
+  char *path1 = AS_STRING(args[0])->value;
+  char *path2 = AS_STRING(args[1])->value;
 
   if (rename(path1, path2) == 0) {
-    return (RuntimeVal *)MK_BOOL(1);
+    return TRUE_VAL;
   }
-  return (RuntimeVal *)MK_BOOL(0);
+  return FALSE_VAL;
 }
 
-static RuntimeVal *file_copy(Environment *env, RuntimeVal **args,
-                             size_t arg_count) {
-  if (arg_count != 2 || args[0]->type != STRING_T ||
-      args[1]->type != STRING_T) {
+static Value file_copy(Environment *env, Value *args, size_t arg_count) {
+  if (arg_count != 2 || value_type(args[0]) != STRING_T ||
+      value_type(args[1]) != STRING_T) {
     error("fCopy() expect two path arguments");
   }
 
-  char *path1 = ((StringVal *)args[0])->value;
-  char *path2 = ((StringVal *)args[1])->value;
+  char *path1 = AS_STRING(args[0])->value;
+  char *path2 = AS_STRING(args[1])->value;
 
   FILE *source, *destination;
   char *buffer;
@@ -413,7 +394,7 @@ static RuntimeVal *file_copy(Environment *env, RuntimeVal **args,
   if (source == NULL) {
     error("Does not possible open source the file");
     free_safe(buffer);
-    return (RuntimeVal *)MK_BOOL(0);
+    return FALSE_VAL;
   }
 
   destination = fopen(path2, "wb");
@@ -421,7 +402,7 @@ static RuntimeVal *file_copy(Environment *env, RuntimeVal **args,
     error("Does not possible open destination the file");
     fclose(source);
     free_safe(buffer);
-    return (RuntimeVal *)MK_BOOL(0);
+    return FALSE_VAL;
   }
 
   while ((bytesRead = fread(buffer, 1, bufferSize, source)) > 0) {
@@ -433,7 +414,7 @@ static RuntimeVal *file_copy(Environment *env, RuntimeVal **args,
 
   free_safe(buffer);
 
-  return (RuntimeVal *)MK_BOOL(1);
+  return TRUE_VAL;
 }
 
 void init_file_module(Environment *env) {
@@ -441,23 +422,23 @@ void init_file_module(Environment *env) {
   char *single_param[] = {"f"};
 
   declare_var(env, "open",
-              (RuntimeVal *)MK_NATIVE_FN(double_param, 2, file_open));
+              OBJ_VAL(MK_NATIVE_FN(double_param, 2, file_open)));
   declare_var(env, "fRead",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, file_read));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, file_read)));
   declare_var(env, "fExists",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, file_delete));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, file_delete)));
   declare_var(env, "fDelete",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, file_exists));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, file_exists)));
   declare_var(env, "fReadLine",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, file_readline));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, file_readline)));
   declare_var(env, "fWrite",
-              (RuntimeVal *)MK_NATIVE_FN(double_param, 2, file_write));
+              OBJ_VAL(MK_NATIVE_FN(double_param, 2, file_write)));
   declare_var(env, "fSeek",
-              (RuntimeVal *)MK_NATIVE_FN(double_param, 2, file_seek));
+              OBJ_VAL(MK_NATIVE_FN(double_param, 2, file_seek)));
   declare_var(env, "fCopy",
-              (RuntimeVal *)MK_NATIVE_FN(double_param, 2, file_copy));
+              OBJ_VAL(MK_NATIVE_FN(double_param, 2, file_copy)));
   declare_var(env, "fMove",
-              (RuntimeVal *)MK_NATIVE_FN(double_param, 2, file_move));
+              OBJ_VAL(MK_NATIVE_FN(double_param, 2, file_move)));
   declare_var(env, "fClose",
-              (RuntimeVal *)MK_NATIVE_FN(single_param, 1, file_close));
+              OBJ_VAL(MK_NATIVE_FN(single_param, 1, file_close)));
 }
\ No newline at end of file
@@ -9,9 +9,8 @@ typedef struct {
   void (*init_func)(Environment *env);
 } NativeModule;
 
-static RuntimeVal *math_abs(Environment *env, RuntimeVal **args, int arg_count);
-static RuntimeVal *math_sqrt(Environment *env, RuntimeVal **args,
-                             int arg_count);
+static Value math_abs(Environment *env, Value *args, size_t arg_count);
+static Value math_sqrt(Environment *env, Value *args, size_t arg_count);
 void init_math_module(Environment *env);
 void init_file_module(Environment *env);
 
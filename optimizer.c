@@ -0,0 +1,317 @@
+#include "optimizer.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "malloc_safe.h"
+#include "values.h"
+
+// Runs between the parser and the resolver, so the blocks it drops or
+// rewrites are never given slots. Only rewrites that cannot change what a
+// program prints or which errors it raises are done: an expression that
+// would fail at run time (a division by zero, a non-boolean condition, a
+// type mismatch) is left alone to fail there.
+
+static Stmt *optimize_node(Stmt *node);
+
+static void optimize_block(Stmt **body, size_t body_count) {
+  for (size_t i = 0; i < body_count; i++) {
+    body[i] = optimize_node(body[i]);
+  }
+}
+
+static Expr *optimize_expr(Expr *expr) {
+  return (Expr *)optimize_node(&(expr->stmt));
+}
+
+static void free_block(Stmt **body, size_t body_count) {
+  for (size_t i = 0; i < body_count; i++) {
+    free_stmt(body[i]);
+  }
+  free_safe(body);
+}
+
+// Every evaluation of the literal returns the same tenured string. It is
+// pinned so the collector keeps it for as long as the node exists;
+// free_expr unpins it.
+static Stmt *share_string(StringLiteral *str_literal) {
+  if (str_literal->constant == NULL) {
+    StringVal *constant = MK_TENURED_STRING(str_literal->value);
+    constant->base.pinned = 1;
+    str_literal->constant = &constant->base;
+  }
+  return &(str_literal->base.stmt);
+}
+
+static int is_number(Expr *expr) {
+  return expr->stmt.kind == NumericLiteralAst;
+}
+
+static double number_of(Expr *expr) { return ((NumericLiteral *)expr)->value; }
+
+// -0 would come back as the shared literal 0.
+static Stmt *make_number(double value) {
+  if (value == 0 && signbit(value)) {
+    return NULL;
+  }
+  return &(create_numeric_literal(value)->base.stmt);
+}
+
+static Stmt *fold_numbers(BinaryOperator operator, double a, double b) {
+  if (operator >= BIN_EACH_ADD) {
+    return NULL;
+  }
+  if ((operator == BIN_DIV && b == 0) ||
+      (operator == BIN_MOD && number_to_integer(b) == 0)) {
+    return NULL;
+  }
+  Value result =
+      eval_binary_expr_evaluated(NUMBER_VAL(a), NUMBER_VAL(b), operator);
+  if (IS_BOOL(result)) {
+    return &(create_boolean_literal(AS_BOOL(result))->base.stmt);
+  }
+  return make_number(AS_NUMBER(result));
+}
+
+static Stmt *fold_strings(BinaryOperator operator, StringLiteral *lhs,
+                          StringLiteral *rhs) {
+  if (operator != BIN_ADD) {
+    return NULL;
+  }
+  size_t lhs_length = strlen(lhs->value);
+  size_t rhs_length = strlen(rhs->value);
+  char *value = malloc_safe(lhs_length + rhs_length + 1, "fold_strings");
+  memcpy(value, lhs->value, lhs_length);
+  memcpy(value + lhs_length, rhs->value, rhs_length + 1);
+  StringLiteral *folded = create_string_literal(value);
+  free_safe(value);
+  return share_string(folded);
+}
+
+static Stmt *fold_binary(BinaryExpr *binop) {
+  binop->left = optimize_expr(binop->left);
+  binop->right = optimize_expr(binop->right);
+  Stmt *folded = NULL;
+  if (is_number(binop->left) && is_number(binop->right)) {
+    folded = fold_numbers(binop->operator, number_of(binop->left),
+                          number_of(binop->right));
+  } else if (binop->left->stmt.kind == StringLiteralAst &&
+             binop->right->stmt.kind == StringLiteralAst) {
+    folded = fold_strings(binop->operator, (StringLiteral *)binop->left,
+                          (StringLiteral *)binop->right);
+  }
+  if (folded == NULL) {
+    return &(binop->base.stmt);
+  }
+  free_stmt(&(binop->base.stmt));
+  return folded;
+}
+
+static Stmt *fold_unary(UnaryExpr *unary_expr) {
+  unary_expr->expr = optimize_expr(unary_expr->expr);
+  int negate = strcmp(unary_expr->operator, "-") == 0;
+  if (!is_number(unary_expr->expr) ||
+      (!negate && strcmp(unary_expr->operator, "+") != 0)) {
+    return &(unary_expr->base.stmt);
+  }
+  double value = number_of(unary_expr->expr);
+  Stmt *folded = make_number(negate ? -value : value);
+  if (folded == NULL) {
+    return &(unary_expr->base.stmt);
+  }
+  free_stmt(&(unary_expr->base.stmt));
+  return folded;
+}
+
+static int is_boolean(Expr *expr) {
+  return expr->stmt.kind == BooleanLiteralAst;
+}
+
+static int truth_of(Expr *expr) {
+  return is_number(expr) ? number_of(expr) != 0
+                         : ((BooleanLiteral *)expr)->value != 0;
+}
+
+// A literal left operand that decides the result drops the right one, which
+// would never run; two literal operands fold like any other operator.
+static Stmt *fold_logical(LogicalExpr *logical) {
+  logical->left = optimize_expr(logical->left);
+  logical->right = optimize_expr(logical->right);
+  Expr *left = logical->left;
+  Expr *right = logical->right;
+  if (!is_number(left) && !is_boolean(left)) {
+    return &(logical->base.stmt);
+  }
+  int is_or = logical->operator == BIN_OR;
+  int value;
+  if (truth_of(left) == is_or) {
+    value = is_or;
+  } else if (is_number(right) || is_boolean(right)) {
+    value = truth_of(right);
+  } else {
+    return &(logical->base.stmt);
+  }
+  free_stmt(&(logical->base.stmt));
+  return &(create_boolean_literal(value)->base.stmt);
+}
+
+// A '?' whose condition is a literal keeps only the branch that runs. The
+// surviving block stays an IfExpr with a `true` condition so that it still
+// gets its own scope; compile_if emits no test for it.
+static Stmt *prune_if(IfExpr *if_expr) {
+  if_expr->condition = optimize_expr(if_expr->condition);
+  optimize_block(if_expr->body, if_expr->body_count);
+  if (if_expr->else_if != NULL) {
+    Stmt *else_if = optimize_node((Stmt *)if_expr->else_if);
+    // A pruned '?' without an else is just nil, as is having no else at all.
+    if_expr->else_if =
+        else_if->kind == IfAst ? (struct IfExpr *)else_if : NULL;
+  }
+  optimize_block(if_expr->else_body, if_expr->else_body_count);
+
+  if (!is_boolean(if_expr->condition)) {
+    return &(if_expr->base.stmt);
+  }
+  if (((BooleanLiteral *)if_expr->condition)->value) {
+    if (if_expr->else_if != NULL) {
+      free_stmt((Stmt *)if_expr->else_if);
+      if_expr->else_if = NULL;
+    }
+    if (if_expr->else_body != NULL) {
+      free_block(if_expr->else_body, if_expr->else_body_count);
+      if_expr->else_body = NULL;
+      if_expr->else_body_count = 0;
+    }
+    return &(if_expr->base.stmt);
+  }
+
+  Stmt *replacement;
+  free_block(if_expr->body, if_expr->body_count);
+  if (if_expr->else_if != NULL) {
+    replacement = (Stmt *)if_expr->else_if;
+  } else if (if_expr->else_body != NULL) {
+    replacement = &(create_if(&(create_boolean_literal(1)->base),
+                              if_expr->else_body, if_expr->else_body_count,
+                              NULL, NULL, 0)
+                        ->base.stmt);
+  } else {
+    replacement = &(create_nil_literal()->base.stmt);
+  }
+  free_safe(if_expr);
+  return replacement;
+}
+
+static Stmt *optimize_node(Stmt *node) {
+  switch (node->kind) {
+  case StringLiteralAst: {
+    return share_string((StringLiteral *)node);
+  }
+  case UnaryExprAst: {
+    return fold_unary((UnaryExpr *)node);
+  }
+  case BinaryExprAst: {
+    return fold_binary((BinaryExpr *)node);
+  }
+  case VarDeclarationAst: {
+    VarDeclaration *var = (VarDeclaration *)node;
+    var->value = optimize_expr(var->value);
+    break;
+  }
+  case AssignVarAst: {
+    AssignVar *var = (AssignVar *)node;
+    var->value = optimize_expr(var->value);
+    break;
+  }
+  case AssignListVarAst: {
+    AssignListVar *var = (AssignListVar *)node;
+    var->value = optimize_expr(var->value);
+    var->index = optimize_expr(var->index);
+    break;
+  }
+  case AssignDictVarAst: {
+    AssignDictVar *var = (AssignDictVar *)node;
+    var->value = optimize_expr(var->value);
+    var->key = optimize_expr(var->key);
+    break;
+  }
+  case LogicalExprAst: {
+    return fold_logical((LogicalExpr *)node);
+  }
+  case IfAst: {
+    return prune_if((IfExpr *)node);
+  }
+  case WhileAst: {
+    WhileExpr *while_expr = (WhileExpr *)node;
+    while_expr->condition = optimize_expr(while_expr->condition);
+    optimize_block(while_expr->body, while_expr->body_count);
+    break;
+  }
+  case ForAst: {
+    ForExpr *for_expr = (ForExpr *)node;
+    for_expr->initialization = optimize_expr(for_expr->initialization);
+    for_expr->condition = optimize_expr(for_expr->condition);
+    for_expr->increment = optimize_expr(for_expr->increment);
+    optimize_block(for_expr->body, for_expr->body_count);
+    break;
+  }
+  case FuncDefAst: {
+    FuncDef *func_def = (FuncDef *)node;
+    optimize_block(func_def->body, func_def->body_count);
+    break;
+  }
+  case CallExprAst: {
+    CallExpr *call_expr = (CallExpr *)node;
+    call_expr->callee = optimize_expr(call_expr->callee);
+    for (size_t i = 0; i < call_expr->arg_count; i++) {
+      call_expr->arguments[i] = optimize_expr(call_expr->arguments[i]);
+    }
+    break;
+  }
+  case ListLiteralAst: {
+    ListLiteral *list_lit = (ListLiteral *)node;
+    for (size_t i = 0; i < list_lit->element_count; i++) {
+      list_lit->elements[i] = optimize_expr(list_lit->elements[i]);
+    }
+    break;
+  }
+  case DictLiteralAst: {
+    DictLiteral *dict_lit = (DictLiteral *)node;
+    for (size_t i = 0; i < dict_lit->element_count; i++) {
+      dict_lit->keys[i] = optimize_expr(dict_lit->keys[i]);
+      dict_lit->values[i] = optimize_expr(dict_lit->values[i]);
+    }
+    break;
+  }
+  case ListIndexAst: {
+    ListIndex *list_index = (ListIndex *)node;
+    list_index->list = optimize_expr(list_index->list);
+    list_index->start = optimize_expr(list_index->start);
+    if (list_index->is_slice && list_index->end != NULL) {
+      list_index->end = optimize_expr(list_index->end);
+    }
+    break;
+  }
+  case DictKeyAst: {
+    DictKey *dict_key = (DictKey *)node;
+    dict_key->dict = optimize_expr(dict_key->dict);
+    dict_key->key = optimize_expr(dict_key->key);
+    break;
+  }
+  case ReturnAst: {
+    ReturnExpr *return_expr = (ReturnExpr *)node;
+    return_expr->value = optimize_expr(return_expr->value);
+    break;
+  }
+  default: {
+    break;
+  }
+  }
+  return node;
+}
+
+void optimize_program(Program *program) {
+  optimize_block(program->body, program->body_count);
+}
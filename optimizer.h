@@ -0,0 +1,8 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "ast.h"
+
+void optimize_program(Program *program);
+
+#endif  // OPTIMIZER_H
@@ -38,6 +38,15 @@ Token expect(Parser *parser, TokenType type, const char *err) {
   return token;
 }
 
+BinaryOperator eat_binary_operator(Parser *parser) {
+  Token token = eat(parser);
+  BinaryOperator operator = binary_operator_from_string(token.value);
+  if (operator == BINARY_OPERATOR_COUNT) {
+    parser_error("Unknown binary operator", &token, BinaryOperatorTk);
+  }
+  return operator;
+}
+
 Stmt *parse_stmt(Parser *parser) {
   if (at(parser).type == ImportTk) {
     return parse_import_stmt(parser);
@@ -100,13 +109,13 @@ Expr *parse_logical_or(Parser *parser) {
     if (strcmp(token.value, "||") != 0) {
       break;
     }
-    char *operator= eat(parser).value;
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = parse_logical_and(parser);
     if (!right) {
       free_expr(left);
       return NULL;
     }
-    left = (Expr *)create_binary_expr(left, right, operator);
+    left = (Expr *)create_logical_expr(left, right, operator);
   }
   return left;
 }
@@ -120,13 +129,13 @@ Expr *parse_logical_and(Parser *parser) {
     if (strcmp(token.value, "&&") != 0) {
       break;
     }
-    char *operator= eat(parser).value;
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = parse_equality(parser);
     if (!right) {
       free_expr(left);
       return NULL;
     }
-    left = (Expr *)create_binary_expr(left, right, operator);
+    left = (Expr *)create_logical_expr(left, right, operator);
   }
   return left;
 }
@@ -140,7 +149,7 @@ Expr *parse_equality(Parser *parser) {
     if (strcmp(token.value, "==") != 0 && strcmp(token.value, "!=") != 0) {
       break;
     }
-    char *operator= eat(parser).value;
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = parse_comparison(parser);
     if (!right) {
       free_expr(left);
@@ -161,7 +170,7 @@ Expr *parse_comparison(Parser *parser) {
         strcmp(token.value, "<=") != 0 && strcmp(token.value, ">=") != 0) {
       break;
     }
-    char *operator= eat(parser).value;
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = parse_additive_expr(parser);
     if (!right) {
       free_expr(left);
@@ -193,7 +202,7 @@ Expr *parse_additive_expr(Parser *parser) {
          strcmp(token.value, "&+") != 0 && strcmp(token.value, "&-") != 0)) {
       break;
     }
-    char *operator= eat(parser).value;
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = parse_unary_expr(parser);
     if (!right) {
       free_expr(left);
@@ -215,7 +224,11 @@ Expr *parse_bitwise_expr(Parser *parser) {
         strcmp(token.value, "&e") != 0 && strcmp(token.value, "&^") != 0) {
       break;
     }
-    char *operator= eat(parser).value;
+    // `&&` and `||` bind loosest; see parse_logical_or.
+    if (strcmp(token.value, "&&") == 0 || strcmp(token.value, "||") == 0) {
+      break;
+    }
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = parse_multiplicative_expr(parser);
     left = (Expr *)create_binary_expr(left, right, operator);
   }
@@ -234,7 +247,7 @@ Expr *parse_multiplicative_expr(Parser *parser) {
          strcmp(token.value, "&/") != 0 && strcmp(token.value, "&%") != 0)) {
       break;
     }
-    char *operator= eat(parser).value;
+    BinaryOperator operator = eat_binary_operator(parser);
     Expr *right = (Expr *)parse_unary_expr(parser);
     if (!right) {
       free_expr(left);
@@ -518,6 +531,15 @@ Expr *parse_primary_expr(Parser *parser) {
   case LetTk: {
     return (Expr *)parse_var_declaration(parser);
   }
+  case BreakTk: {
+    return parse_break_expr(parser);
+  }
+  case ContinueTk: {
+    return parse_continue_expr(parser);
+  }
+  case ReturnTk: {
+    return parse_return_expr(parser);
+  }
   case SemiColonTk: {
     eat(parser);
     return parse_expr(parser);
@@ -565,6 +587,27 @@ Expr *parse_primary_expr(Parser *parser) {
   }
 }
 
+Expr *parse_break_expr(Parser *parser) {
+  eat(parser);
+  return (Expr *)create_jump_expr(BreakAst);
+}
+
+Expr *parse_continue_expr(Parser *parser) {
+  eat(parser);
+  return (Expr *)create_jump_expr(ContinueAst);
+}
+
+// `return` on its own, right before a ';' or the '}' closing the body,
+// returns nil.
+Expr *parse_return_expr(Parser *parser) {
+  eat(parser);
+  TokenType next = at(parser).type;
+  if (next == SemiColonTk || next == CloseBraceTk || next == EOFTk) {
+    return (Expr *)create_return_expr((Expr *)create_nil_literal());
+  }
+  return (Expr *)create_return_expr(parse_expr(parser));
+}
+
 Expr *parse_if_expr(Parser *parser) {
   expect(parser, OpenParenTk, "Expected '(' after '?' keyword.");
   Expr *cond = parse_expr(parser);
@@ -15,6 +15,7 @@ short int not_eof(Parser *parser);
 Token at(Parser *parser);
 Token eat(Parser *parser);
 Token expect(Parser *parser, TokenType type, const char *err);
+BinaryOperator eat_binary_operator(Parser *parser);
 Program *produce_ast(Parser *parser, const char *source_code);
 Stmt *parse_stmt(Parser *parser);
 Expr *parse_expr(Parser *parser);
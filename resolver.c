@@ -0,0 +1,638 @@
+#include "resolver.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "env.h"
+#include "global.h"
+#include "malloc_safe.h"
+
+// There is one Scope for every function, block or flat closure environment
+// that the evaluator and the VM create at run time, so a name found `depth`
+// scopes up lives `depth` environments up. The top level of a program has no
+// Scope: globals, module variables and REPL lines stay in hashed
+// environments. `visible` counts the names of the enclosing scope that are
+// bound whenever this one is entered; a scope that `repeats` runs its
+// declarations again in the same environment (a '#' loop).
+typedef struct Scope {
+  struct Scope *enclosing;
+  char **names;
+  size_t count;
+  FuncDef **functions;
+  size_t function_count;
+  size_t visible;
+  int repeats;
+} Scope;
+
+static void resolve_node(Scope *scope, Stmt *node);
+static void resolve_function(Scope *scope, FuncDef *func_def);
+
+// Loops around the node being resolved, up to the innermost function, and
+// functions around it; break and continue need the one, return the other.
+static int loop_depth = 0;
+static int function_depth = 0;
+
+static Scope *begin_scope(Scope *enclosing) {
+  Scope *scope = (Scope *)malloc_safe(sizeof(Scope), "Scope");
+  scope->enclosing = enclosing;
+  scope->names = NULL;
+  scope->count = 0;
+  scope->functions = NULL;
+  scope->function_count = 0;
+  scope->visible = enclosing != NULL ? enclosing->count : 0;
+  scope->repeats = 0;
+  return scope;
+}
+
+// Function bodies are resolved once the scope that declares them is
+// complete, so a nested function can call a sibling declared after it.
+static size_t end_scope(Scope *scope) {
+  for (size_t i = 0; i < scope->function_count; i++) {
+    resolve_function(scope, scope->functions[i]);
+  }
+  size_t slot_count = scope->count;
+  free_safe(scope->names);
+  free_safe(scope->functions);
+  free_safe(scope);
+  return slot_count;
+}
+
+static int declare(Scope *scope, char *name) {
+  if (scope == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < scope->count; i++) {
+    if (strcmp(scope->names[i], name) == 0) {
+      char error_message[100];
+      snprintf(error_message, sizeof(error_message),
+               "Cannot declare variable %s. It is already defined.\n", name);
+      error(error_message);
+    }
+  }
+  scope->names = realloc_safe(scope->names, sizeof(char *) * (scope->count + 1),
+                              "declare names");
+  scope->names[scope->count] = name;
+  return (int)scope->count++;
+}
+
+static void lookup(Scope *scope, const char *name, int *depth, int *slot) {
+  for (int d = 0; scope != NULL; scope = scope->enclosing, d++) {
+    for (size_t i = 0; i < scope->count; i++) {
+      if (strcmp(scope->names[i], name) == 0) {
+        *depth = d;
+        *slot = (int)i;
+        return;
+      }
+    }
+  }
+  *depth = -1;
+  *slot = -1;
+}
+
+static void resolve_block(Scope *scope, Stmt **body, size_t body_count) {
+  for (size_t i = 0; i < body_count; i++) {
+    resolve_node(scope, body[i]);
+  }
+}
+
+// The last statement of a function body is in tail position, and so is the
+// last statement of each branch of a '?' there. A call there may also be
+// returned explicitly.
+static void mark_tail_calls(Stmt **body, size_t body_count) {
+  if (body_count == 0) {
+    return;
+  }
+  Stmt *last = body[body_count - 1];
+  if (last->kind == ReturnAst) {
+    last = &(((ReturnExpr *)last)->value->stmt);
+  }
+  if (last->kind == CallExprAst) {
+    ((CallExpr *)last)->is_tail = 1;
+  }
+  for (IfExpr *if_expr = last->kind == IfAst ? (IfExpr *)last : NULL;
+       if_expr != NULL; if_expr = (IfExpr *)if_expr->else_if) {
+    mark_tail_calls(if_expr->body, if_expr->body_count);
+    if (if_expr->else_body != NULL) {
+      mark_tail_calls(if_expr->else_body, if_expr->else_body_count);
+    }
+  }
+}
+
+static void resolve_func_def(Scope *scope, FuncDef *func_def) {
+  func_def->slot = declare(scope, func_def->name);
+  if (scope == NULL) {
+    resolve_function(NULL, func_def);
+    return;
+  }
+  scope->functions =
+      realloc_safe(scope->functions,
+                   sizeof(FuncDef *) * (scope->function_count + 1),
+                   "resolve_func_def functions");
+  scope->functions[scope->function_count++] = func_def;
+}
+
+// A block gets its own environment only when it declares a variable, a
+// function or an import; any other block resolves in the enclosing scope and
+// runs in the enclosing environment.
+static int declares_names(Stmt **body, size_t body_count) {
+  for (size_t i = 0; i < body_count; i++) {
+    NodeType kind = body[i]->kind;
+    if (kind == VarDeclarationAst || kind == FuncDefAst || kind == ImportAst) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static Scope *begin_block(Scope *scope, int has_scope) {
+  return has_scope ? begin_scope(scope) : scope;
+}
+
+static size_t end_block(Scope *block_scope, int has_scope) {
+  return has_scope ? end_scope(block_scope) : 0;
+}
+
+static void resolve_if(Scope *scope, IfExpr *if_expr) {
+  if_expr->has_scope = declares_names(if_expr->body, if_expr->body_count);
+  Scope *if_scope = begin_block(scope, if_expr->has_scope);
+  resolve_node(if_scope, &(if_expr->condition->stmt));
+  resolve_block(if_scope, if_expr->body, if_expr->body_count);
+  if_expr->slot_count = end_block(if_scope, if_expr->has_scope);
+  if (if_expr->else_if != NULL) {
+    resolve_if(scope, (IfExpr *)if_expr->else_if);
+  }
+  if (if_expr->else_body != NULL) {
+    if_expr->else_has_scope =
+        declares_names(if_expr->else_body, if_expr->else_body_count);
+    Scope *else_scope = begin_block(scope, if_expr->else_has_scope);
+    resolve_block(else_scope, if_expr->else_body, if_expr->else_body_count);
+    if_expr->else_slot_count = end_block(else_scope, if_expr->else_has_scope);
+  }
+}
+
+static void resolve_while(Scope *scope, WhileExpr *while_expr) {
+  while_expr->has_scope =
+      declares_names(while_expr->body, while_expr->body_count);
+  Scope *while_scope = begin_block(scope, while_expr->has_scope);
+  if (while_expr->has_scope) {
+    while_scope->repeats = 1;
+  }
+  resolve_node(while_scope, &(while_expr->condition->stmt));
+  loop_depth++;
+  resolve_block(while_scope, while_expr->body, while_expr->body_count);
+  loop_depth--;
+  while_expr->slot_count = end_block(while_scope, while_expr->has_scope);
+}
+
+// Every name a loop may declare or assign, and whether it runs code (calls,
+// imports) that could assign anything else.
+typedef struct {
+  char **names;
+  size_t count;
+  int calls;
+} Effects;
+
+static void add_effect(Effects *effects, char *name) {
+  effects->names = realloc_safe(effects->names,
+                                sizeof(char *) * (effects->count + 1),
+                                "add_effect");
+  effects->names[effects->count++] = name;
+}
+
+static int has_effect(Effects *effects, const char *name) {
+  for (size_t i = 0; i < effects->count; i++) {
+    if (strcmp(effects->names[i], name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void collect_effects(Stmt *node, void *context) {
+  Effects *effects = (Effects *)context;
+  switch (node->kind) {
+  case VarDeclarationAst:
+    add_effect(effects, ((VarDeclaration *)node)->varname);
+    break;
+  case AssignVarAst:
+    add_effect(effects, ((AssignVar *)node)->varname);
+    break;
+  case AssignListVarAst:
+    add_effect(effects, ((AssignListVar *)node)->varname);
+    break;
+  case AssignDictVarAst:
+    add_effect(effects, ((AssignDictVar *)node)->varname);
+    break;
+  case FuncDefAst: {
+    FuncDef *func_def = (FuncDef *)node;
+    add_effect(effects, func_def->name);
+    for (size_t i = 0; i < func_def->param_count; i++) {
+      add_effect(effects, func_def->params[i]);
+    }
+    break;
+  }
+  case CallExprAst:
+  case ImportAst:
+    effects->calls = 1;
+    break;
+  default:
+    break;
+  }
+  visit_children(node, collect_effects, context);
+}
+
+static int is_invariant(Expr *expr, Effects *effects) {
+  switch (expr->stmt.kind) {
+  case NumericLiteralAst:
+  case BooleanLiteralAst:
+    return 1;
+  case IdentifierAst:
+    return !has_effect(effects, ((Identifier *)expr)->symbol);
+  case UnaryExprAst:
+    return is_invariant(((UnaryExpr *)expr)->expr, effects);
+  case BinaryExprAst:
+    return is_invariant(((BinaryExpr *)expr)->left, effects) &&
+           is_invariant(((BinaryExpr *)expr)->right, effects);
+  default:
+    return 0;
+  }
+}
+
+// Function bodies are skipped: a closure may run after the loop is over.
+static void mark_invariants(Stmt *node, void *context) {
+  if (node->kind == FuncDefAst) {
+    return;
+  }
+  if (node->kind == BinaryExprAst &&
+      is_invariant((Expr *)node, (Effects *)context)) {
+    ((BinaryExpr *)node)->invariant = 1;
+    return;
+  }
+  visit_children(node, mark_invariants, context);
+}
+
+static int is_counter(Expr *expr, int slot) {
+  return expr->stmt.kind == IdentifierAst &&
+         ((Identifier *)expr)->depth == 0 && ((Identifier *)expr)->slot == slot;
+}
+
+// Recognizes `@(let i = a; i < b; i = i + step)` (any ordering comparison,
+// or !=, and + or - a literal step) whose body leaves i alone, and marks
+// what the body and the bound cannot change while the loop runs.
+static void analyze_for(ForExpr *for_expr) {
+  Effects effects = {NULL, 0, 0};
+  visit_children(&(for_expr->base.stmt), collect_effects, &effects);
+  if (!effects.calls) {
+    visit_block(for_expr->body, for_expr->body_count, mark_invariants,
+                &effects);
+  }
+
+  Stmt *initialization = &(for_expr->initialization->stmt);
+  Expr *condition = for_expr->condition;
+  Stmt *increment = &(for_expr->increment->stmt);
+  if (initialization->kind != VarDeclarationAst ||
+      condition->stmt.kind != BinaryExprAst ||
+      increment->kind != AssignVarAst) {
+    free_safe(effects.names);
+    return;
+  }
+  VarDeclaration *counter = (VarDeclaration *)initialization;
+  BinaryExpr *test = (BinaryExpr *)condition;
+  AssignVar *update = (AssignVar *)increment;
+  BinaryExpr *next = (BinaryExpr *)update->value;
+  int compares = test->operator == BIN_LT || test->operator == BIN_LE ||
+                 test->operator == BIN_GT || test->operator == BIN_GE ||
+                 test->operator == BIN_NE;
+  int steps = update->value->stmt.kind == BinaryExprAst &&
+              (next->operator == BIN_ADD || next->operator == BIN_SUB) &&
+              is_counter(next->left, counter->slot) &&
+              next->right->stmt.kind == NumericLiteralAst;
+  if (counter->slot < 0 || !compares ||
+      !is_counter(test->left, counter->slot) || update->depth != 0 ||
+      update->slot != counter->slot || !steps) {
+    free_safe(effects.names);
+    return;
+  }
+
+  // The increment itself is the only assignment to i that is allowed.
+  Effects body_effects = {NULL, 0, 0};
+  visit_block(for_expr->body, for_expr->body_count, collect_effects,
+              &body_effects);
+  collect_effects(&(test->right->stmt), &body_effects);
+  if (!has_effect(&body_effects, counter->varname)) {
+    double step = ((NumericLiteral *)next->right)->value;
+    for_expr->counted = 1;
+    for_expr->step = next->operator == BIN_ADD ? step : -step;
+    for_expr->bound_invariant =
+        !effects.calls && is_invariant(test->right, &effects);
+  }
+  free_safe(body_effects.names);
+  free_safe(effects.names);
+}
+
+// Names assigned anywhere in the program being resolved. `calls` is set when
+// an import runs inside a block or function, where it declares names the
+// resolver never sees.
+static Effects rebinds;
+
+static void collect_rebinds(Stmt *node, void *context) {
+  Effects *effects = (Effects *)context;
+  if (node->kind == AssignVarAst) {
+    add_effect(effects, ((AssignVar *)node)->varname);
+  } else if (node->kind == ImportAst) {
+    effects->calls = 1;
+  }
+  visit_children(node, collect_rebinds, context);
+}
+
+// Every name a function body (nested functions included) reads or writes.
+static void collect_names(Stmt *node, void *context) {
+  Effects *effects = (Effects *)context;
+  switch (node->kind) {
+  case IdentifierAst:
+    add_effect(effects, ((Identifier *)node)->symbol);
+    break;
+  case AssignVarAst:
+    add_effect(effects, ((AssignVar *)node)->varname);
+    break;
+  case AssignListVarAst:
+    add_effect(effects, ((AssignListVar *)node)->varname);
+    break;
+  case AssignDictVarAst:
+    add_effect(effects, ((AssignDictVar *)node)->varname);
+    break;
+  default:
+    break;
+  }
+  visit_children(node, collect_names, context);
+}
+
+static int count_scopes(Scope *scope) {
+  int count = 0;
+  for (; scope != NULL; scope = scope->enclosing) {
+    count++;
+  }
+  return count;
+}
+
+// Whether the variable `depth` scopes up in `slot` already holds its value
+// when the definition of func_def runs, and keeps it from then on. The
+// function's own name counts, since it is bound before the copy is made.
+static int is_bound_once(Scope *scope, int depth, int slot, const char *name,
+                         FuncDef *func_def) {
+  if (has_effect(&rebinds, name)) {
+    return 0;
+  }
+  size_t bound = (size_t)func_def->slot + 1;
+  for (; depth > 0; depth--) {
+    bound = scope->visible;
+    scope = scope->enclosing;
+  }
+  return !scope->repeats && (size_t)slot < bound;
+}
+
+static int is_param(FuncDef *func_def, const char *name) {
+  for (size_t i = 0; i < func_def->param_count; i++) {
+    if (strcmp(func_def->params[i], name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A function defined inside another function or block would keep that whole
+// chain of environments alive and walk it for every free variable. When each
+// variable it takes from there is bound once (is_bound_once), the function
+// becomes a flat closure instead: the values are copied into an environment
+// of its own, described by the Scope returned here, and the rest of the chain
+// is skipped on the way to the top level. Otherwise returns NULL.
+static Scope *capture_scope(Scope *scope, FuncDef *func_def) {
+  if (scope == NULL || rebinds.calls) {
+    return NULL;
+  }
+  Effects used = {NULL, 0, 0};
+  visit_block(func_def->body, func_def->body_count, collect_names, &used);
+  Scope *captured = begin_scope(NULL);
+  Capture *captures = NULL;
+  int flat = 1;
+  for (size_t i = 0; i < used.count && flat; i++) {
+    int depth, slot;
+    lookup(captured, used.names[i], &depth, &slot);
+    if (depth >= 0 || is_param(func_def, used.names[i])) {
+      continue;
+    }
+    lookup(scope, used.names[i], &depth, &slot);
+    if (depth < 0) {
+      continue;
+    }
+    flat = is_bound_once(scope, depth, slot, used.names[i], func_def);
+    captures = realloc_safe(captures, sizeof(Capture) * (captured->count + 1),
+                            "capture_scope");
+    captures[captured->count] = (Capture){depth, slot};
+    declare(captured, used.names[i]);
+  }
+  free_safe(used.names);
+  if (!flat) {
+    free_safe(captures);
+    end_scope(captured);
+    return NULL;
+  }
+  func_def->flat = 1;
+  func_def->scope_depth = count_scopes(scope);
+  func_def->captures = captures;
+  func_def->capture_count = captured->count;
+  return captured;
+}
+
+static void resolve_function(Scope *scope, FuncDef *func_def) {
+  Scope *captured = capture_scope(scope, func_def);
+  Scope *func_scope = begin_scope(captured != NULL ? captured : scope);
+  if (captured == NULL && scope != NULL) {
+    func_scope->visible = (size_t)func_def->slot + 1;
+  }
+  for (size_t i = 0; i < func_def->param_count; i++) {
+    declare(func_scope, func_def->params[i]);
+  }
+  int enclosing_loops = loop_depth;
+  loop_depth = 0;
+  function_depth++;
+  resolve_block(func_scope, func_def->body, func_def->body_count);
+  function_depth--;
+  loop_depth = enclosing_loops;
+  func_def->slot_count = end_scope(func_scope);
+  if (captured != NULL) {
+    end_scope(captured);
+  }
+  mark_tail_calls(func_def->body, func_def->body_count);
+}
+
+static void resolve_for(Scope *scope, ForExpr *for_expr) {
+  Stmt *initialization = &(for_expr->initialization->stmt);
+  for_expr->has_scope = declares_names(&initialization, 1);
+  for_expr->body_has_scope =
+      declares_names(for_expr->body, for_expr->body_count);
+  Scope *for_scope = begin_block(scope, for_expr->has_scope);
+  resolve_node(for_scope, initialization);
+  resolve_node(for_scope, &(for_expr->condition->stmt));
+  Scope *body_scope = begin_block(for_scope, for_expr->body_has_scope);
+  loop_depth++;
+  resolve_block(body_scope, for_expr->body, for_expr->body_count);
+  loop_depth--;
+  for_expr->body_slot_count = end_block(body_scope, for_expr->body_has_scope);
+  resolve_node(for_scope, &(for_expr->increment->stmt));
+  for_expr->slot_count = end_block(for_scope, for_expr->has_scope);
+  analyze_for(for_expr);
+}
+
+static void resolve_node(Scope *scope, Stmt *node) {
+  switch (node->kind) {
+  case IdentifierAst: {
+    Identifier *ident = (Identifier *)node;
+    lookup(scope, ident->symbol, &ident->depth, &ident->slot);
+    if (ident->slot < 0) {
+      ident->name_id = intern_name(ident->symbol);
+    }
+    break;
+  }
+  case UnaryExprAst: {
+    resolve_node(scope, &(((UnaryExpr *)node)->expr->stmt));
+    break;
+  }
+  case BinaryExprAst: {
+    BinaryExpr *binop = (BinaryExpr *)node;
+    resolve_node(scope, &(binop->left->stmt));
+    resolve_node(scope, &(binop->right->stmt));
+    break;
+  }
+  case LogicalExprAst: {
+    LogicalExpr *logical = (LogicalExpr *)node;
+    resolve_node(scope, &(logical->left->stmt));
+    resolve_node(scope, &(logical->right->stmt));
+    break;
+  }
+  case VarDeclarationAst: {
+    VarDeclaration *var = (VarDeclaration *)node;
+    resolve_node(scope, &(var->value->stmt));
+    var->slot = declare(scope, var->varname);
+    break;
+  }
+  case AssignVarAst: {
+    AssignVar *var = (AssignVar *)node;
+    resolve_node(scope, &(var->value->stmt));
+    lookup(scope, var->varname, &var->depth, &var->slot);
+    break;
+  }
+  case AssignListVarAst: {
+    AssignListVar *var = (AssignListVar *)node;
+    resolve_node(scope, &(var->value->stmt));
+    resolve_node(scope, &(var->index->stmt));
+    lookup(scope, var->varname, &var->depth, &var->slot);
+    break;
+  }
+  case AssignDictVarAst: {
+    AssignDictVar *var = (AssignDictVar *)node;
+    resolve_node(scope, &(var->value->stmt));
+    resolve_node(scope, &(var->key->stmt));
+    lookup(scope, var->varname, &var->depth, &var->slot);
+    break;
+  }
+  case IfAst: {
+    resolve_if(scope, (IfExpr *)node);
+    break;
+  }
+  case WhileAst: {
+    resolve_while(scope, (WhileExpr *)node);
+    break;
+  }
+  case ForAst: {
+    resolve_for(scope, (ForExpr *)node);
+    break;
+  }
+  case FuncDefAst: {
+    resolve_func_def(scope, (FuncDef *)node);
+    break;
+  }
+  case CallExprAst: {
+    CallExpr *call_expr = (CallExpr *)node;
+    resolve_node(scope, &(call_expr->callee->stmt));
+    for (size_t i = 0; i < call_expr->arg_count; i++) {
+      resolve_node(scope, &(call_expr->arguments[i]->stmt));
+    }
+    Identifier *callee = (Identifier *)call_expr->callee;
+    if (callee->base.stmt.kind == IdentifierAst && callee->slot < 0) {
+      call_expr->intrinsic =
+          intrinsic_for(callee->symbol, call_expr->arg_count);
+    }
+    break;
+  }
+  case ListLiteralAst: {
+    ListLiteral *list_lit = (ListLiteral *)node;
+    for (size_t i = 0; i < list_lit->element_count; i++) {
+      resolve_node(scope, &(list_lit->elements[i]->stmt));
+    }
+    break;
+  }
+  case DictLiteralAst: {
+    DictLiteral *dict_lit = (DictLiteral *)node;
+    for (size_t i = 0; i < dict_lit->element_count; i++) {
+      resolve_node(scope, &(dict_lit->keys[i]->stmt));
+      resolve_node(scope, &(dict_lit->values[i]->stmt));
+    }
+    break;
+  }
+  case ListIndexAst: {
+    ListIndex *list_index = (ListIndex *)node;
+    resolve_node(scope, &(list_index->list->stmt));
+    resolve_node(scope, &(list_index->start->stmt));
+    if (list_index->is_slice && list_index->end != NULL) {
+      resolve_node(scope, &(list_index->end->stmt));
+    }
+    break;
+  }
+  case DictKeyAst: {
+    DictKey *dict_key = (DictKey *)node;
+    resolve_node(scope, &(dict_key->dict->stmt));
+    resolve_node(scope, &(dict_key->key->stmt));
+    break;
+  }
+  case BreakAst:
+  case ContinueAst: {
+    if (loop_depth == 0) {
+      error(node->kind == BreakAst ? "'break' outside of a loop.\n"
+                                   : "'continue' outside of a loop.\n");
+    }
+    break;
+  }
+  case ReturnAst: {
+    if (function_depth == 0) {
+      error("'return' outside of a function.\n");
+    }
+    resolve_node(scope, &(((ReturnExpr *)node)->value->stmt));
+    break;
+  }
+  default: {
+    // Literals, tables and imports reference no variables; imported names
+    // are declared by name and found through the dynamic lookup.
+    break;
+  }
+  }
+}
+
+// A resolver error in the REPL jumps out midway, so the state is reset on the
+// way in.
+void resolve_program(Program *program) {
+  loop_depth = 0;
+  function_depth = 0;
+  free_safe(rebinds.names);
+  rebinds = (Effects){NULL, 0, 0};
+  for (size_t i = 0; i < program->body_count; i++) {
+    if (program->body[i]->kind == AssignVarAst) {
+      add_effect(&rebinds, ((AssignVar *)program->body[i])->varname);
+    }
+    visit_children(program->body[i], collect_rebinds, &rebinds);
+  }
+  resolve_block(NULL, program->body, program->body_count);
+}
@@ -0,0 +1,8 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "ast.h"
+
+void resolve_program(Program *program);
+
+#endif  // RESOLVER_H
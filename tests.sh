@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs tests.zo on both engines, then checks that a runaway recursion stops
+# with the "Stack overflow" error instead of crashing the interpreter.
+# Usage: ./tests.sh [path to zox]
+
+zox=${1:-./zox}
+status=0
+
+for mode in "" --tree-walk; do
+  output=$("$zox" $mode tests.zo 2>&1)
+  echo "$output"
+  case "$output" in
+  *Fail:* | *Error:*)
+    echo "tests.zo failed ${mode:-on the VM}"
+    status=1
+    ;;
+  esac
+done
+
+program=$(mktemp)
+printf '$down(n) { 1 + down(n + 1) };\ndown(0)\n' >"$program"
+for mode in "" --tree-walk; do
+  output=$("$zox" $mode --max-depth=100 "$program" 2>&1)
+  if [ $? -ne 1 ] || [ "${output#*Stack overflow}" = "$output" ]; then
+    echo "no stack overflow error ${mode:-on the VM}: $output"
+    status=1
+  fi
+done
+rm -f "$program"
+
+exit $status
@@ -4,51 +4,54 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "gc.h"
 #include "malloc_safe.h"
 
-NilVal *MK_NIL() {
-  NilVal *val = (NilVal *)malloc_safe(sizeof(NilVal), "NilVal");
-  val->base.type = NIL_T;
-  return val;
-}
-
-BooleanVal *MK_BOOL(unsigned short int b) {
-  BooleanVal *val = (BooleanVal *)malloc_safe(sizeof(BooleanVal), "BooleanVal");
-  val->base.type = BOOLEAN_T;
-  val->value = b;
-  return val;
-}
-
-NumberVal *MK_NUMBER(double n) {
-  NumberVal *val = (NumberVal *)malloc_safe(sizeof(NumberVal), "NumberVal");
-  val->base.type = NUMBER_T;
-  val->value = n;
-  return val;
-}
-
+// Strings, lists and dicts start out young with their payload right behind
+// the header; the collector copies both out when the object is promoted.
 ListVal *MK_LIST(size_t capacity) {
-  ListVal *list = (ListVal *)malloc_safe(sizeof(ListVal), "ListVal");
-  list->base.type = LIST_T;
-  list->items = (RuntimeVal **)malloc_safe(sizeof(RuntimeVal *) * capacity,
-                                           "ListVal items");
+  ListVal *list = (ListVal *)gc_allocate_young(
+      sizeof(ListVal) + sizeof(Value) * capacity, LIST_T);
+  list->items = (Value *)(list + 1);
   list->size = 0;
   list->capacity = capacity;
   return list;
 }
 
-Entry *MK_ENTRY(const char *key, RuntimeVal *value) {
-  Entry *entry = malloc_safe(sizeof(Entry), "Entry");
-  entry->key = strdup(key);
+void list_reserve(ListVal *list, size_t capacity) {
+  if (list->base.young) {
+    Value *items = (Value *)gc_nursery_alloc(sizeof(Value) * capacity);
+    memcpy(items, list->items, sizeof(Value) * list->size);
+    list->items = items;
+  } else {
+    gc_track_bytes(sizeof(Value) * (capacity - list->capacity));
+    list->items = realloc_safe(list->items, sizeof(Value) * capacity,
+                               "list_reserve items");
+  }
+  list->capacity = capacity;
+}
+
+Entry *MK_ENTRY(DictVal *dict, const char *key, Value value) {
+  size_t key_length = strlen(key) + 1;
+  Entry *entry;
+  if (dict->base.young) {
+    entry = gc_nursery_alloc(sizeof(Entry) + key_length);
+    entry->key = (char *)(entry + 1);
+    memcpy(entry->key, key, key_length);
+  } else {
+    entry = malloc_safe(sizeof(Entry), "Entry");
+    gc_track_bytes(sizeof(Entry));
+    entry->key = strdup(key);
+  }
   entry->value = value;
   entry->next = NULL;
   return entry;
 }
 
 DictVal *MK_DICT(size_t capacity) {
-  DictVal *dict = (DictVal *)malloc_safe(sizeof(DictVal), "DictVal");
-  dict->base.type = DICT_T;
-  dict->entries =
-      (Entry **)malloc_safe(sizeof(Entry *) * capacity, "DictVal items");
+  DictVal *dict = (DictVal *)gc_allocate_young(
+      sizeof(DictVal) + sizeof(Entry *) * capacity, DICT_T);
+  dict->entries = (Entry **)(dict + 1);
   for (size_t i = 0; i < capacity; ++i) {
     dict->entries[i] = NULL;
   }
@@ -75,38 +78,56 @@ char *type_to_string(ValueType type) {
       return "table";
     case DICT_T:
       return "dict";
+    case FILE_T:
+      return "file";
+    case ENVIRONMENT_T:
+      return "environment";
     default:
       return "unknown";
   }
 }
 
 StringVal *MK_STRING(const char *str) {
-  StringVal *val = (StringVal *)malloc_safe(sizeof(StringVal), "StringVal");
-  val->base.type = STRING_T;
+  size_t length = strlen(str) + 1;
+  StringVal *val =
+      (StringVal *)gc_allocate_young(sizeof(StringVal) + length, STRING_T);
+  val->value = (char *)(val + 1);
+  memcpy(val->value, str, length);
+  return val;
+}
+
+// Allocated straight in the old space, for strings stored where no write
+// barrier runs, such as chunk constants.
+StringVal *MK_TENURED_STRING(const char *str) {
+  StringVal *val = (StringVal *)gc_allocate(sizeof(StringVal), STRING_T);
   val->value = strdup(str);
+  gc_track_bytes(strlen(str) + 1);
   return val;
 }
 
 FunctionVal *MK_FUNCTION(char **params, size_t param_count, Stmt **body,
                          size_t body_count, Environment *env,
-                         RuntimeVal *(*builtin_func)(Environment *env,
-                                                     RuntimeVal **args,
-                                                     size_t arg_count)) {
+                         NativeFn builtin_func) {
   FunctionVal *val =
-      (FunctionVal *)malloc_safe(sizeof(FunctionVal), "FunctionVal");
-  val->base.type = FUNCTION_T;
+      (FunctionVal *)gc_allocate(sizeof(FunctionVal), FUNCTION_T);
   val->params = params;
   val->param_count = param_count;
   val->body = body;
   val->body_count = body_count;
   val->env = env;
+  if (env != NULL) {
+    gc_write_barrier(&val->base, OBJ_VAL(env));
+  }
   val->builtin_func = builtin_func;
+  val->chunk = NULL;
+  val->slot_count = param_count;
+  val->region = 0;
   return val;
 }
 
 TableVal *MK_TABLE(char **columns, size_t column_count) {
-  TableVal *table = (TableVal *)malloc_safe(sizeof(TableVal), "TableVal");
-  table->base.type = TABLE_T;
+  TableVal *table = (TableVal *)gc_allocate(sizeof(TableVal), TABLE_T);
+  gc_track_bytes(sizeof(char *) * column_count);
   table->columns =
       (char **)malloc_safe(sizeof(char *) * column_count, "TableVal columns");
   for (size_t i = 0; i < column_count; i++) {
@@ -119,17 +140,16 @@ TableVal *MK_TABLE(char **columns, size_t column_count) {
   return table;
 }
 
-RuntimeVal *create_native_fn(char **params, size_t param_count,
-                             RuntimeVal *(*fn)(Environment *env,
-                                               RuntimeVal **args,
-                                               size_t arg_count)) {
-  FunctionVal *func_val = malloc_safe(sizeof(FunctionVal), "create_native_fn");
-  func_val->base.type = FUNCTION_T;
+RuntimeVal *create_native_fn(char **params, size_t param_count, NativeFn fn) {
+  FunctionVal *func_val =
+      (FunctionVal *)gc_allocate(sizeof(FunctionVal), FUNCTION_T);
   func_val->params = params;
   func_val->param_count = param_count;
   func_val->body = NULL;
   func_val->body_count = 0;
   func_val->env = NULL;
   func_val->builtin_func = fn;
+  func_val->chunk = NULL;
+  func_val->slot_count = 0;
   return (RuntimeVal *)func_val;
 }
\ No newline at end of file
@@ -1,11 +1,15 @@
 #include "ast.h"
 #include "env.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #ifndef VALUE_H
 #define VALUE_H
 
 typedef struct Environment Environment;  // Forward declaration
+typedef struct Chunk Chunk;              // Forward declaration
 
 typedef enum {
   NIL_T,
@@ -15,26 +19,110 @@ typedef enum {
   LIST_T,
   DICT_T,
   TABLE_T,
-  FUNCTION_T
+  FUNCTION_T,
+  FILE_T,
+  ENVIRONMENT_T,
+  VALUE_TYPE_COUNT
 } ValueType;
 
-typedef struct {
+// Header shared by every heap-allocated value. Old objects are linked through
+// `next` so the collector (gc.c) can sweep the ones it did not mark; a young
+// object that survived a minor collection has `marked` set and `next`
+// pointing at its promoted copy. A `pinned` old object is kept even when
+// nothing references it.
+typedef struct RuntimeVal {
   ValueType type;
+  unsigned char marked;
+  unsigned char young;
+  unsigned char remembered;
+  unsigned char pinned;
+  struct RuntimeVal *next;
 } RuntimeVal;
 
-typedef struct {
-  RuntimeVal base;
-} NilVal;
-
-typedef struct {
-  RuntimeVal base;
-  short int value;
-} BooleanVal;
-
-typedef struct {
-  RuntimeVal base;
-  double value;
-} NumberVal;
+// Values are NaN-boxed into 64 bits. Any double that does not have all the
+// QNAN bits set is a number. nil and the booleans are tags inside that quiet
+// NaN space, and heap objects additionally set the sign bit and keep their
+// pointer in the low 48 bits.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_EMPTY 4
+#define TAG_TAIL_CALL 5
+
+#define NIL_VAL ((Value)(QNAN | TAG_NIL))
+#define FALSE_VAL ((Value)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(QNAN | TAG_TRUE))
+// Internal marker for "no value" (e.g. an open slice end); never reaches
+// programs.
+#define EMPTY_VAL ((Value)(QNAN | TAG_EMPTY))
+// Internal marker returned by a tail call in the tree walker (eval.c).
+#define TAIL_CALL_VAL ((Value)(QNAN | TAG_TAIL_CALL))
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(n) number_to_value(n)
+#define OBJ_VAL(obj) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
+
+#define IS_NUMBER(v) (((v) & QNAN) != QNAN)
+#define IS_NIL(v) ((v) == NIL_VAL)
+#define IS_BOOL(v) (((v) | 1) == TRUE_VAL)
+#define IS_OBJ(v) (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_NUMBER(v) value_to_number(v)
+#define AS_BOOL(v) ((v) == TRUE_VAL)
+#define AS_OBJ(v) ((RuntimeVal *)(uintptr_t)((v) & ~(SIGN_BIT | QNAN)))
+
+static inline Value number_to_value(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+static inline double value_to_number(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+// Integer operators and indexes work on numbers as 64-bit integers,
+// truncating toward zero. A double holds every integer up to 2^53 exactly;
+// beyond the int64 range (and for NaN) the conversion saturates instead of
+// being undefined.
+static inline int64_t number_to_integer(double number) {
+  if (number >= 9223372036854775807.0) {
+    return INT64_MAX;
+  }
+  if (number < -9223372036854775807.0) {
+    return INT64_MIN;
+  }
+  return number == number ? (int64_t)number : 0;
+}
+
+#define AS_INTEGER(v) number_to_integer(AS_NUMBER(v))
+
+void gc_remember(RuntimeVal *object);
+
+// Must follow every store of a value into an object that may already be old
+// (environment slots, list items, dict entries, table rows).
+static inline void gc_write_barrier(RuntimeVal *owner, Value value) {
+  if (IS_OBJ(value) && AS_OBJ(value)->young && !owner->young &&
+      !owner->remembered) {
+    gc_remember(owner);
+  }
+}
+
+static inline ValueType value_type(Value value) {
+  if (IS_NUMBER(value)) {
+    return NUMBER_T;
+  }
+  if (IS_OBJ(value)) {
+    return AS_OBJ(value)->type;
+  }
+  return IS_NIL(value) ? NIL_T : BOOLEAN_T;
+}
 
 typedef struct {
   RuntimeVal base;
@@ -48,20 +136,22 @@ typedef struct {
   Stmt **body;
   size_t body_count;
   Environment *env;
-  RuntimeVal *(*builtin_func)(Environment *env, RuntimeVal **args,
-                              size_t arg_count);
+  Value (*builtin_func)(Environment *env, Value *args, size_t arg_count);
+  Chunk *chunk;  // bytecode for the VM, compiled on first call
+  size_t slot_count;
+  int region;  // see FuncDef.region
 } FunctionVal;
 
 typedef struct {
   RuntimeVal base;
-  RuntimeVal **items;
+  Value *items;
   size_t size;
   size_t capacity;
 } ListVal;
 
 typedef struct Entry {
   char *key;
-  RuntimeVal *value;
+  Value value;
   struct Entry *next;
 } Entry;
 
@@ -81,33 +171,34 @@ typedef struct {
   size_t capacity;
 } TableVal;
 
-typedef RuntimeVal *(*NativeFn)(Environment *env, RuntimeVal **args,
-                                int arg_count);
+typedef struct {
+  RuntimeVal base;
+  FILE *fp;
+  char *mode;
+} FileHandle;
+
+#define AS_STRING(v) ((StringVal *)AS_OBJ(v))
+#define AS_LIST(v) ((ListVal *)AS_OBJ(v))
+#define AS_DICT(v) ((DictVal *)AS_OBJ(v))
+#define AS_TABLE(v) ((TableVal *)AS_OBJ(v))
+#define AS_FUNCTION(v) ((FunctionVal *)AS_OBJ(v))
+
+typedef Value (*NativeFn)(Environment *env, Value *args, size_t arg_count);
 
-NilVal *MK_NIL();
-BooleanVal *MK_BOOL(unsigned short int b);
-NumberVal *MK_NUMBER(double n);
 StringVal *MK_STRING(const char *str);
-RuntimeVal *create_native_fn(char **params, size_t param_count,
-                             RuntimeVal *(*fn)(Environment *env,
-                                               RuntimeVal **args,
-                                               size_t arg_count));
+StringVal *MK_TENURED_STRING(const char *str);
+RuntimeVal *create_native_fn(char **params, size_t param_count, NativeFn fn);
 FunctionVal *MK_FUNCTION(char **params, size_t param_count, Stmt **body,
                          size_t body_count, Environment *env,
-                         RuntimeVal *(*builtin_func)(Environment *env,
-                                                     RuntimeVal **args,
-                                                     size_t arg_count));
+                         NativeFn builtin_func);
 ListVal *MK_LIST(size_t capacity);
 DictVal *MK_DICT(size_t capacity);
-Entry *MK_ENTRY(const char *key, RuntimeVal *value);
+Entry *MK_ENTRY(DictVal *dict, const char *key, Value value);
+void list_reserve(ListVal *list, size_t capacity);
 TableVal *MK_TABLE(char **columns, size_t column_count);
 
 char *type_to_string(ValueType type);
 
-void free_null(NilVal *val);
-void free_boolean(BooleanVal *val);
-void free_number(NumberVal *val);
-
 #define MK_NATIVE_FN(params, param_count, fn_ptr) \
   create_native_fn(params, param_count, fn_ptr)
 
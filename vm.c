@@ -0,0 +1,519 @@
+#include "vm.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "env.h"
+#include "eval.h"
+#include "gc.h"
+#include "global.h"
+#include "infer.h"
+#include "inliner.h"
+#include "jit.h"
+#include "malloc_safe.h"
+#include "optimizer.h"
+#include "resolver.h"
+#include "values.h"
+
+typedef struct {
+  Value *stack;
+  size_t stack_size;
+  CallFrame *frames;
+  size_t max_frames;
+  size_t frame_count;
+} VM;
+
+static VM vm = {NULL, 0, NULL, 0, 0};
+
+// The first free register is just past the window of the innermost frame, so
+// nested vm_execute calls (e.g. an import run from inside a function) keep
+// stacking on the same register file.
+static Value *stack_top() {
+  if (vm.frame_count == 0) {
+    return vm.stack;
+  }
+  CallFrame *top = &vm.frames[vm.frame_count - 1];
+  return top->regs + top->chunk->max_registers;
+}
+
+static CallFrame *push_frame(Chunk *chunk, Environment *env, Value *result) {
+  // Sized once from the call depth limit; the pages of a large stack are
+  // only touched as deep as the program actually recurses.
+  if (vm.stack == NULL) {
+    vm.max_frames = global_context.max_call_depth;
+    vm.stack_size = vm.max_frames * VM_REGISTERS_PER_FRAME;
+    vm.stack = malloc_safe(sizeof(Value) * vm.stack_size, "VM stack");
+    vm.frames = malloc_safe(sizeof(CallFrame) * vm.max_frames, "VM frames");
+  }
+  Value *regs = stack_top();
+  if (vm.frame_count >= vm.max_frames ||
+      regs + chunk->max_registers > vm.stack + vm.stack_size) {
+    error("Stack overflow: too many nested calls.\n");
+  }
+  // The collector scans every register below stack_top(), so a new window
+  // must not expose values left behind by an earlier call.
+  for (int r = 0; r < chunk->max_registers; r++) {
+    regs[r] = NIL_VAL;
+  }
+  CallFrame *frame = &vm.frames[vm.frame_count++];
+  frame->chunk = chunk;
+  frame->ip = chunk->code;
+  frame->regs = regs;
+  frame->env = env;
+  frame->result = result;
+  return frame;
+}
+
+// A tail call runs the callee in the caller's frame and register window; its
+// RETURN then hands the result straight to the caller's caller.
+static void replace_frame(CallFrame *frame, Chunk *chunk, Environment *env) {
+  if (frame->regs + chunk->max_registers > vm.stack + vm.stack_size) {
+    error("Stack overflow: too many nested calls.\n");
+  }
+  for (int r = 0; r < chunk->max_registers; r++) {
+    frame->regs[r] = NIL_VAL;
+  }
+  frame->chunk = chunk;
+  frame->ip = chunk->code;
+  frame->env = env;
+}
+
+static FunctionVal *check_callee(Value callee, size_t arg_count) {
+  if (value_type(callee) != FUNCTION_T) {
+    error("Attempted to call a non-function value.\n");
+  }
+  FunctionVal *func = AS_FUNCTION(callee);
+  if (arg_count != func->param_count) {
+    char error_message[100];
+    snprintf(error_message, sizeof(error_message),
+             "Function expected %ld arguments but got %ld.\n",
+             func->param_count, arg_count);
+    error(error_message);
+  }
+  return func;
+}
+
+static Environment *bind_arguments(FunctionVal *func, Value *args,
+                                   size_t arg_count) {
+  Environment *func_env =
+      create_local_environment(func->env, "func_env", func->slot_count);
+  for (size_t p = 0; p < arg_count; p++) {
+    define_slot(func_env, p, args[p]);
+  }
+  if (func->chunk == NULL) {
+    func->chunk = compile_function(func->body, func->body_count);
+  }
+  return func_env;
+}
+
+// With GCC/Clang every handler jumps straight to the next one through a label
+// table (threaded dispatch); other compilers fall back to a plain switch.
+#if defined(__GNUC__)
+#define VM_LOOP() VM_DISPATCH();
+#define VM_CASE(name) op_##name:
+#define VM_DISPATCH()                                                          \
+  do {                                                                         \
+    i = *ip++;                                                                 \
+    goto *dispatch_table[GET_OP(i)];                                           \
+  } while (0)
+#else
+#define VM_LOOP()                                                              \
+  dispatch:                                                                    \
+  i = *ip++;                                                                   \
+  switch (GET_OP(i))
+#define VM_CASE(name) case OP_##name:
+#define VM_DISPATCH() goto dispatch
+#endif
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    ip = frame->ip;                                                            \
+    R = frame->regs;                                                           \
+    K = frame->chunk->constants;                                               \
+  } while (0)
+
+// Native code (jit.c) takes over from ip when it handles the instruction
+// there, and returns where the interpreter has to go on.
+#define JIT_ENTER()                                                            \
+  do {                                                                         \
+    if (frame->chunk->jit != NULL) {                                           \
+      ip = jit_run(frame, ip);                                                 \
+    }                                                                          \
+  } while (0)
+
+#define RK(x) ((x) & RK_CONSTANT ? K[(x) & ~RK_CONSTANT] : R[x])
+#define NUM(v) AS_NUMBER(v)
+#define BOTH_NUMBERS(l, r) (IS_NUMBER(l) && IS_NUMBER(r))
+
+#define ARITH_OP(name, op, operator)                                           \
+  VM_CASE(name) {                                                              \
+    Value l = RK(GET_B(i));                                                    \
+    Value r = RK(GET_C(i));                                                    \
+    if (BOTH_NUMBERS(l, r)) {                                                  \
+      R[GET_A(i)] = NUMBER_VAL(NUM(l) op NUM(r));                              \
+    } else {                                                                   \
+      R[GET_A(i)] = eval_binary_expr_evaluated(l, r, operator);                \
+    }                                                                          \
+    VM_DISPATCH();                                                             \
+  }
+
+#define COMPARE_OP(name, op, operator)                                         \
+  VM_CASE(name) {                                                              \
+    Value l = RK(GET_B(i));                                                    \
+    Value r = RK(GET_C(i));                                                    \
+    if (BOTH_NUMBERS(l, r)) {                                                  \
+      R[GET_A(i)] = BOOL_VAL(NUM(l) op NUM(r));                                \
+    } else {                                                                   \
+      R[GET_A(i)] = eval_binary_expr_evaluated(l, r, operator);                \
+    }                                                                          \
+    VM_DISPATCH();                                                             \
+  }
+
+#define JUMP_IF_FALSE(name, message)                                           \
+  VM_CASE(name) {                                                              \
+    Value condition = R[GET_A(i)];                                             \
+    if (!IS_BOOL(condition)) {                                                 \
+      error(message);                                                          \
+    }                                                                          \
+    if (condition == FALSE_VAL) {                                              \
+      ip += GET_SBX(i);                                                        \
+    }                                                                          \
+    VM_DISPATCH();                                                             \
+  }
+
+// `&&` and `||` jump over their right operand once a number or boolean on
+// the left decides the result, which is then left in the register.
+#define JUMP_IF_DECIDED(name, result)                                          \
+  VM_CASE(name) {                                                              \
+    Value value = R[GET_A(i)];                                                 \
+    if ((IS_BOOL(value) && value == (result)) ||                               \
+        (IS_NUMBER(value) && (NUM(value) != 0) == ((result) == TRUE_VAL))) {   \
+      R[GET_A(i)] = (result);                                                  \
+      ip += GET_SBX(i);                                                        \
+    }                                                                          \
+    VM_DISPATCH();                                                             \
+  }
+
+static Value vm_execute(Chunk *chunk, Environment *env) {
+#if defined(__GNUC__)
+  static void *dispatch_table[] = {
+#define OPCODE_LABEL(name) &&op_##name,
+      OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+  };
+#endif
+  Value result = NIL_VAL;
+  size_t entry = vm.frame_count;
+  CallFrame *frame = push_frame(chunk, env, &result);
+  Instruction *ip;
+  Value *R;
+  Value *K;
+  Instruction i;
+  LOAD_FRAME();
+
+  VM_LOOP() {
+    VM_CASE(MOVE) {
+      R[GET_A(i)] = R[GET_B(i)];
+      VM_DISPATCH();
+    }
+    VM_CASE(LOADK) {
+      R[GET_A(i)] = K[GET_BX(i)];
+      VM_DISPATCH();
+    }
+    VM_CASE(LOADNIL) {
+      R[GET_A(i)] = NIL_VAL;
+      VM_DISPATCH();
+    }
+    VM_CASE(LOADBOOL) {
+      R[GET_A(i)] = BOOL_VAL(GET_B(i));
+      VM_DISPATCH();
+    }
+    VM_CASE(GETVAR) {
+      R[GET_A(i)] = lookup_name(frame->env, frame->chunk->names[GET_BX(i)],
+                                frame->chunk->name_ids[GET_BX(i)],
+                                &frame->chunk->name_caches[GET_BX(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(SETVAR) {
+      assign_var(frame->env, frame->chunk->names[GET_BX(i)], R[GET_A(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(DEFVAR) {
+      declare_var(frame->env, frame->chunk->names[GET_BX(i)], R[GET_A(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(GETLOCAL) {
+      R[GET_A(i)] = lookup_slot(frame->env, GET_B(i), GET_C(i));
+      VM_DISPATCH();
+    }
+    VM_CASE(SETLOCAL) {
+      assign_slot(frame->env, GET_B(i), GET_C(i), R[GET_A(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(DEFLOCAL) {
+      define_slot(frame->env, GET_BX(i), R[GET_A(i)]);
+      VM_DISPATCH();
+    }
+    ARITH_OP(ADD, +, BIN_ADD)
+    ARITH_OP(SUB, -, BIN_SUB)
+    ARITH_OP(MUL, *, BIN_MUL)
+    VM_CASE(DIV) {
+      Value l = RK(GET_B(i));
+      Value r = RK(GET_C(i));
+      if (BOTH_NUMBERS(l, r) && NUM(r) != 0) {
+        R[GET_A(i)] = NUMBER_VAL(NUM(l) / NUM(r));
+      } else {
+        R[GET_A(i)] = eval_binary_expr_evaluated(l, r, BIN_DIV);
+      }
+      VM_DISPATCH();
+    }
+    COMPARE_OP(LT, <, BIN_LT)
+    COMPARE_OP(LE, <=, BIN_LE)
+    COMPARE_OP(GT, >, BIN_GT)
+    COMPARE_OP(GE, >=, BIN_GE)
+    COMPARE_OP(EQ, ==, BIN_EQ)
+    COMPARE_OP(NE, !=, BIN_NE)
+    VM_CASE(BINARY) {
+      BinaryOperator operator = (BinaryOperator)*ip++;
+      R[GET_A(i)] = eval_binary_expr_evaluated(R[GET_B(i)], R[GET_C(i)],
+                                               operator);
+      VM_DISPATCH();
+    }
+    VM_CASE(UNM) {
+      Value value = R[GET_B(i)];
+      if (!IS_NUMBER(value)) {
+        error("Unary operator not applicable to non-number type");
+      }
+      R[GET_A(i)] = NUMBER_VAL(-NUM(value));
+      VM_DISPATCH();
+    }
+    VM_CASE(UPLUS) {
+      Value value = R[GET_B(i)];
+      if (!IS_NUMBER(value)) {
+        error("Unary operator not applicable to non-number type");
+      }
+      R[GET_A(i)] = value;
+      VM_DISPATCH();
+    }
+    VM_CASE(JMP) {
+      ip += GET_SBX(i);
+      VM_DISPATCH();
+    }
+    VM_CASE(LOOP) {
+      ip += GET_SBX(i);
+      gc_safe_point();
+      jit_tick(frame->chunk);
+      JIT_ENTER();
+      VM_DISPATCH();
+    }
+    JUMP_IF_FALSE(JMPFALSE_IF, "Condition of '?' must be a boolean.\n")
+    JUMP_IF_FALSE(JMPFALSE_WHILE, "Condition of '#' must be a boolean.\n")
+    JUMP_IF_FALSE(JMPFALSE_FOR, "Condition of '@' must be a boolean.\n")
+    JUMP_IF_DECIDED(JMPAND, FALSE_VAL)
+    JUMP_IF_DECIDED(JMPOR, TRUE_VAL)
+    VM_CASE(PUSHENV) {
+      frame->env = create_local_environment(
+          frame->env, scope_names[GET_A(i)], GET_BX(i));
+      VM_DISPATCH();
+    }
+    VM_CASE(POPENV) {
+      frame->env = frame->env->parent;
+      VM_DISPATCH();
+    }
+    VM_CASE(CLOSURE) {
+      FunctionProto *proto = frame->chunk->protos[GET_BX(i)];
+      FunctionVal *func =
+          MK_FUNCTION(proto->params, proto->param_count, proto->body,
+                      proto->body_count, frame->env, NULL);
+      func->chunk = proto->chunk;
+      func->slot_count = proto->slot_count;
+      if (proto->slot < 0) {
+        declare_var(frame->env, proto->name, OBJ_VAL(func));
+      } else {
+        define_slot(frame->env, proto->slot, OBJ_VAL(func));
+      }
+      if (proto->flat) {
+        func->env = create_closure_env(frame->env, proto->scope_depth,
+                                       proto->captures, proto->capture_count);
+        gc_write_barrier(&func->base, OBJ_VAL(func->env));
+      }
+      R[GET_A(i)] = OBJ_VAL(func);
+      VM_DISPATCH();
+    }
+    VM_CASE(INTRINSIC) {
+      if (is_intrinsic_callee(R[GET_A(i)], GET_B(i))) {
+        R[GET_A(i)] = run_intrinsic(GET_B(i), frame->env, &R[GET_A(i) + 1]);
+        ip++;
+      }
+      VM_DISPATCH();
+    }
+    VM_CASE(CALL) {
+      size_t arg_count = GET_B(i);
+      FunctionVal *func = check_callee(R[GET_A(i)], arg_count);
+      Value *args = &R[GET_A(i) + 1];
+      if (func->builtin_func != NULL) {
+        R[GET_A(i)] = func->builtin_func(frame->env, args, arg_count);
+        VM_DISPATCH();
+      }
+      Environment *func_env = bind_arguments(func, args, arg_count);
+      frame->ip = ip;
+      frame = push_frame(func->chunk, func_env, &R[GET_A(i)]);
+      LOAD_FRAME();
+      gc_safe_point();
+      jit_tick(frame->chunk);
+      JIT_ENTER();
+      VM_DISPATCH();
+    }
+    VM_CASE(TAILCALL) {
+      size_t arg_count = GET_B(i);
+      FunctionVal *func = check_callee(R[GET_A(i)], arg_count);
+      Value *args = &R[GET_A(i) + 1];
+      if (func->builtin_func != NULL) {
+        R[GET_A(i)] = func->builtin_func(frame->env, args, arg_count);
+        VM_DISPATCH();
+      }
+      Environment *func_env = bind_arguments(func, args, arg_count);
+      replace_frame(frame, func->chunk, func_env);
+      LOAD_FRAME();
+      gc_safe_point();
+      jit_tick(frame->chunk);
+      JIT_ENTER();
+      VM_DISPATCH();
+    }
+    VM_CASE(RETURN) {
+      *frame->result = R[GET_A(i)];
+      vm.frame_count--;
+      if (vm.frame_count == entry) {
+        return result;
+      }
+      frame = &vm.frames[vm.frame_count - 1];
+      LOAD_FRAME();
+      JIT_ENTER();
+      VM_DISPATCH();
+    }
+    VM_CASE(NEWLIST) {
+      R[GET_A(i)] = OBJ_VAL(MK_LIST(GET_BX(i)));
+      VM_DISPATCH();
+    }
+    VM_CASE(LISTAPPEND) {
+      ListVal *list = AS_LIST(R[GET_A(i)]);
+      size_t count = GET_C(i);
+      if (list->size + count > list->capacity) {
+        list_reserve(list, (list->size + count) * 2);
+      }
+      for (size_t j = 0; j < count; j++) {
+        list->items[list->size++] = R[GET_B(i) + j];
+        gc_write_barrier(&list->base, R[GET_B(i) + j]);
+      }
+      VM_DISPATCH();
+    }
+    VM_CASE(NEWDICT) {
+      R[GET_A(i)] = OBJ_VAL(MK_DICT(GET_BX(i) * 2));
+      VM_DISPATCH();
+    }
+    VM_CASE(DICTPUT) {
+      DictVal *dict = AS_DICT(R[GET_A(i)]);
+      Value *pairs = &R[GET_B(i)];
+      for (size_t j = 0; j < GET_C(i); j++) {
+        dict_set_val(dict, runtime_value_to_string(pairs[2 * j]),
+                     pairs[2 * j + 1]);
+      }
+      VM_DISPATCH();
+    }
+    VM_CASE(NEWTABLE) {
+      TableLiteral *table = (TableLiteral *)frame->chunk->nodes[GET_BX(i)];
+      R[GET_A(i)] = OBJ_VAL(MK_TABLE(table->columns, table->column_count));
+      VM_DISPATCH();
+    }
+    VM_CASE(INDEX) {
+      R[GET_A(i)] =
+          eval_index_evaluated(R[GET_B(i)], R[GET_C(i)], EMPTY_VAL, 0);
+      VM_DISPATCH();
+    }
+    VM_CASE(SLICE) {
+      R[GET_A(i)] = eval_index_evaluated(R[GET_B(i)], R[GET_C(i)],
+                                         R[GET_C(i) + 1], 1);
+      VM_DISPATCH();
+    }
+    VM_CASE(SLICEOPEN) {
+      R[GET_A(i)] =
+          eval_index_evaluated(R[GET_B(i)], R[GET_C(i)], EMPTY_VAL, 1);
+      VM_DISPATCH();
+    }
+    VM_CASE(GETKEY) {
+      R[GET_A(i)] = eval_dict_key_evaluated(R[GET_B(i)], R[GET_C(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(SETINDEX) {
+      ListVal *list = AS_LIST(R[GET_A(i)]);
+      list->items[AS_INTEGER(R[GET_B(i)])] = R[GET_C(i)];
+      gc_write_barrier(&list->base, R[GET_C(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(SETKEY) {
+      dict_set_val(AS_DICT(R[GET_A(i)]), AS_STRING(R[GET_B(i)])->value,
+                   R[GET_C(i)]);
+      VM_DISPATCH();
+    }
+    VM_CASE(EVALAST) {
+      frame->ip = ip;
+      R[GET_A(i)] = evaluate(frame->chunk->nodes[GET_BX(i)], frame->env);
+      VM_DISPATCH();
+    }
+  }
+  return result;
+}
+
+Value vm_run_program(Program *program, Environment *env) {
+  Chunk *chunk = compile_program(program);
+  if (global_context.dump_bytecode) {
+    disassemble_chunk(chunk, "program");
+  }
+  Value result = vm_execute(chunk, env);
+  free_chunk(chunk);
+  return result;
+}
+
+Value run_program(Program *program, Environment *env) {
+  if (!global_context.no_optimize) {
+    inline_program(program);
+    optimize_program(program);
+  }
+  resolve_program(program);
+  if (global_context.use_tree_walker) {
+    infer_types(program);
+    return eval_program(program, env);
+  }
+  return vm_run_program(program, env);
+}
+
+// Drops every frame left behind by a runtime error that longjmp'd out of the
+// dispatch loop.
+void vm_reset() { vm.frame_count = 0; }
+
+// Registers of every active frame, the environments they run in and the
+// constants of their chunks.
+void vm_mark_roots() {
+  for (Value *slot = vm.stack; slot < stack_top(); slot++) {
+    gc_mark_value(*slot);
+  }
+  for (size_t f = 0; f < vm.frame_count; f++) {
+    gc_mark_object(&vm.frames[f].env->base);
+    gc_mark_chunk(vm.frames[f].chunk);
+  }
+}
+
+// Chunk constants are never young.
+void vm_promote_roots() {
+  for (Value *slot = vm.stack; slot < stack_top(); slot++) {
+    gc_promote_slot(slot);
+  }
+  for (size_t f = 0; f < vm.frame_count; f++) {
+    gc_promote_env(vm.frames[f].env);
+  }
+}
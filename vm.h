@@ -0,0 +1,26 @@
+#ifndef VM_H
+#define VM_H
+
+#include "ast.h"
+#include "chunk.h"
+#include "env.h"
+#include "values.h"
+
+// The register file holds this many registers per allowed frame.
+#define VM_REGISTERS_PER_FRAME 16
+
+typedef struct {
+  Chunk *chunk;
+  Instruction *ip;
+  Value *regs;
+  Environment *env;
+  Value *result;
+} CallFrame;
+
+Value run_program(Program *program, Environment *env);
+Value vm_run_program(Program *program, Environment *env);
+void vm_reset();
+void vm_mark_roots();
+void vm_promote_roots();
+
+#endif  // VM_H